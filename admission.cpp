@@ -0,0 +1,70 @@
+//
+//  admission.cpp
+//  coroserver
+//
+
+#include "admission.h"
+
+namespace net {
+    boost::asio::io_service::id admission_service::id;
+
+    admission_service::admission_service(boost::asio::io_service &ios)
+    : boost::asio::io_service::service(ios)
+    , timer_(ios)
+    , overloaded_(false)
+    , delay_(0)
+    {}
+
+    void admission_service::start(const admission_options_t &options) {
+        if (started_ || options.target.count()<=0) return;
+        started_=true;
+        options_=options;
+        rejection_="HTTP/1.1 503 Service Unavailable\r\n"
+                   "Retry-After: "+std::to_string(options_.retry_after.count())+"\r\n"
+                   "Content-Length: 0\r\n"
+                   "Connection: close\r\n"
+                   "\r\n";
+        delays_=metrics::make_histogram("net_io_service_queue_delay_seconds", "Time from posting a handler to running it");
+        episodes_=metrics::make_counter("net_overload_episodes_total", "Times an io_service has become overloaded");
+        overloaded_gauge_=metrics::make_gauge("net_io_services_overloaded", "io_services shedding load");
+        probe();
+    }
+
+    void admission_service::shutdown_service() {
+        stopped_=true;
+        boost::system::error_code ec;
+        timer_.cancel(ec);
+    }
+
+    void admission_service::probe() {
+        timer_.expires_from_now(options_.probe_interval);
+        timer_.async_wait([this](const boost::system::error_code &ec) {
+            if (ec || stopped_) return;
+            // Queued behind everything already posted
+            clock_type::time_point posted=clock_type::now();
+            get_io_service().post([this, posted]() {
+                if (stopped_) return;
+                sample(std::chrono::duration_cast<std::chrono::microseconds>(clock_type::now()-posted));
+                probe();
+            });
+        });
+    }
+
+    void admission_service::sample(std::chrono::microseconds delay) {
+        delay_.store(delay.count(), std::memory_order_relaxed);
+        delays_.observe(delay.count());
+        if (delay<options_.target) {
+            first_above_=clock_type::time_point();
+            if (overloaded_.load(std::memory_order_relaxed)) {
+                overloaded_.store(false, std::memory_order_relaxed);
+                overloaded_gauge_.dec();
+            }
+        } else if (first_above_==clock_type::time_point()) {
+            first_above_=clock_type::now()+options_.interval;
+        } else if (clock_type::now()>=first_above_ && !overloaded_.load(std::memory_order_relaxed)) {
+            overloaded_.store(true, std::memory_order_relaxed);
+            overloaded_gauge_.inc();
+            episodes_.inc();
+        }
+    }
+}   // End of namespace net
@@ -0,0 +1,100 @@
+//
+//  admission.h
+//  coroserver
+//
+
+#ifndef __coroserver__admission__
+#define __coroserver__admission__
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include "metrics.h"
+
+namespace net {
+    /**
+     * Load shedding options
+     */
+    struct admission_options_t {
+        /**
+         * Queueing delay of the io_service to stay under, 0 disables load shedding
+         */
+        std::chrono::microseconds target=std::chrono::microseconds(0);
+        /**
+         * The io_service is overloaded once the delay has stayed above target this long
+         */
+        std::chrono::milliseconds interval=std::chrono::milliseconds(100);
+        /**
+         * Time between two samples of the delay
+         */
+        std::chrono::milliseconds probe_interval=std::chrono::milliseconds(10);
+        /**
+         * Retry-After of the responses to shed HTTP requests
+         */
+        std::chrono::seconds retry_after=std::chrono::seconds(1);
+    };
+
+    /**
+     * Admission control of an io_service
+     *
+     * The queueing delay, the time from posting a handler to running it, is sampled periodically.
+     * Like CoDel, a delay staying above the target for a whole interval means a standing queue,
+     * the io_service is overloaded from then on until a sample falls below the target again.
+     * Meanwhile the server stops accepting and HTTP requests are answered with a pre-rendered
+     * 503 instead of being handled, so the requests in flight keep their latency.
+     */
+    class admission_service : public boost::asio::io_service::service {
+    public:
+        static boost::asio::io_service::id id;
+
+        admission_service(boost::asio::io_service &ios);
+
+        /**
+         * Start sampling, later calls are ignored
+         */
+        void start(const admission_options_t &options);
+
+        inline bool overloaded() const
+        { return overloaded_.load(std::memory_order_relaxed); }
+
+        /**
+         * Last sampled queueing delay
+         */
+        inline std::chrono::microseconds queue_delay() const
+        { return std::chrono::microseconds(delay_.load(std::memory_order_relaxed)); }
+
+        inline const admission_options_t &options() const
+        { return options_; }
+
+        /**
+         * Complete "503 Service Unavailable" response with Retry-After, closing the connection
+         */
+        inline const std::string &rejection() const
+        { return rejection_; }
+
+    private:
+        typedef std::chrono::steady_clock clock_type;
+
+        virtual void shutdown_service();
+        void probe();
+        void sample(std::chrono::microseconds delay);
+
+        admission_options_t options_;
+        boost::asio::steady_timer timer_;
+        bool started_=false;
+        bool stopped_=false;
+        // Only touched by the probe, there is one in flight at a time
+        clock_type::time_point first_above_;
+        std::atomic<bool> overloaded_;
+        std::atomic<std::int64_t> delay_;
+        std::string rejection_;
+        metrics::histogram delays_;
+        metrics::counter episodes_;
+        metrics::gauge overloaded_gauge_;
+    };
+}   // End of namespace net
+
+#endif /* defined(__coroserver__admission__) */
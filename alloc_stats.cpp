@@ -0,0 +1,72 @@
+//
+//  alloc_stats.cpp
+//  coroserver
+//
+
+#include <cstdlib>
+#include <new>
+#include "alloc_stats.h"
+
+namespace net {
+    namespace {
+        // Zero-initialized POD, no TLS guard so it is safe to touch from operator new
+        thread_local alloc_stats_t stats_;
+    }   // End of anonymous namespace
+    
+    const alloc_stats_t &thread_alloc_stats()
+    { return stats_; }
+    
+#if defined(COROSERVER_ALLOC_STATS)
+    bool alloc_stats_enabled()
+    { return true; }
+    
+    namespace {
+        inline void *counted_alloc(std::size_t size) {
+            stats_.allocations++;
+            stats_.bytes+=size;
+            return std::malloc(size ? size : 1);
+        }
+        
+        inline void counted_free(void *p) {
+            if (!p) return;
+            stats_.deallocations++;
+            std::free(p);
+        }
+    }   // End of anonymous namespace
+#else
+    bool alloc_stats_enabled()
+    { return false; }
+#endif
+}   // End of namespace net
+
+#if defined(COROSERVER_ALLOC_STATS)
+void *operator new(std::size_t size) {
+    void *p=net::counted_alloc(size);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+
+void *operator new[](std::size_t size) {
+    void *p=net::counted_alloc(size);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept
+{ return net::counted_alloc(size); }
+
+void *operator new[](std::size_t size, const std::nothrow_t &) noexcept
+{ return net::counted_alloc(size); }
+
+void operator delete(void *p) noexcept
+{ net::counted_free(p); }
+
+void operator delete[](void *p) noexcept
+{ net::counted_free(p); }
+
+void operator delete(void *p, const std::nothrow_t &) noexcept
+{ net::counted_free(p); }
+
+void operator delete[](void *p, const std::nothrow_t &) noexcept
+{ net::counted_free(p); }
+#endif
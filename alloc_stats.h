@@ -0,0 +1,35 @@
+//
+//  alloc_stats.h
+//  coroserver
+//
+
+#ifndef alloc_stats_h_included
+#define alloc_stats_h_included
+
+#include <cstddef>
+
+namespace net {
+    /**
+     * Heap allocation counters
+     */
+    struct alloc_stats_t {
+        std::size_t allocations;
+        std::size_t deallocations;
+        std::size_t bytes;
+    };
+    
+    /**
+     * Counters of the calling thread
+     *
+     * Global operator new/delete are only replaced with counting versions when built with
+     * COROSERVER_ALLOC_STATS, otherwise all counters stay 0
+     */
+    const alloc_stats_t &thread_alloc_stats();
+    
+    /**
+     * Returns true if the allocation counters are enabled
+     */
+    bool alloc_stats_enabled();
+}   // End of namespace net
+
+#endif  /* defined(alloc_stats_h_included) */
@@ -0,0 +1,207 @@
+//
+//  arena.h
+//  coroserver
+//
+
+#ifndef arena_h_included
+#define arena_h_included
+
+#include <cstddef>
+#include <cstring>
+#include <new>
+#include <string>
+#include <vector>
+#include <boost/utility/string_ref.hpp>
+
+namespace net {
+    /**
+     * Default size of the first arena block
+     */
+    constexpr std::size_t arena_block_size=4096;
+    constexpr std::size_t arena_alignment=alignof(long double);
+    
+    /**
+     * Monotonic memory arena
+     *
+     * Allocation bumps a pointer in the current block and deallocation does nothing, reset() releases
+     * everything at once. When the last round needed more than one block, reset() replaces them with
+     * one block big enough for all of them, so a steady workload ends up in one block that is reused
+     * forever without touching the heap.
+     */
+    class arena {
+    public:
+        explicit arena(std::size_t block_size=arena_block_size)
+        : head_(nullptr)
+        , ptr_(nullptr)
+        , end_(nullptr)
+        , block_size_(block_size)
+        , used_(0)
+        , blocks_allocated_(0)
+        {}
+        
+        // Non-copyable
+        arena(const arena&) = delete;
+        arena& operator=(const arena&) = delete;
+        
+        ~arena()
+        { release(); }
+        
+        /**
+         * Allocate n bytes aligned to align, which must be a power of 2
+         */
+        inline void *allocate(std::size_t n, std::size_t align=arena_alignment) {
+            char *p=align_up(ptr_, align);
+            if (!ptr_ || p+n>end_) {
+                grow(n+align);
+                p=align_up(ptr_, align);
+            }
+            ptr_=p+n;
+            used_+=n;
+            return p;
+        }
+        
+        /**
+         * Copy a string into the arena
+         */
+        inline boost::string_ref copy(const boost::string_ref &s) {
+            if (s.empty()) return boost::string_ref();
+            char *p=static_cast<char *>(allocate(s.size(), 1));
+            std::memcpy(p, s.data(), s.size());
+            return boost::string_ref(p, s.size());
+        }
+        
+        /**
+         * Release all allocations
+         */
+        inline void reset() {
+            if (head_ && head_->next) {
+                // Coalesce all blocks into one for the next round
+                std::size_t total=0;
+                for (block *b=head_; b; b=b->next) total+=b->size;
+                release();
+                block_size_=total;
+            }
+            if (head_) {
+                ptr_=head_->data();
+                end_=ptr_+head_->size;
+            }
+            used_=0;
+        }
+        
+        /**
+         * Bytes allocated since last reset
+         */
+        std::size_t used() const
+        { return used_; }
+        
+        /**
+         * Number of blocks requested from the heap during the lifetime of the arena
+         */
+        std::size_t blocks_allocated() const
+        { return blocks_allocated_; }
+        
+    private:
+        struct block {
+            block *next;
+            std::size_t size;
+            char *data()
+            { return reinterpret_cast<char *>(this)+header_size(); }
+            static constexpr std::size_t header_size()
+            { return (sizeof(block)+arena_alignment-1) & ~(arena_alignment-1); }
+        };
+        
+        static inline char *align_up(char *p, std::size_t align)
+        { return reinterpret_cast<char *>((reinterpret_cast<std::size_t>(p)+align-1) & ~(align-1)); }
+        
+        void grow(std::size_t min_size) {
+            std::size_t size=block_size_;
+            if (head_) size=head_->size*2;
+            if (size<min_size) size=min_size;
+            block *b=static_cast<block *>(::operator new(block::header_size()+size));
+            b->next=head_;
+            b->size=size;
+            head_=b;
+            ptr_=b->data();
+            end_=ptr_+size;
+            ++blocks_allocated_;
+        }
+        
+        void release() {
+            while (head_) {
+                block *next=head_->next;
+                ::operator delete(head_);
+                head_=next;
+            }
+            ptr_=end_=nullptr;
+        }
+        
+        block *head_;
+        char *ptr_;
+        char *end_;
+        std::size_t block_size_;
+        std::size_t used_;
+        std::size_t blocks_allocated_;
+    };
+    
+    /**
+     * STL allocator allocating from an arena
+     */
+    template<typename T>
+    struct arena_allocator {
+        typedef T value_type;
+        typedef T *pointer;
+        typedef const T *const_pointer;
+        typedef T &reference;
+        typedef const T &const_reference;
+        typedef std::size_t size_type;
+        typedef std::ptrdiff_t difference_type;
+        
+        template<typename U>
+        struct rebind {
+            typedef arena_allocator<U> other;
+        };
+        
+        arena_allocator(arena &a)
+        : arena_(&a)
+        {}
+        
+        template<typename U>
+        arena_allocator(const arena_allocator<U> &other)
+        : arena_(other.arena_)
+        {}
+        
+        pointer allocate(size_type n, const void * =nullptr)
+        { return static_cast<pointer>(arena_->allocate(n*sizeof(T), alignof(T))); }
+        
+        void deallocate(pointer, size_type)
+        {}
+        
+        size_type max_size() const
+        { return size_type(-1)/sizeof(T); }
+        
+        template<typename U, typename... Args>
+        void construct(U *p, Args &&...args)
+        { ::new((void *)p) U(std::forward<Args>(args)...); }
+        
+        template<typename U>
+        void destroy(U *p)
+        { p->~U(); }
+        
+        template<typename U>
+        bool operator==(const arena_allocator<U> &other) const
+        { return arena_==other.arena_; }
+        
+        template<typename U>
+        bool operator!=(const arena_allocator<U> &other) const
+        { return arena_!=other.arena_; }
+        
+        arena *arena_;
+    };
+    
+    typedef std::basic_string<char, std::char_traits<char>, arena_allocator<char>> arena_string_t;
+    
+    template<typename T>
+    using arena_vector_t=std::vector<T, arena_allocator<T>>;
+}   // End of namespace net
+
+#endif  /* defined(arena_h_included) */
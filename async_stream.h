@@ -14,10 +14,22 @@
 #include <memory>
 #include <chrono>
 #include <utility>
+#include <array>
+#include <algorithm>
+#include <cstdint>
+#include <cerrno>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#endif
 #include <boost/asio/write.hpp>
 #include <boost/asio/spawn.hpp>
 #include <boost/asio/ip/tcp.hpp>
 #include <boost/asio/steady_timer.hpp>
+#include "timer_wheel.h"
+#include "stack_pool.h"
+#include "admission.h"
+#include "dns_cache.h"
 
 namespace net {
     /**
@@ -59,8 +71,6 @@ namespace net {
                                                boost::asio::yield_context yield)
         {
             using namespace boost::asio::ip;
-            boost::asio::io_service &ios=yield.handler_.dispatcher_.get_io_service();
-            tcp::resolver resolver(ios);
             size_t pos=endpoint_desc.find_last_of(':');
             std::string host;
             std::string port;
@@ -74,11 +84,13 @@ namespace net {
                 }
                 port.assign(endpoint_desc.begin()+pos+1, endpoint_desc.end());
             }
-            tcp::resolver::query query(host, port);
-            return *resolver.async_resolve(query, yield);
+            // Cached and coalesced with other coroutines resolving the same host
+            dns_query_t query={host, port, family_};
+            return *dns_cache::instance().resolve(query, yield)->begin();
         }
         
         std::string default_port_;
+        address_family family_=address_family::unspecified;
     };
     
     /*
@@ -135,6 +147,28 @@ namespace net {
         inline bool is_open() const
         { return sbuf_->is_open(); }
         
+        /**
+         * Number of bytes received and buffered but not read yet, never blocks
+         */
+        inline std::streamsize buffered_input() const
+        { return sbuf_->buffered_(); }
+        
+        /**
+         * Number of bytes written but not sent yet
+         */
+        inline std::streamsize buffered_output() const
+        { return sbuf_->pending_(); }
+        
+        /**
+         * Take the underlying stream descriptor out, the stream is closed afterwards and anything
+         * buffered is discarded
+         */
+        inline StreamDescriptor release() {
+            sbuf_->read_timer_.disarm();
+            sbuf_->write_timer_.disarm();
+            return std::move(sbuf_->sd_);
+        }
+        
         inline boost::asio::yield_context yield_context()
         { return sbuf_->yield_; }
         
@@ -148,27 +182,77 @@ namespace net {
         inline boost::asio::io_service &io_service()
         { return yield_context().handler_.dispatcher_.get_io_service(); }
         
+        /**
+         * Spawn new coroutine within the strand, its stack comes from stack_pool()
+         */
         template <typename Function>
         inline void spawn(BOOST_ASIO_MOVE_ARG(Function) function) {
-            boost::asio::spawn(strand(), BOOST_ASIO_MOVE_CAST(Function)(function));
+            net::spawn(strand(), BOOST_ASIO_MOVE_CAST(Function)(function), sbuf_->stack_pool_);
         }
         
-        inline int read_timeout() const
+        /**
+         * Stacks of the coroutines spawned from this stream, the default allocator is used without a pool
+         */
+        inline const stack_pool_ptr &stack_pool() const
+        { return sbuf_->stack_pool_; }
+        
+        inline void stack_pool(const stack_pool_ptr &pool)
+        { sbuf_->stack_pool_=pool; }
+        
+        /**
+         * Admission control of the io_service handling this stream, null if there's none
+         */
+        inline admission_service *admission() const
+        { return sbuf_->admission_; }
+        
+        inline void admission(admission_service *admission)
+        { sbuf_->admission_=admission; }
+        
+        inline timeout_t read_timeout() const
         { return sbuf_->read_timeout_; }
         
-        inline int write_timeout() const
+        inline timeout_t write_timeout() const
         { return sbuf_->write_timeout_; }
         
-        inline void read_timeout(int timeout)
+        inline void read_timeout(timeout_t timeout)
         { sbuf_->read_timeout_=timeout; }
         
-        inline void write_timeout(int timeout)
+        inline void write_timeout(timeout_t timeout)
         { sbuf_->write_timeout_=timeout; }
         
+        /**
+         * Write buffers in place with one gathering write, data pending in the output buffer goes first
+         *
+         * @param buffers the buffers to write, they must stay unchanged until the function returns
+         */
+        template<std::size_t N>
+        inline bool write_buffers(const std::array<boost::asio::const_buffer, N> &buffers)
+        {
+            if (sbuf_->gather_(buffers)==0) return true;
+            setstate(std::ios_base::badbit);
+            return false;
+        }
+        
+        /**
+         * Send part of a file, data pending in the output buffer goes first
+         *
+         * Uses sendfile() on Linux so the data goes from the page cache to the socket without
+         * being copied to user space, elsewhere it's read into the output buffer piece by piece
+         *
+         * @param fd file descriptor opened for reading, the file offset is not changed
+         */
+        inline bool send_file(int fd, std::uint64_t offset, std::uint64_t size)
+        {
+            // A partial file can't be taken back, the stream is unusable afterwards
+            if (sbuf_->sendfile_(fd, offset, size)==0) return true;
+            setstate(std::ios_base::badbit);
+            return false;
+        }
+        
     private:
         class async_streambuf : public std::streambuf {
         public:
-            typedef std::function<void(boost::system::error_code)> timeout_callback_t;
+            typedef wheel_timer::callback_t timeout_callback_t;
             /**
              * Constructor
              *
@@ -197,8 +281,12 @@ namespace net {
             , yield_(std::move(src.yield_))
             , buffer_in_(std::move(src.buffer_in_))
             , buffer_out_(std::move(src.buffer_out_))
+            , read_timeout_(src.read_timeout_)
+            , write_timeout_(src.write_timeout_)
             , read_timer_(std::move(src.read_timer_))
             , write_timer_(std::move(src.write_timer_))
+            , stack_pool_(std::move(src.stack_pool_))
+            , admission_(src.admission_)
             {}
             
             // Non-copyable
@@ -211,6 +299,12 @@ namespace net {
             inline bool is_open() const
             { return sd_.is_open(); }
             
+            inline std::streamsize buffered_() const
+            { return egptr()-gptr(); }
+            
+            inline std::streamsize pending_() const
+            { return pptr()-pbase(); }
+            
             inline void close() {
                 if(sd_.is_open()) {
                     boost::system::error_code ec;
@@ -254,7 +348,7 @@ namespace net {
             }
             
         private:
-            typedef boost::asio::steady_timer timer_t;
+            typedef wheel_timer timer_t;
             
             inline boost::asio::strand &strand()
             { return yield_.handler_.dispatcher_; }
@@ -263,15 +357,13 @@ namespace net {
             { return yield_.handler_.dispatcher_.get_io_service(); }
             
             inline size_t async_read_some_with_timeout(boost::system::error_code &ec) {
-                if (read_timeout_>0) {
-                    // Setup read timer
-                    read_timer_.expires_from_now(std::chrono::seconds(read_timeout_));
-                    read_timer_.async_wait(strand().wrap(read_timeout_callback_));
+                if (read_timeout_.count()>0) {
+                    // Only stores the deadline, the timer wheel checks it on its own tick
+                    read_timer_.arm(read_timeout_);
                     size_t ret=sd_.async_read_some(boost::asio::buffer(buffer_in_ + pb_size,
                                                                        bf_size - pb_size),
                                                    yield_[ec]);
-                    boost::system::error_code ec1;
-                    read_timer_.cancel(ec1);
+                    read_timer_.disarm();
                     return ret;
                 } else {
                     return sd_.async_read_some(boost::asio::buffer(buffer_in_ + pb_size,
@@ -280,22 +372,16 @@ namespace net {
                 }
             }
             
-            inline void async_write_with_timeout(boost::system::error_code &ec) {
-                if (write_timeout_>0) {
-                    // Setup write timer
-                    write_timer_.expires_from_now(std::chrono::seconds(write_timeout_));
-                    write_timer_.async_wait(strand().wrap(write_timeout_callback_));
-                    boost::asio::async_write(sd_,
-                                             boost::asio::const_buffers_1(pbase(),
-                                                                          pptr()-pbase()),
-                                             yield_[ec]);
-                    boost::system::error_code ec1;
-                    write_timer_.cancel(ec1);
+            template<typename ConstBufferSequence>
+            inline void async_write_with_timeout(const ConstBufferSequence &buffers,
+                                                 boost::system::error_code &ec)
+            {
+                if (write_timeout_.count()>0) {
+                    write_timer_.arm(write_timeout_);
+                    boost::asio::async_write(sd_, buffers, yield_[ec]);
+                    write_timer_.disarm();
                 } else {
-                    boost::asio::async_write(sd_,
-                                             boost::asio::const_buffers_1(pbase(),
-                                                                          pptr()-pbase()),
-                                             yield_[ec]);
+                    boost::asio::async_write(sd_, buffers, yield_[ec]);
                 }
             }
             
@@ -323,22 +409,85 @@ namespace net {
                 // Don't flush empty buffer
                 if(pptr()<=pbase()) return 0;
                 boost::system::error_code ec;
-                async_write_with_timeout(ec);
+                async_write_with_timeout(boost::asio::const_buffers_1(pbase(),
+                                                                      pptr()-pbase()),
+                                         ec);
+                setp(buffer_out_,
+                     buffer_out_ + bf_size - 1);
+                return ec ? traits_type::eof() : 0;
+            }
+            
+            template<std::size_t N>
+            inline int_type gather_(const std::array<boost::asio::const_buffer, N> &buffers) {
+                std::array<boost::asio::const_buffer, N+1> bufs;
+                bufs[0]=boost::asio::const_buffer(pbase(), pptr()-pbase());
+                std::copy(buffers.begin(), buffers.end(), bufs.begin()+1);
+                boost::system::error_code ec;
+                async_write_with_timeout(bufs, ec);
                 setp(buffer_out_,
                      buffer_out_ + bf_size - 1);
                 return ec ? traits_type::eof() : 0;
             }
             
+            inline int_type sendfile_(int fd, std::uint64_t offset, std::uint64_t size) {
+                if (nudge_()!=0) return traits_type::eof();
+#if defined(__linux__)
+                boost::system::error_code ec;
+                if (!sd_.native_non_blocking()) {
+                    sd_.native_non_blocking(true, ec);
+                    if (ec) return traits_type::eof();
+                }
+                while (size>0) {
+                    off_t off=offset;
+                    // Linux never transfers more than this at once
+                    ssize_t n=::sendfile(sd_.native_handle(), fd, &off, std::min<std::uint64_t>(size, 0x7ffff000));
+                    if (n>0) {
+                        offset+=n;
+                        size-=n;
+                        continue;
+                    }
+                    if (n==0) {
+                        // The file has been truncated
+                        return traits_type::eof();
+                    }
+                    if (errno==EINTR) continue;
+                    if (errno!=EAGAIN && errno!=EWOULDBLOCK) return traits_type::eof();
+                    // Socket buffer is full, wait until it's writable
+                    if (write_timeout_.count()>0) {
+                        write_timer_.arm(write_timeout_);
+                        sd_.async_write_some(boost::asio::null_buffers(), yield_[ec]);
+                        write_timer_.disarm();
+                    } else {
+                        sd_.async_write_some(boost::asio::null_buffers(), yield_[ec]);
+                    }
+                    if (ec) return traits_type::eof();
+                }
+                return 0;
+#else
+                while (size>0) {
+                    ssize_t n=::pread(fd, buffer_out_, std::min<std::uint64_t>(size, bf_size), offset);
+                    if (n<0 && errno==EINTR) continue;
+                    if (n<=0) return traits_type::eof();
+                    offset+=n;
+                    size-=n;
+                    boost::system::error_code ec;
+                    async_write_with_timeout(boost::asio::const_buffers_1(buffer_out_, n), ec);
+                    if (ec) return traits_type::eof();
+                }
+                return 0;
+#endif
+            }
+            
             StreamDescriptor sd_;
             boost::asio::yield_context yield_;
             char buffer_in_[bf_size];
             char buffer_out_[bf_size];
-            int read_timeout_=0;
-            int write_timeout_=0;
+            timeout_t read_timeout_=timeout_t(0);
+            timeout_t write_timeout_=timeout_t(0);
             timer_t read_timer_;
             timer_t write_timer_;
-            timeout_callback_t read_timeout_callback_;
-            timeout_callback_t write_timeout_callback_;
+            stack_pool_ptr stack_pool_;
+            admission_service *admission_=nullptr;
             
             friend class async_stream<StreamDescriptor>;
         };
@@ -373,12 +522,13 @@ namespace net {
             // NOTE: shared_ptr<async_streambuf> is needed here as the callback may happen *after* the destruction of async_stream
             // Cancelling in destructor is not reliable as the callback may already be posted in the queue hence not cancelable
             std::weak_ptr<async_streambuf> sbp(sbuf_);
-            sbuf_->read_timeout_callback_=[sbp](boost::system::error_code error){
-                if (!error && !sbp.expired()) sbp.lock()->close();
-            };
-            sbuf_->write_timeout_callback_=[sbp](boost::system::error_code error){
-                if (!error && !sbp.expired()) sbp.lock()->close();
+            typename async_streambuf::timeout_callback_t cb=[sbp](){
+                streambuf_ptr sb=sbp.lock();
+                if (sb) sb->close();
             };
+            // Timer wheel calls back on any thread, close the socket within the strand
+            sbuf_->read_timer_.callback(sbuf_->strand().wrap(cb));
+            sbuf_->write_timer_.callback(sbuf_->strand().wrap(cb));
         }
         
         streambuf_ptr sbuf_;
@@ -0,0 +1,407 @@
+//
+//  coroserver_bench.cpp
+//  coroserver
+//
+
+// Load generator for the demo server
+//
+// Each connection is a coroutine on the client io_service, sending keep-alive or pipelined HTTP
+// requests, or lines to the calculator. In open-loop mode requests are scheduled at a fixed rate
+// and latency is measured from the scheduled time, so a stalled server is charged for the
+// requests it held back (coordinated omission correction).
+//
+// Usage: coroserver-bench [--host H] [--port P] [--protocol http|calc] [--connections 16,64]
+//                         [--pipeline N] [--rate R] [--duration S] [--warmup S] [--path /]
+//                         [--expr 1+2*3] [--client-threads N] [--embedded --threads 1,2,4]
+//                         [--model shared|per-thread|work-stealing] [--csv file]
+//
+// --rate is the total requests per second over all connections, 0 runs closed-loop. With
+// --embedded the server runs in this process with a minimal handler, and --threads sweeps its
+// thread_pool_size; every combination of --threads and --connections is one run. --model picks
+// the threading model of the embedded server, run once per model to compare their dispatch
+// overhead and tail latency.
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <string>
+#include <memory>
+#include <fstream>
+#include <iostream>
+#include <boost/asio/spawn.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include "async_stream.h"
+#include "server.h"
+#include "http_protocol.h"
+#include "metrics.h"
+#include "calculator.h"
+
+namespace bench {
+    typedef std::chrono::steady_clock clock_type;
+
+    /**
+     * Log-linear latency histogram in nanoseconds, with less than 1% relative error
+     */
+    class histogram {
+    public:
+        typedef net::metrics::log_linear_buckets<7> buckets_t;
+        static constexpr std::size_t bucket_count=buckets_t::count;
+
+        histogram()
+        : counts_(bucket_count)
+        {}
+
+        void record(std::uint64_t v) {
+            counts_[buckets_t::bucket_of(v)]++;
+            count_++;
+            if (v>max_) max_=v;
+        }
+
+        void merge(const histogram &other) {
+            for (std::size_t i=0; i<bucket_count; i++)
+                counts_[i]+=other.counts_[i];
+            count_+=other.count_;
+            if (other.max_>max_) max_=other.max_;
+        }
+
+        std::uint64_t count() const
+        { return count_; }
+
+        std::uint64_t max() const
+        { return max_; }
+
+        /**
+         * Value at percentile p, 0 to 100
+         */
+        std::uint64_t percentile(double p) const {
+            if (count_==0) return 0;
+            std::uint64_t rank=static_cast<std::uint64_t>(std::ceil(p/100*count_));
+            if (rank==0) rank=1;
+            std::uint64_t seen=0;
+            for (std::size_t i=0; i<bucket_count; i++) {
+                seen+=counts_[i];
+                if (seen>=rank) return std::min(buckets_t::upper(i), max_);
+            }
+            return max_;
+        }
+
+    private:
+        std::vector<std::uint64_t> counts_;
+        std::uint64_t count_=0;
+        std::uint64_t max_=0;
+    };
+
+    struct options_t {
+        std::string host="127.0.0.1";
+        std::string port;
+        bool calc=false;
+        std::vector<std::size_t> connections{16};
+        std::vector<std::size_t> threads{1};
+        std::size_t pipeline=1;
+        double rate=0;
+        double duration=10;
+        double warmup=1;
+        std::string path="/";
+        std::string expr="1+2*3";
+        std::size_t client_threads=std::thread::hardware_concurrency();
+        bool embedded=false;
+        net::threading_model model=net::threading_model::shared_io_service;
+        std::string csv;
+    };
+
+    struct result_t {
+        std::size_t threads;
+        std::size_t connections;
+        std::uint64_t requests=0;
+        std::uint64_t errors=0;
+        double seconds=0;
+        histogram latency;
+    };
+
+    /**
+     * State shared by the connections of one run
+     */
+    struct run_t {
+        const options_t &options;
+        clock_type::time_point start;
+        clock_type::time_point measure_from;
+        clock_type::time_point stop;
+        std::mutex mutex;
+        result_t &result;
+        std::atomic<std::uint64_t> errors;
+
+        run_t(const options_t &o, result_t &r)
+        : options(o)
+        , result(r)
+        , errors(0)
+        {}
+    };
+
+    /**
+     * Send one batch of requests and wait for their responses, returns false if the connection failed
+     */
+    bool http_batch(net::async_tcp_stream &s, http::request_t &req, http::response_t &resp, std::size_t n) {
+        for (std::size_t i=0; i<n; i++)
+            s << req;
+        s.flush();
+        for (std::size_t i=0; i<n; i++) {
+            resp.clear();
+            if (!http::parse_response(s, resp) || !resp.keep_alive())
+                return false;
+        }
+        return true;
+    }
+
+    bool calc_batch(net::async_tcp_stream &s, const std::string &line, std::string &reply, std::size_t n) {
+        for (std::size_t i=0; i<n; i++)
+            s << line << '\n';
+        s.flush();
+        for (std::size_t i=0; i<n; i++) {
+            if (!std::getline(s, reply) || reply=="Parse error")
+                return false;
+        }
+        return true;
+    }
+
+    void connection(run_t &run, std::size_t index, boost::asio::yield_context yield) {
+        const options_t &o=run.options;
+        histogram latency;
+        std::uint64_t requests=0;
+        try {
+            net::async_tcp_stream s(yield, o.host, o.port);
+            s.read_timeout(std::chrono::seconds(10));
+            s.write_timeout(std::chrono::seconds(10));
+            http::request_t req;
+            http::response_t resp;
+            std::string reply;
+            if (o.calc) {
+                // Greeting
+                std::getline(s, reply);
+            } else {
+                req.method(http::GET);
+                req.http_major(1);
+                req.http_minor(1);
+                req.path(o.path);
+                req.keep_alive(true);
+                req.add_header("Host", o.host);
+            }
+            // Open loop, every connection sends its share of the rate, spread over one interval
+            std::chrono::nanoseconds interval(0);
+            clock_type::time_point next=run.start;
+            if (o.rate>0) {
+                double per_connection=o.rate/run.result.connections;
+                interval=std::chrono::nanoseconds(static_cast<std::int64_t>(1e9*o.pipeline/per_connection));
+                next+=interval*index/run.result.connections;
+            }
+            boost::asio::steady_timer timer(s.io_service());
+            for (;;) {
+                clock_type::time_point sent;
+                if (o.rate>0) {
+                    if (next>=run.stop) break;
+                    if (clock_type::now()<next) {
+                        timer.expires_at(next);
+                        boost::system::error_code ec;
+                        timer.async_wait(yield[ec]);
+                    }
+                    // Measured from when the batch should have gone out, not when it did
+                    sent=next;
+                    next+=interval;
+                } else {
+                    sent=clock_type::now();
+                    if (sent>=run.stop) break;
+                }
+                bool ok=o.calc ? calc_batch(s, o.expr, reply, o.pipeline) : http_batch(s, req, resp, o.pipeline);
+                clock_type::time_point done=clock_type::now();
+                if (!ok) {
+                    run.errors++;
+                    break;
+                }
+                if (sent>=run.measure_from) {
+                    std::uint64_t ns=std::chrono::duration_cast<std::chrono::nanoseconds>(done-sent).count();
+                    for (std::size_t i=0; i<o.pipeline; i++)
+                        latency.record(ns);
+                    requests+=o.pipeline;
+                }
+            }
+            if (o.calc) s << "quit" << std::endl;
+        } catch(std::exception &e) {
+            run.errors++;
+        }
+        std::lock_guard<std::mutex> lock(run.mutex);
+        run.result.latency.merge(latency);
+        run.result.requests+=requests;
+    }
+
+    result_t run_once(const options_t &o, std::size_t threads, std::size_t connections) {
+        result_t result;
+        result.threads=threads;
+        result.connections=connections;
+
+        // The embedded server gets its own threads, the clients run on another io_service
+        std::unique_ptr<net::server> server;
+        std::thread server_thread;
+        if (o.embedded) {
+            net::protocol_handler_t handler;
+            if (o.calc) {
+                handler=&calculator::protocol_handler;
+            } else {
+                http::protocol_handler<> h;
+                h.set_request_handler([](http::session_t &session)->bool {
+                    session.response().headers().push_back("Content-Type", "text/plain");
+                    session.response().body_stream() << "Hello, World!\r\n";
+                    return true;
+                });
+                handler=h;
+            }
+            net::server_options_t server_options;
+            server_options.model=o.model;
+            server.reset(new net::server({{"127.0.0.1:"+o.port, handler}}, threads, server_options));
+            server_thread=std::thread([&server](){ (*server)(); });
+            // Give the acceptors a moment
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+
+        boost::asio::io_service ios;
+        run_t run(o, result);
+        run.start=clock_type::now();
+        run.measure_from=run.start+std::chrono::milliseconds(static_cast<std::int64_t>(o.warmup*1000));
+        run.stop=run.measure_from+std::chrono::milliseconds(static_cast<std::int64_t>(o.duration*1000));
+        for (std::size_t i=0; i<connections; i++) {
+            boost::asio::spawn(boost::asio::strand(ios),
+                               [&run, i](boost::asio::yield_context yield) { connection(run, i, yield); });
+        }
+        std::vector<std::thread> clients;
+        for (std::size_t i=0; i<std::max<std::size_t>(o.client_threads, 1); i++)
+            clients.emplace_back([&ios](){ ios.run(); });
+        for (std::thread &t : clients)
+            t.join();
+        result.seconds=std::chrono::duration<double>(std::min(clock_type::now(), run.stop)-run.measure_from).count();
+        result.errors=run.errors;
+
+        if (server) {
+            server->stop();
+            server_thread.join();
+        }
+        return result;
+    }
+
+    void print_header(std::ostream &os) {
+        char line[160];
+        snprintf(line, sizeof(line), "%8s %12s %12s %8s %12s %10s %10s %10s %10s %10s\n",
+                 "threads", "connections", "requests", "errors", "req/s",
+                 "p50 ms", "p90 ms", "p99 ms", "p99.9 ms", "max ms");
+        os << line;
+    }
+
+    void print(std::ostream &os, const result_t &r) {
+        char line[160];
+        const histogram &h=r.latency;
+        snprintf(line, sizeof(line), "%8zu %12zu %12llu %8llu %12.0f %10.3f %10.3f %10.3f %10.3f %10.3f\n",
+                 r.threads, r.connections,
+                 static_cast<unsigned long long>(r.requests), static_cast<unsigned long long>(r.errors),
+                 r.seconds>0 ? r.requests/r.seconds : 0.0,
+                 h.percentile(50)/1e6, h.percentile(90)/1e6, h.percentile(99)/1e6, h.percentile(99.9)/1e6, h.max()/1e6);
+        os << line;
+    }
+
+    const char *model_name(net::threading_model model) {
+        switch (model) {
+            case net::threading_model::io_service_per_thread:
+                return "per-thread";
+            case net::threading_model::work_stealing:
+                return "work-stealing";
+            default:
+                return "shared";
+        }
+    }
+
+    void write_csv(const options_t &o, const result_t &r) {
+        bool exists=std::ifstream(o.csv).good();
+        std::ofstream f(o.csv, std::ios::app);
+        if (!exists)
+            f << "protocol,embedded,model,threads,connections,pipeline,rate,requests,errors,seconds,rps,p50_us,p90_us,p99_us,p999_us,max_us\n";
+        const histogram &h=r.latency;
+        f << (o.calc ? "calc" : "http") << ',' << o.embedded << ',' << model_name(o.model) << ',' << r.threads << ',' << r.connections << ','
+          << o.pipeline << ',' << o.rate << ',' << r.requests << ',' << r.errors << ',' << r.seconds << ','
+          << (r.seconds>0 ? r.requests/r.seconds : 0.0) << ','
+          << h.percentile(50)/1e3 << ',' << h.percentile(90)/1e3 << ',' << h.percentile(99)/1e3 << ','
+          << h.percentile(99.9)/1e3 << ',' << h.max()/1e3 << '\n';
+    }
+
+    std::vector<std::size_t> parse_list(const std::string &s) {
+        std::vector<std::size_t> v;
+        std::size_t pos=0;
+        while (pos<s.size()) {
+            std::size_t comma=s.find(',', pos);
+            if (comma==std::string::npos) comma=s.size();
+            v.push_back(std::strtoul(s.substr(pos, comma-pos).c_str(), nullptr, 10));
+            pos=comma+1;
+        }
+        return v;
+    }
+
+    bool parse_options(int argc, const char *argv[], options_t &o) {
+        for (int i=1; i<argc; i++) {
+            std::string arg=argv[i];
+            if (arg=="--embedded") {
+                o.embedded=true;
+                continue;
+            }
+            if (i+1>=argc) return false;
+            std::string v=argv[++i];
+            if (arg=="--host") o.host=v;
+            else if (arg=="--port") o.port=v;
+            else if (arg=="--protocol") o.calc=(v=="calc");
+            else if (arg=="--connections") o.connections=parse_list(v);
+            else if (arg=="--threads") o.threads=parse_list(v);
+            else if (arg=="--pipeline") o.pipeline=std::max<std::size_t>(std::strtoul(v.c_str(), nullptr, 10), 1);
+            else if (arg=="--rate") o.rate=std::atof(v.c_str());
+            else if (arg=="--duration") o.duration=std::atof(v.c_str());
+            else if (arg=="--warmup") o.warmup=std::atof(v.c_str());
+            else if (arg=="--path") o.path=v;
+            else if (arg=="--expr") o.expr=v;
+            else if (arg=="--client-threads") o.client_threads=std::strtoul(v.c_str(), nullptr, 10);
+            else if (arg=="--model") {
+                if (v=="shared") o.model=net::threading_model::shared_io_service;
+                else if (v=="per-thread") o.model=net::threading_model::io_service_per_thread;
+                else if (v=="work-stealing") o.model=net::threading_model::work_stealing;
+                else return false;
+            }
+            else if (arg=="--csv") o.csv=v;
+            else return false;
+        }
+        if (o.port.empty())
+            o.port=o.embedded ? "20080" : (o.calc ? "30000" : "20000");
+        return !o.connections.empty() && !o.threads.empty();
+    }
+}   // End of namespace bench
+
+int main(int argc, const char *argv[]) {
+    bench::options_t options;
+    if (!bench::parse_options(argc, argv, options)) {
+        std::cerr << "Usage: " << argv[0] << " [--host H] [--port P] [--protocol http|calc] [--connections N,...]\n"
+                  << "       [--pipeline N] [--rate R] [--duration S] [--warmup S] [--path P] [--expr E]\n"
+                  << "       [--client-threads N] [--embedded [--threads N,...] [--model M]] [--csv file]\n";
+        return 1;
+    }
+    if (!options.embedded) {
+        // The server's thread pool can only be swept when it runs in this process
+        options.threads.resize(1);
+        options.threads[0]=0;
+    }
+    bench::print_header(std::cout);
+    for (std::size_t threads : options.threads) {
+        for (std::size_t connections : options.connections) {
+            bench::result_t r=bench::run_once(options, threads, connections);
+            bench::print(std::cout, r);
+            if (!options.csv.empty())
+                bench::write_csv(options, r);
+        }
+    }
+    return 0;
+}
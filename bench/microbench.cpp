@@ -0,0 +1,322 @@
+//
+//  microbench.cpp
+//  coroserver
+//
+
+// Microbenchmarks of the HTTP hot paths, without sockets
+//
+// Usage: coroserver-microbench [--filter substring] [--min-time seconds] [--json file] [--baseline file]
+//
+// Every case reports ns/op, allocations/op and bytes/op, the allocation columns are only
+// non-zero when built with COROSERVER_ALLOC_STATS. --json writes one JSON object per line,
+// --baseline reads such a file and shows the change of each case against it.
+
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <map>
+#include <vector>
+#include <string>
+#include <memory>
+#include <fstream>
+#include <iostream>
+#include <streambuf>
+#include <boost/asio/spawn.hpp>
+#include "alloc_stats.h"
+#include "http_protocol.h"
+#include "routing.h"
+
+namespace bench {
+    typedef std::chrono::steady_clock clock_type;
+
+    struct result_t {
+        std::string name;
+        std::uint64_t ops;
+        double ns;
+        double allocations;
+        double bytes;
+    };
+
+    /**
+     * Discards everything, so only serialization is measured
+     */
+    class null_streambuf : public std::streambuf {
+    protected:
+        virtual int_type overflow(int_type c)
+        { return traits_type::not_eof(c); }
+
+        virtual std::streamsize xsputn(const char *, std::streamsize n)
+        { return n; }
+    };
+
+    // Keeps results alive so the work isn't optimized away
+    volatile std::size_t sink;
+
+    /**
+     * Run fn until min_time has passed, fn returns the number of operations it has done
+     */
+    template<typename Function>
+    result_t measure(const std::string &name, double min_time, Function fn) {
+        // Warm up and find a batch size that runs for about a tenth of min_time
+        std::uint64_t batch=1;
+        for (;;) {
+            clock_type::time_point start=clock_type::now();
+            for (std::uint64_t i=0; i<batch; i++)
+                fn();
+            double elapsed=std::chrono::duration<double>(clock_type::now()-start).count();
+            if (elapsed>=min_time/10 || batch>=(std::uint64_t(1)<<30)) break;
+            batch*=2;
+        }
+        const net::alloc_stats_t &stats=net::thread_alloc_stats();
+        std::size_t allocations=stats.allocations;
+        std::size_t bytes=stats.bytes;
+        std::uint64_t ops=0;
+        clock_type::time_point start=clock_type::now();
+        double elapsed=0;
+        while (elapsed<min_time) {
+            for (std::uint64_t i=0; i<batch; i++)
+                ops+=fn();
+            elapsed=std::chrono::duration<double>(clock_type::now()-start).count();
+        }
+        if (ops==0) ops=1;
+        result_t r;
+        r.name=name;
+        r.ops=ops;
+        r.ns=elapsed*1e9/ops;
+        r.allocations=double(stats.allocations-allocations)/ops;
+        r.bytes=double(stats.bytes-bytes)/ops;
+        return r;
+    }
+
+    const char get_request[]=
+        "GET /api/v1/users/12345?fields=name,email HTTP/1.1\r\n"
+        "Host: www.example.com\r\n"
+        "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0 Safari/537.36\r\n"
+        "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+        "Accept-Language: en-US,en;q=0.5\r\n"
+        "Accept-Encoding: gzip, deflate\r\n"
+        "Cookie: session=0123456789abcdef; theme=dark\r\n"
+        "Referer: http://www.example.com/index.html\r\n"
+        "Connection: keep-alive\r\n"
+        "\r\n";
+
+    std::string post_request() {
+        std::string body(4096, 'x');
+        return "POST /upload HTTP/1.1\r\n"
+               "Host: www.example.com\r\n"
+               "Content-Type: application/octet-stream\r\n"
+               "Content-Length: 4096\r\n"
+               "\r\n"+body;
+    }
+
+    /**
+     * Route table of n entries mixing the predicate kinds, with a catch-all at the end
+     */
+    http::router<int>::routing_table_t route_table(std::size_t n) {
+        http::router<int>::routing_table_t table;
+        http::router<int>::handler_t handler=[](http::session_t &, int &arg)->bool { arg++; return true; };
+        for (std::size_t i=0; i+1<n; i++) {
+            std::string k=std::to_string(i);
+            switch (i%4) {
+                case 0:
+                    table.push_back({http::url_equals("/pages/page"+k+".html"), handler});
+                    break;
+                case 1:
+                    table.push_back({http::url_starts_with("/assets"+k+"/"), handler});
+                    break;
+                case 2:
+                    table.push_back({http::url_matches("/api/v"+k+"/users/:id"), handler});
+                    break;
+                default:
+                    table.push_back({http::url_ends_with(".ext"+k), handler});
+                    break;
+            }
+        }
+        table.push_back({http::any(), handler});
+        return table;
+    }
+
+    /**
+     * Paths hitting each kind of route near the end of the table, and one falling through
+     */
+    std::vector<std::string> route_paths(std::size_t n) {
+        std::vector<std::string> paths;
+        std::size_t last=n>4 ? n-5 : 0;
+        for (std::size_t i=last; i+1<n; i++) {
+            std::string k=std::to_string(i);
+            switch (i%4) {
+                case 0:
+                    paths.push_back("/pages/page"+k+".html");
+                    break;
+                case 1:
+                    paths.push_back("/assets"+k+"/css/site.css");
+                    break;
+                case 2:
+                    paths.push_back("/api/v"+k+"/users/42");
+                    break;
+                default:
+                    paths.push_back("/download/file.ext"+k);
+                    break;
+            }
+        }
+        paths.push_back("/nowhere/to/be/found");
+        return paths;
+    }
+
+    void run_cases(net::async_tcp_stream &stream, double min_time, const std::string &filter, std::vector<result_t> &results) {
+        auto run=[&](const std::string &name, std::function<std::size_t()> fn) {
+            if (!filter.empty() && name.find(filter)==std::string::npos) return;
+            results.push_back(measure(name, min_time, fn));
+            const result_t &r=results.back();
+            char line[160];
+            snprintf(line, sizeof(line), "%-28s %12.1f ns/op %10.2f allocs/op %12.1f bytes/op\n",
+                     r.name.c_str(), r.ns, r.allocations, r.bytes);
+            std::cout << line << std::flush;
+        };
+
+        // Parser, the handler does nothing
+        http::session_t session(stream);
+        http::request_handler_t nop=[](http::session_t &s)->bool { sink=s.request().headers().size(); return true; };
+        std::string get(get_request);
+        run("parser/get", [&]()->std::size_t {
+            return http::details::parse_request_buffer(session, get.data(), get.size(), nop);
+        });
+        std::string pipelined;
+        for (int i=0; i<16; i++) pipelined+=get;
+        run("parser/get_pipelined_16", [&]()->std::size_t {
+            return http::details::parse_request_buffer(session, pipelined.data(), pipelined.size(), nop);
+        });
+        std::string post=post_request();
+        run("parser/post_4k", [&]()->std::size_t {
+            return http::details::parse_request_buffer(session, post.data(), post.size(), nop);
+        });
+
+        // Router
+        for (std::size_t n : {10, 100, 1000}) {
+            http::router<int> router(route_table(n));
+            std::vector<std::string> paths=route_paths(n);
+            std::vector<std::unique_ptr<http::session_t>> sessions;
+            for (const std::string &p : paths) {
+                sessions.emplace_back(new http::session_t(stream));
+                sessions.back()->request().path(p);
+            }
+            std::size_t i=0;
+            int arg=0;
+            run("router/"+std::to_string(n), [&]()->std::size_t {
+                router(*sessions[i], arg);
+                i=(i+1)%sessions.size();
+                return 1;
+            });
+        }
+
+        // Header lookup on the parsed GET request
+        http::details::parse_request_buffer(session, get.data(), get.size(), nop);
+        run("headers/find_header", [&]()->std::size_t {
+            http::headers_t::const_iterator i=http::find_header(session.request().headers(), "Accept-Language");
+            sink=i!=session.request().headers().end() ? i->second.size() : 0;
+            return 1;
+        });
+        run("headers/value_by_id", [&]()->std::size_t {
+            sink=session.request().headers().value(http::header_id::accept_encoding).size();
+            return 1;
+        });
+
+        // Response head as request_callback renders it, and the ostream serializer
+        http::response_t resp;
+        resp.clear();
+        resp.http_major(1);
+        resp.http_minor(1);
+        resp.code(http::OK);
+        resp.headers().push_back("Content-Type", "text/html; charset=utf-8");
+        resp.headers().push_back("Cache-Control", "max-age=60");
+        resp.headers().push_back("ETag", "\"5f3a-1b2c\"");
+        resp.headers().push_back("Vary", "Accept-Encoding");
+        resp.body_stream() << std::string(2048, 'x');
+        std::string head;
+        const http::string_ref_t connection("Connection: keep-alive\r\n");
+        run("response/render_head", [&]()->std::size_t {
+            http::details::render_head(head, resp, connection);
+            sink=head.size();
+            return 1;
+        });
+        null_streambuf nb;
+        std::ostream null_stream(&nb);
+        run("response/ostream", [&]()->std::size_t {
+            null_stream << resp;
+            return 1;
+        });
+    }
+
+    /**
+     * Results of an earlier run, keyed by name
+     */
+    std::map<std::string, result_t> load(const std::string &file) {
+        std::map<std::string, result_t> results;
+        std::ifstream f(file);
+        std::string line;
+        while (std::getline(f, line)) {
+            char name[128];
+            result_t r;
+            unsigned long long ops;
+            if (sscanf(line.c_str(), "{\"name\":\"%127[^\"]\",\"ops\":%llu,\"ns_per_op\":%lf,\"allocs_per_op\":%lf,\"bytes_per_op\":%lf}",
+                       name, &ops, &r.ns, &r.allocations, &r.bytes)==5)
+            {
+                r.name=name;
+                r.ops=ops;
+                results[r.name]=r;
+            }
+        }
+        return results;
+    }
+
+    void save(const std::string &file, const std::vector<result_t> &results) {
+        std::ofstream f(file);
+        for (const result_t &r : results) {
+            char line[256];
+            snprintf(line, sizeof(line), "{\"name\":\"%s\",\"ops\":%llu,\"ns_per_op\":%.3f,\"allocs_per_op\":%.4f,\"bytes_per_op\":%.2f}\n",
+                     r.name.c_str(), static_cast<unsigned long long>(r.ops), r.ns, r.allocations, r.bytes);
+            f << line;
+        }
+    }
+
+    void compare(const std::vector<result_t> &results, const std::map<std::string, result_t> &baseline) {
+        std::cout << "\nChange against baseline:\n";
+        for (const result_t &r : results) {
+            std::map<std::string, result_t>::const_iterator i=baseline.find(r.name);
+            if (i==baseline.end()) continue;
+            char line[160];
+            snprintf(line, sizeof(line), "%-28s %+8.1f%% ns/op %+10.2f allocs/op %+12.1f bytes/op\n",
+                     r.name.c_str(), (r.ns/i->second.ns-1)*100, r.allocations-i->second.allocations, r.bytes-i->second.bytes);
+            std::cout << line;
+        }
+    }
+}   // End of namespace bench
+
+int main(int argc, const char *argv[]) {
+    std::string filter;
+    std::string json;
+    std::string baseline;
+    double min_time=0.5;
+    for (int i=1; i+1<argc; i+=2) {
+        std::string arg=argv[i];
+        if (arg=="--filter") filter=argv[i+1];
+        else if (arg=="--min-time") min_time=std::atof(argv[i+1]);
+        else if (arg=="--json") json=argv[i+1];
+        else if (arg=="--baseline") baseline=argv[i+1];
+    }
+    if (!net::alloc_stats_enabled())
+        std::cout << "Allocation counters are off, build with COROSERVER_ALLOC_STATS to enable them\n";
+    std::vector<bench::result_t> results;
+    // Sessions need a stream, it's never read from or written to
+    boost::asio::io_service ios;
+    boost::asio::spawn(boost::asio::strand(ios), [&](boost::asio::yield_context yield) {
+        net::async_tcp_stream stream(boost::asio::ip::tcp::socket(ios), yield);
+        bench::run_cases(stream, min_time, filter, results);
+    });
+    ios.run();
+    if (!json.empty())
+        bench::save(json, results);
+    if (!baseline.empty())
+        bench::compare(results, bench::load(baseline));
+    return 0;
+}
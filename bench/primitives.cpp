@@ -0,0 +1,365 @@
+//
+//  primitives.cpp
+//  coroserver
+//
+
+// Benchmarks of the runtime primitives every connection goes through
+//
+// Usage: coroserver-primitives [--threads 1,2,4,8] [--ops N] [--filter substring] [--csv file]
+//
+// Each case runs once for every thread count, with that many threads running one io_service and
+// one worker per thread doing --ops operations, workers never share a strand unless the case says
+// so. Mops/s is the total over all workers, ns/op is the wall time of one operation as seen by a
+// worker, and scaling is the throughput relative to the first thread count.
+//
+//   spawn/strand           spawn a coroutine into a new strand and run it to completion, as
+//                          server::handle_connect does for every connection
+//   switch/yield_resume    suspend a coroutine and resume it through its strand
+//   post/io_service        post a handler to the io_service, baseline of the strand cases
+//   post/strand_private    post a handler to the worker's own strand
+//   post/strand_shared     post a handler to a strand shared by all workers
+//   timer/steady           arm and cancel an asio steady_timer, the read and write timeout
+//                          pattern async_tcp_stream used before the timer wheel
+//   timer/wheel            arm and disarm a wheel_timer, the current timeout pattern
+//   cv/inside_notify_one   wake a coroutine waiting on a condition_variable from another
+//   cv/inside_notify_all   coroutine in the same strand, two coroutines ping-pong
+//   cv/outside_notify_one  wake a coroutine waiting on a condition_variable from a thread outside
+//   cv/outside_notify_all  the io_service, the thread waits for the coroutine to acknowledge
+//
+// A condition_variable only ever suspends the coroutine it's constructed with, so notify_all
+// never wakes more than one coroutine, the notify_all cases show the cost of the extra queue walk.
+
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <string>
+#include <memory>
+#include <fstream>
+#include <iostream>
+#include <functional>
+#include <boost/asio/spawn.hpp>
+#include <boost/asio/strand.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include "condition_variable.hpp"
+#include "timer_wheel.h"
+
+namespace bench {
+    typedef std::chrono::steady_clock clock_type;
+
+    /**
+     * One run of a case, the io_service is kept running until every worker has finished
+     */
+    struct run_t {
+        explicit run_t(std::size_t workers)
+        : remaining(workers)
+        , work(new boost::asio::io_service::work(ios))
+        {}
+
+        inline void finish() {
+            if (remaining.fetch_sub(1)==1) {
+                // Cleaning up after the last worker, i.e. the timer wheel tick, is not measured
+                end=clock_type::now();
+                work.reset();
+            }
+        }
+
+        boost::asio::io_service ios;
+        std::atomic<std::size_t> remaining;
+        std::unique_ptr<boost::asio::io_service::work> work;
+        clock_type::time_point end;
+        // Threads running outside the io_service
+        std::vector<std::thread> helpers;
+        // Objects handlers may still refer to after their worker has finished
+        std::vector<std::shared_ptr<void>> keep;
+    };
+
+    /**
+     * Queue the workers of a case, returns the total number of operations
+     */
+    typedef std::function<std::uint64_t(run_t &, std::size_t, std::uint64_t)> case_t;
+
+    struct result_t {
+        std::string name;
+        std::size_t threads;
+        std::uint64_t ops;
+        double seconds;
+        double scaling;
+    };
+
+    /**
+     * Suspend the coroutine owning cv and resume it through its strand
+     */
+    inline void yield_now(boost::asio::condition_variable &cv) {
+        // Runs after wait() has suspended the coroutine, the strand is not reentered before
+        cv.get_strand().post([&cv](){ cv.notify_one(); });
+        cv.wait();
+    }
+
+    std::uint64_t spawn_strand(run_t &run, std::size_t threads, std::uint64_t ops) {
+        for (std::size_t t=0; t<threads; t++) {
+            run.ios.post([&run, ops](){
+                std::shared_ptr<std::atomic<std::uint64_t>> done=std::make_shared<std::atomic<std::uint64_t>>(0);
+                for (std::uint64_t i=0; i<ops; i++) {
+                    boost::asio::spawn(boost::asio::strand(run.ios), [&run, done, ops](boost::asio::yield_context) {
+                        if (done->fetch_add(1)+1==ops) run.finish();
+                    });
+                }
+            });
+        }
+        return threads*ops;
+    }
+
+    std::uint64_t yield_resume(run_t &run, std::size_t threads, std::uint64_t ops) {
+        for (std::size_t t=0; t<threads; t++) {
+            boost::asio::spawn(boost::asio::strand(run.ios), [&run, ops](boost::asio::yield_context yield) {
+                boost::asio::condition_variable cv(yield);
+                for (std::uint64_t i=0; i<ops; i++)
+                    yield_now(cv);
+                run.finish();
+            });
+        }
+        return threads*ops;
+    }
+
+    /**
+     * Handler that posts itself until it has run n times
+     */
+    template<typename Dispatcher>
+    struct chain_t {
+        Dispatcher *dispatcher;
+        std::uint64_t left;
+        run_t *run;
+
+        void operator()() {
+            if (--left==0) run->finish();
+            else dispatcher->post(*this);
+        }
+    };
+
+    std::uint64_t post_io_service(run_t &run, std::size_t threads, std::uint64_t ops) {
+        for (std::size_t t=0; t<threads; t++)
+            run.ios.post(chain_t<boost::asio::io_service>{&run.ios, ops, &run});
+        return threads*ops;
+    }
+
+    std::uint64_t post_strand(run_t &run, std::size_t threads, std::uint64_t ops, bool shared) {
+        std::shared_ptr<boost::asio::strand> strand;
+        for (std::size_t t=0; t<threads; t++) {
+            if (!strand || !shared) {
+                strand=std::make_shared<boost::asio::strand>(run.ios);
+                run.keep.push_back(strand);
+            }
+            strand->post(chain_t<boost::asio::strand>{strand.get(), ops, &run});
+        }
+        return threads*ops;
+    }
+
+    std::uint64_t steady_timer(run_t &run, std::size_t threads, std::uint64_t ops) {
+        for (std::size_t t=0; t<threads; t++) {
+            boost::asio::spawn(boost::asio::strand(run.ios), [&run, ops](boost::asio::yield_context yield) {
+                boost::asio::condition_variable cv(yield);
+                boost::asio::steady_timer timer(run.ios);
+                boost::system::error_code ec;
+                for (std::uint64_t i=0; i<ops; i++) {
+                    timer.expires_from_now(std::chrono::seconds(30));
+                    timer.async_wait(cv.get_strand().wrap([](const boost::system::error_code &){}));
+                    timer.cancel(ec);
+                    // Let the cancelled handlers run now and then, as the read in between would
+                    if ((i & 63)==63) yield_now(cv);
+                }
+                run.finish();
+            });
+        }
+        return threads*ops;
+    }
+
+    std::uint64_t wheel_timer(run_t &run, std::size_t threads, std::uint64_t ops) {
+        for (std::size_t t=0; t<threads; t++) {
+            boost::asio::spawn(boost::asio::strand(run.ios), [&run, ops](boost::asio::yield_context yield) {
+                boost::asio::condition_variable cv(yield);
+                net::wheel_timer timer(run.ios);
+                timer.callback([](){});
+                for (std::uint64_t i=0; i<ops; i++) {
+                    timer.arm(net::timeout_t(30000));
+                    timer.disarm();
+                    if ((i & 63)==63) yield_now(cv);
+                }
+                run.finish();
+            });
+        }
+        return threads*ops;
+    }
+
+    inline void notify(boost::asio::condition_variable &cv, bool all) {
+        if (all) cv.notify_all();
+        else cv.notify_one();
+    }
+
+    /**
+     * Two coroutines in one strand waking each other, every wakeup is one operation
+     */
+    std::uint64_t cv_inside(run_t &run, std::size_t threads, std::uint64_t ops, bool all) {
+        struct pair_t {
+            boost::asio::condition_variable *cv[2]={nullptr, nullptr};
+            int turn=0;
+        };
+        std::uint64_t rounds=(ops+1)/2;
+        for (std::size_t t=0; t<threads; t++) {
+            std::shared_ptr<pair_t> p=std::make_shared<pair_t>();
+            boost::asio::strand strand(run.ios);
+            boost::asio::spawn(strand, [&run, p, rounds, all](boost::asio::yield_context yield) {
+                boost::asio::condition_variable cv(yield);
+                p->cv[0]=&cv;
+                for (std::uint64_t i=0; i<rounds; i++) {
+                    p->turn=1;
+                    if (p->cv[1]) notify(*p->cv[1], all);
+                    while (p->turn!=0) cv.wait();
+                }
+                run.finish();
+            });
+            boost::asio::spawn(strand, [p, rounds, all](boost::asio::yield_context yield) {
+                boost::asio::condition_variable cv(yield);
+                p->cv[1]=&cv;
+                for (std::uint64_t i=0; i<rounds; i++) {
+                    while (p->turn!=1) cv.wait();
+                    p->turn=0;
+                    if (p->cv[0]) notify(*p->cv[0], all);
+                }
+            });
+        }
+        return threads*rounds*2;
+    }
+
+    /**
+     * A thread outside the io_service notifying a coroutine and waiting for it to catch up
+     */
+    std::uint64_t cv_outside(run_t &run, std::size_t threads, std::uint64_t ops, bool all) {
+        struct handshake_t {
+            // Owned here, the last notification may be handled after the coroutine has finished
+            std::unique_ptr<boost::asio::condition_variable> cv;
+            std::atomic<bool> ready{false};
+            std::atomic<std::uint64_t> sent{0};
+            std::atomic<std::uint64_t> acked{0};
+        };
+        for (std::size_t t=0; t<threads; t++) {
+            std::shared_ptr<handshake_t> h=std::make_shared<handshake_t>();
+            run.keep.push_back(h);
+            boost::asio::spawn(boost::asio::strand(run.ios), [h, ops](boost::asio::yield_context yield) {
+                h->cv.reset(new boost::asio::condition_variable(yield));
+                h->ready.store(true);
+                std::uint64_t acked=0;
+                while (acked<ops) {
+                    // sent is only checked in the strand, where the notification is handled too
+                    std::uint64_t sent;
+                    while ((sent=h->sent.load())==acked) h->cv->wait();
+                    acked=sent;
+                    h->acked.store(acked);
+                }
+            });
+            run.helpers.emplace_back([&run, h, ops, all](){
+                while (!h->ready.load()) std::this_thread::yield();
+                for (std::uint64_t i=1; i<=ops; i++) {
+                    h->sent.store(i);
+                    notify(*h->cv, all);
+                    while (h->acked.load()<i) std::this_thread::yield();
+                }
+                // Finished here so the last notification is handled before the io_service stops
+                run.finish();
+            });
+        }
+        return threads*ops;
+    }
+
+    result_t measure(const std::string &name, std::size_t threads, std::uint64_t ops, const case_t &c) {
+        run_t run(threads);
+        std::uint64_t total=c(run, threads, ops);
+        clock_type::time_point start=clock_type::now();
+        std::vector<std::thread> pool;
+        for (std::size_t t=0; t<threads; t++)
+            pool.emplace_back([&run](){ run.ios.run(); });
+        for (std::thread &t : pool) t.join();
+        for (std::thread &t : run.helpers) t.join();
+        result_t r;
+        r.name=name;
+        r.threads=threads;
+        r.ops=total;
+        r.seconds=std::chrono::duration<double>(run.end-start).count();
+        r.scaling=1;
+        return r;
+    }
+
+    std::vector<std::size_t> parse_list(const std::string &s) {
+        std::vector<std::size_t> v;
+        std::size_t pos=0;
+        while (pos<s.size()) {
+            std::size_t comma=s.find(',', pos);
+            if (comma==std::string::npos) comma=s.size();
+            std::size_t n=std::strtoul(s.substr(pos, comma-pos).c_str(), nullptr, 10);
+            if (n>0) v.push_back(n);
+            pos=comma+1;
+        }
+        return v;
+    }
+}   // End of namespace bench
+
+int main(int argc, const char *argv[]) {
+    using namespace std::placeholders;
+    std::vector<std::size_t> threads{1, 2, 4, 8};
+    std::uint64_t ops=200000;
+    std::string filter;
+    std::string csv;
+    for (int i=1; i+1<argc; i+=2) {
+        std::string arg=argv[i];
+        if (arg=="--threads") threads=bench::parse_list(argv[i+1]);
+        else if (arg=="--ops") ops=std::max<std::uint64_t>(std::strtoull(argv[i+1], nullptr, 10), 1);
+        else if (arg=="--filter") filter=argv[i+1];
+        else if (arg=="--csv") csv=argv[i+1];
+    }
+    if (threads.empty()) {
+        std::cerr << "Usage: " << argv[0] << " [--threads N,...] [--ops N] [--filter substring] [--csv file]\n";
+        return 1;
+    }
+    const std::vector<std::pair<std::string, bench::case_t>> cases{
+        {"spawn/strand", bench::spawn_strand},
+        {"switch/yield_resume", bench::yield_resume},
+        {"post/io_service", bench::post_io_service},
+        {"post/strand_private", std::bind(bench::post_strand, _1, _2, _3, false)},
+        {"post/strand_shared", std::bind(bench::post_strand, _1, _2, _3, true)},
+        {"timer/steady", bench::steady_timer},
+        {"timer/wheel", bench::wheel_timer},
+        {"cv/inside_notify_one", std::bind(bench::cv_inside, _1, _2, _3, false)},
+        {"cv/inside_notify_all", std::bind(bench::cv_inside, _1, _2, _3, true)},
+        {"cv/outside_notify_one", std::bind(bench::cv_outside, _1, _2, _3, false)},
+        {"cv/outside_notify_all", std::bind(bench::cv_outside, _1, _2, _3, true)},
+    };
+    std::vector<bench::result_t> results;
+    std::cout << "case                     threads        Mops/s        ns/op  scaling\n";
+    for (const std::pair<std::string, bench::case_t> &c : cases) {
+        if (!filter.empty() && c.first.find(filter)==std::string::npos) continue;
+        double base=0;
+        for (std::size_t t : threads) {
+            bench::result_t r=bench::measure(c.first, t, ops, c.second);
+            double throughput=r.ops/r.seconds;
+            if (base==0) base=throughput;
+            r.scaling=throughput/base;
+            results.push_back(r);
+            char line[160];
+            snprintf(line, sizeof(line), "%-24s %8zu %13.3f %12.1f %8.2f\n",
+                     r.name.c_str(), r.threads, throughput/1e6, r.seconds*1e9*r.threads/r.ops, r.scaling);
+            std::cout << line << std::flush;
+        }
+    }
+    if (!csv.empty()) {
+        std::ofstream f(csv);
+        f << "case,threads,ops,seconds,mops_per_second,ns_per_op,scaling\n";
+        for (const bench::result_t &r : results) {
+            f << r.name << ',' << r.threads << ',' << r.ops << ',' << r.seconds << ','
+              << r.ops/r.seconds/1e6 << ',' << r.seconds*1e9*r.threads/r.ops << ',' << r.scaling << '\n';
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,155 @@
+//
+//  compression.cpp
+//  coroserver
+//
+
+#include <cstdlib>
+#include <ctime>
+#include <thread>
+#include <zlib.h>
+#include "compression.h"
+
+namespace http {
+    namespace details {
+        inline string_ref_t trim(string_ref_t s) {
+            while (!s.empty() && (s.front()==' ' || s.front()=='\t')) s.remove_prefix(1);
+            while (!s.empty() && (s.back()==' ' || s.back()=='\t')) s.remove_suffix(1);
+            return s;
+        }
+
+        /**
+         * Quality of a coding in Accept-Encoding, 1000 for "q=1", -1 if not mentioned
+         */
+        int quality(const string_ref_t &params) {
+            // Only "q" is defined
+            string_ref_t p=trim(params);
+            if (p.size()<2 || (p[0]!='q' && p[0]!='Q') || p[1]!='=') return 1000;
+            p.remove_prefix(2);
+            int q=0;
+            int scale=1000;
+            bool fraction=false;
+            for (char c : p) {
+                if (c=='.') {
+                    fraction=true;
+                } else if (c>='0' && c<='9') {
+                    if (!fraction) {
+                        q=(c-'0')*1000;
+                    } else if (scale>1) {
+                        scale/=10;
+                        q+=(c-'0')*scale;
+                    }
+                } else {
+                    break;
+                }
+            }
+            return q>1000 ? 1000 : q;
+        }
+
+        struct load_sample_t {
+            std::time_t time;
+            int level;
+        };
+    }   // End of namespace details
+
+    content_coding negotiate_coding(const string_ref_t &accept_encoding) {
+        int gzip=-1;
+        int deflate=-1;
+        int any=-1;
+        string_ref_t s=accept_encoding;
+        while (!s.empty()) {
+            std::size_t comma=s.find(',');
+            string_ref_t item=s.substr(0, comma);
+            std::size_t semi=item.find(';');
+            string_ref_t name=details::trim(item.substr(0, semi));
+            int q=semi==string_ref_t::npos ? 1000 : details::quality(item.substr(semi+1));
+            if (iequals(name, "gzip") || iequals(name, "x-gzip")) {
+                gzip=q;
+            } else if (iequals(name, "deflate")) {
+                deflate=q;
+            } else if (name=="*") {
+                any=q;
+            }
+            if (comma==string_ref_t::npos) break;
+            s.remove_prefix(comma+1);
+        }
+        if (gzip<0) gzip=any;
+        if (deflate<0) deflate=any;
+        if (gzip>0 && gzip>=deflate) return content_coding::gzip;
+        if (deflate>0) return content_coding::deflate;
+        return content_coding::identity;
+    }
+
+    string_ref_t coding_name(content_coding c) {
+        switch (c) {
+            case content_coding::gzip:
+                return "gzip";
+            case content_coding::deflate:
+                return "deflate";
+            default:
+                return string_ref_t();
+        }
+    }
+
+    bool compressible_type(const string_ref_t &content_type) {
+        if (content_type.empty()) return true;
+        string_ref_t t=content_type.substr(0, content_type.find(';'));
+        if (t.size()>=5 && iequals(t.substr(0, 5), "text/")) return true;
+        static const char *types[]={
+            "application/javascript",
+            "application/json",
+            "application/xml",
+            "application/xhtml+xml",
+            "application/rss+xml",
+            "application/wasm",
+            "image/svg+xml",
+            "image/x-icon",
+        };
+        t=details::trim(t);
+        for (const char *type : types) {
+            if (iequals(t, type)) return true;
+        }
+        return false;
+    }
+
+    int adaptive_level(const compression_options_t &options) {
+        static thread_local details::load_sample_t sample;
+        std::time_t now=std::time(nullptr);
+        if (now!=sample.time || sample.level==0) {
+            double load=0;
+            unsigned cpus=std::thread::hardware_concurrency();
+            if (getloadavg(&load, 1)==1 && cpus>0) load/=cpus;
+            int level;
+            if (load<=options.low_load) {
+                level=options.max_level;
+            } else if (load>=options.high_load) {
+                level=options.min_level;
+            } else {
+                double r=(load-options.low_load)/(options.high_load-options.low_load);
+                level=options.max_level-int(r*(options.max_level-options.min_level)+0.5);
+            }
+            sample.level=level<1 ? 1 : (level>9 ? 9 : level);
+            sample.time=now;
+        }
+        return sample.level;
+    }
+
+    bool compress(content_coding c, int level, const string_ref_t &in, std::string &out) {
+        if (c==content_coding::identity) return false;
+        z_stream zs;
+        zs.zalloc=Z_NULL;
+        zs.zfree=Z_NULL;
+        zs.opaque=Z_NULL;
+        // 16 added to window bits selects the gzip wrapper
+        int bits=c==content_coding::gzip ? 15+16 : 15;
+        if (deflateInit2(&zs, level, Z_DEFLATED, bits, 8, Z_DEFAULT_STRATEGY)!=Z_OK) return false;
+        out.resize(deflateBound(&zs, in.size()));
+        zs.next_in=reinterpret_cast<Bytef *>(const_cast<char *>(in.data()));
+        zs.avail_in=static_cast<uInt>(in.size());
+        zs.next_out=reinterpret_cast<Bytef *>(&out[0]);
+        zs.avail_out=static_cast<uInt>(out.size());
+        int ret=deflate(&zs, Z_FINISH);
+        out.resize(zs.total_out);
+        deflateEnd(&zs);
+        return ret==Z_STREAM_END;
+    }
+}   // End of namespace http
@@ -0,0 +1,78 @@
+//
+//  compression.h
+//  coroserver
+//
+
+#ifndef __coroserver__compression__
+#define __coroserver__compression__
+
+#include <cstddef>
+#include <string>
+#include "headers.h"
+
+namespace http {
+    enum class content_coding {
+        identity,
+        gzip,
+        deflate,
+        // Must be the last one
+        count,
+    };
+
+    struct compression_options_t {
+        /**
+         * Compression is off unless enabled
+         */
+        bool enabled=false;
+        /**
+         * Smaller bodies are sent as they are
+         */
+        std::size_t min_size=1024;
+        /**
+         * zlib levels used when the CPUs are busy and when they are idle
+         */
+        int min_level=1;
+        int max_level=6;
+        /**
+         * Load average per CPU below which max_level is used, and above which min_level is used
+         */
+        double low_load=0.5;
+        double high_load=1.0;
+        /**
+         * Level of variants compressed once and sent many times, i.e. cached responses and static files
+         */
+        int variant_level=9;
+        /**
+         * Largest static file compressed in memory
+         */
+        std::size_t max_file_size=1024*1024;
+    };
+
+    /**
+     * Pick a coding from the Accept-Encoding header, gzip is preferred over deflate at equal
+     * quality, identity if neither is acceptable
+     */
+    content_coding negotiate_coding(const string_ref_t &accept_encoding);
+
+    /**
+     * Value of Content-Encoding, empty for identity
+     */
+    string_ref_t coding_name(content_coding c);
+
+    /**
+     * True for textual types worth compressing, an empty type is taken as text/html
+     */
+    bool compressible_type(const string_ref_t &content_type);
+
+    /**
+     * Compression level for the current load average, sampled at most once per second per thread
+     */
+    int adaptive_level(const compression_options_t &options);
+
+    /**
+     * Compress in into out, "deflate" is the zlib format as defined by HTTP
+     */
+    bool compress(content_coding c, int level, const string_ref_t &in, std::string &out);
+}   // End of namespace http
+
+#endif /* defined(__coroserver__compression__) */
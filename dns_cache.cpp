@@ -0,0 +1,179 @@
+//
+//  dns_cache.cpp
+//  coroserver
+//
+
+#include <boost/asio/error.hpp>
+#include "dns_cache.h"
+
+namespace net {
+    dns_cache::dns_cache()
+    : backend_(default_backend())
+    , hits_(0)
+    , misses_(0)
+    , coalesced_(0)
+    {}
+    
+    dns_cache &dns_cache::instance() {
+        static dns_cache cache;
+        return cache;
+    }
+    
+    dns_backend_t dns_cache::default_backend() {
+        return [](boost::asio::io_service &ios, const dns_query_t &query, const dns_callback_t &cb) {
+            using namespace boost::asio::ip;
+            std::shared_ptr<tcp::resolver> resolver=std::make_shared<tcp::resolver>(ios);
+            auto handler=[resolver, cb](const boost::system::error_code &ec, tcp::resolver::iterator i) {
+                if (ec) {
+                    cb(ec, endpoints_ptr());
+                    return;
+                }
+                std::shared_ptr<endpoints_t> eps=std::make_shared<endpoints_t>();
+                for (; i!=tcp::resolver::iterator(); ++i)
+                    eps->push_back(i->endpoint());
+                if (eps->empty())
+                    cb(boost::asio::error::host_not_found, endpoints_ptr());
+                else
+                    cb(ec, eps);
+            };
+            switch (query.family) {
+                case address_family::v4:
+                    resolver->async_resolve(tcp::resolver::query(tcp::v4(), query.host, query.port), handler);
+                    break;
+                case address_family::v6:
+                    resolver->async_resolve(tcp::resolver::query(tcp::v6(), query.host, query.port), handler);
+                    break;
+                default:
+                    resolver->async_resolve(tcp::resolver::query(query.host, query.port), handler);
+                    break;
+            }
+        };
+    }
+    
+    void dns_cache::backend(const dns_backend_t &b) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        backend_=b;
+    }
+    
+    dns_cache_options_t dns_cache::options() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return options_;
+    }
+    
+    void dns_cache::options(const dns_cache_options_t &opt) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        options_=opt;
+    }
+    
+    std::string dns_cache::key(const dns_query_t &query) {
+        std::string k;
+        k.reserve(query.host.size()+query.port.size()+2);
+        k.push_back('0'+static_cast<int>(query.family));
+        k.append(query.host);
+        k.push_back('\0');
+        k.append(query.port);
+        return k;
+    }
+    
+    bool dns_cache::find(const std::string &k, boost::system::error_code &ec, endpoints_ptr &eps) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        entries_t::const_iterator i=entries_.find(k);
+        if (i==entries_.end() || i->second.pending || i->second.expires<=timer_wheel::now())
+            return false;
+        ec=i->second.error;
+        eps=i->second.endpoints;
+        hits_++;
+        return true;
+    }
+    
+    endpoints_ptr dns_cache::resolve(const dns_query_t &query, boost::asio::yield_context yield) {
+        boost::system::error_code ec;
+        endpoints_ptr eps;
+        if (!find(key(query), ec, eps)) {
+            boost::asio::io_service &ios=yield.handler_.dispatcher_.get_io_service();
+            eps=async_resolve(ios, query, yield[ec]);
+        }
+        if (ec)
+            throw boost::system::system_error(ec);
+        return eps;
+    }
+    
+    void dns_cache::lookup(boost::asio::io_service &ios, const dns_query_t &query, const dns_callback_t &cb) {
+        std::string k=key(query);
+        dns_backend_t backend;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            std::int64_t now=timer_wheel::now();
+            entry_t &e=entries_[k];
+            if (e.pending && !e.waiters.empty()) {
+                // Someone is already looking it up
+                e.waiters.push_back(cb);
+                coalesced_++;
+                return;
+            }
+            if (!e.pending && e.expires>now) {
+                hits_++;
+                boost::system::error_code ec=e.error;
+                endpoints_ptr eps=e.endpoints;
+                // Callback is posting, safe to call with the lock held
+                cb(ec, eps);
+                return;
+            }
+            e.pending=true;
+            e.waiters.push_back(cb);
+            misses_++;
+            backend=backend_;
+            if (entries_.size()>options_.max_entries)
+                evict(now);
+        }
+        backend(ios, query, [this, k](const boost::system::error_code &ec, endpoints_ptr eps) {
+            complete(k, ec, eps);
+        });
+    }
+    
+    void dns_cache::complete(const std::string &k, const boost::system::error_code &ec, endpoints_ptr eps) {
+        std::vector<dns_callback_t> waiters;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            entry_t &e=entries_[k];
+            e.pending=false;
+            e.error=ec;
+            e.endpoints=eps;
+            e.expires=timer_wheel::now()+(ec ? options_.negative_ttl : options_.ttl).count();
+            waiters.swap(e.waiters);
+        }
+        for (const dns_callback_t &cb : waiters)
+            cb(ec, eps);
+    }
+    
+    void dns_cache::evict(std::int64_t now) {
+        for (entries_t::iterator i=entries_.begin(); i!=entries_.end(); ) {
+            if (!i->second.pending && i->second.expires<=now)
+                i=entries_.erase(i);
+            else
+                ++i;
+        }
+        // Still too many, drop finished entries even if fresh
+        for (entries_t::iterator i=entries_.begin(); i!=entries_.end() && entries_.size()>options_.max_entries; ) {
+            if (!i->second.pending)
+                i=entries_.erase(i);
+            else
+                ++i;
+        }
+    }
+    
+    void dns_cache::clear() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (entries_t::iterator i=entries_.begin(); i!=entries_.end(); ) {
+            if (!i->second.pending)
+                i=entries_.erase(i);
+            else
+                ++i;
+        }
+    }
+    
+    std::size_t dns_cache::size() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return entries_.size();
+    }
+}   // End of namespace net
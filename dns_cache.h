@@ -0,0 +1,166 @@
+//
+//  dns_cache.h
+//  coroserver
+//
+
+#ifndef __coroserver__dns_cache__
+#define __coroserver__dns_cache__
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <unordered_map>
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/asio/detail/bind_handler.hpp>
+#include "timer_wheel.h"
+
+namespace net {
+    enum class address_family {
+        unspecified,
+        v4,
+        v6,
+    };
+
+    struct dns_query_t {
+        std::string host;
+        std::string port;
+        address_family family;
+    };
+
+    typedef std::vector<boost::asio::ip::tcp::endpoint> endpoints_t;
+    typedef std::shared_ptr<const endpoints_t> endpoints_ptr;
+    typedef std::function<void(const boost::system::error_code &, endpoints_ptr)> dns_callback_t;
+
+    /**
+     * Lookup backend, must call the callback exactly once, from any thread
+     */
+    typedef std::function<void(boost::asio::io_service &, const dns_query_t &, const dns_callback_t &)> dns_backend_t;
+
+    struct dns_cache_options_t {
+        /**
+         * How long successful and failed lookups are cached
+         */
+        timeout_t ttl=std::chrono::seconds(60);
+        timeout_t negative_ttl=std::chrono::seconds(5);
+        /**
+         * Expired entries are dropped when the cache grows over this
+         */
+        std::size_t max_entries=4096;
+    };
+
+    /**
+     * Process-wide DNS cache shared by all threads
+     *
+     * Concurrent lookups of the same host, port and address family are coalesced into one call to
+     * the backend, the waiters are resumed through their own io_service
+     */
+    class dns_cache {
+    public:
+        dns_cache();
+
+        // Non-copyable
+        dns_cache(const dns_cache&) = delete;
+        dns_cache& operator=(const dns_cache&) = delete;
+
+        static dns_cache &instance();
+
+        /**
+         * Lookup with boost::asio::ip::tcp::resolver
+         */
+        static dns_backend_t default_backend();
+
+        void backend(const dns_backend_t &b);
+
+        dns_cache_options_t options() const;
+
+        void options(const dns_cache_options_t &opt);
+
+        /**
+         * Resolve within a coroutine, returns without yielding on cache hits
+         *
+         * Throws boost::system::system_error if the lookup failed
+         */
+        endpoints_ptr resolve(const dns_query_t &query, boost::asio::yield_context yield);
+
+        /**
+         * Asynchronous resolve, handler signature is void(boost::system::error_code, endpoints_ptr)
+         */
+        template<typename Handler>
+        BOOST_ASIO_INITFN_RESULT_TYPE(Handler, void(boost::system::error_code, endpoints_ptr))
+        async_resolve(boost::asio::io_service &ios, const dns_query_t &query, BOOST_ASIO_MOVE_ARG(Handler) handler)
+        {
+            typedef void signature_t(boost::system::error_code, endpoints_ptr);
+            typedef typename boost::asio::handler_type<Handler, signature_t>::type handler_t;
+            handler_t h(BOOST_ASIO_MOVE_CAST(Handler)(handler));
+            boost::asio::async_result<handler_t> result(h);
+            // Post the handler so it runs the way the io_service and the handler want, i.e. in a strand
+            lookup(ios, query, [&ios, h](const boost::system::error_code &ec, endpoints_ptr eps) {
+                ios.post(boost::asio::detail::bind_handler(h, ec, eps));
+            });
+            return result.get();
+        }
+
+        /**
+         * Drop all finished entries
+         */
+        void clear();
+
+        std::size_t size() const;
+
+        /**
+         * Lookups answered from the cache, including cached failures
+         */
+        std::size_t hits() const
+        { return hits_.load(std::memory_order_relaxed); }
+
+        /**
+         * Lookups sent to the backend
+         */
+        std::size_t misses() const
+        { return misses_.load(std::memory_order_relaxed); }
+
+        /**
+         * Lookups joined an outstanding lookup of the same query
+         */
+        std::size_t coalesced() const
+        { return coalesced_.load(std::memory_order_relaxed); }
+
+    private:
+        struct entry_t {
+            bool pending=true;
+            boost::system::error_code error;
+            endpoints_ptr endpoints;
+            std::int64_t expires=0;
+            std::vector<dns_callback_t> waiters;
+        };
+        typedef std::unordered_map<std::string, entry_t> entries_t;
+
+        static std::string key(const dns_query_t &query);
+
+        /**
+         * Returns true and sets result if there is a fresh entry
+         */
+        bool find(const std::string &k, boost::system::error_code &ec, endpoints_ptr &eps);
+
+        void lookup(boost::asio::io_service &ios, const dns_query_t &query, const dns_callback_t &cb);
+
+        void complete(const std::string &k, const boost::system::error_code &ec, endpoints_ptr eps);
+
+        void evict(std::int64_t now);
+
+        mutable std::mutex mutex_;
+        dns_backend_t backend_;
+        dns_cache_options_t options_;
+        entries_t entries_;
+        std::atomic<std::size_t> hits_;
+        std::atomic<std::size_t> misses_;
+        std::atomic<std::size_t> coalesced_;
+    };
+}   // End of namespace net
+
+#endif /* defined(__coroserver__dns_cache__) */
@@ -0,0 +1,219 @@
+//
+//  headers.cpp
+//  coroserver
+//
+
+#include <cstring>
+#include <algorithm>
+#include <functional>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include "headers.h"
+
+namespace http {
+    namespace details {
+        struct known_header_t {
+            const char *name;
+            std::size_t size;
+            header_id id;
+        };
+        
+#define KNOWN_HEADER(name, id) { name, sizeof(name)-1, header_id::id }
+        // Same order as header_id
+        constexpr known_header_t known_headers[]={
+            KNOWN_HEADER("", unknown),
+            KNOWN_HEADER("Accept", accept),
+            KNOWN_HEADER("Accept-Encoding", accept_encoding),
+            KNOWN_HEADER("Accept-Language", accept_language),
+            KNOWN_HEADER("Authorization", authorization),
+            KNOWN_HEADER("Cache-Control", cache_control),
+            KNOWN_HEADER("Connection", connection),
+            KNOWN_HEADER("Content-Encoding", content_encoding),
+            KNOWN_HEADER("Content-Length", content_length),
+            KNOWN_HEADER("Content-Type", content_type),
+            KNOWN_HEADER("Cookie", cookie),
+            KNOWN_HEADER("Date", date),
+            KNOWN_HEADER("ETag", etag),
+            KNOWN_HEADER("Expect", expect),
+            KNOWN_HEADER("Host", host),
+            KNOWN_HEADER("If-Modified-Since", if_modified_since),
+            KNOWN_HEADER("If-None-Match", if_none_match),
+            KNOWN_HEADER("Keep-Alive", keep_alive),
+            KNOWN_HEADER("Last-Modified", last_modified),
+            KNOWN_HEADER("Location", location),
+            KNOWN_HEADER("Proxy-Connection", proxy_connection),
+            KNOWN_HEADER("Range", range),
+            KNOWN_HEADER("Referer", referer),
+            KNOWN_HEADER("Server", server),
+            KNOWN_HEADER("Set-Cookie", set_cookie),
+            KNOWN_HEADER("Transfer-Encoding", transfer_encoding),
+            KNOWN_HEADER("Upgrade", upgrade),
+            KNOWN_HEADER("User-Agent", user_agent),
+            KNOWN_HEADER("Vary", vary),
+        };
+#undef KNOWN_HEADER
+        static_assert(sizeof(known_headers)/sizeof(known_headers[0])==static_cast<std::size_t>(header_id::count),
+                      "known_headers must match header_id");
+        
+        // Longest well-known name is "If-Modified-Since"
+        constexpr std::size_t max_known_size=17;
+        
+        inline char lower(char c)
+        { return (c>='A' && c<='Z') ? c+('a'-'A') : c; }
+        
+        inline bool iequals_scalar(const char *a, const char *b, std::size_t n) {
+            for (std::size_t i=0; i<n; i++) {
+                if (lower(a[i])!=lower(b[i])) return false;
+            }
+            return true;
+        }
+        
+#if defined(__SSE2__)
+        inline __m128i lower16(__m128i v) {
+            // 'A'-1 < c < 'Z'+1, bytes above 0x7f are negative and never upper case
+            __m128i upper=_mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('A'-1)),
+                                        _mm_cmplt_epi8(v, _mm_set1_epi8('Z'+1)));
+            return _mm_or_si128(v, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+        }
+#endif
+        
+        inline bool iequals(const char *a, const char *b, std::size_t n) {
+#if defined(__SSE2__)
+            while (n>=16) {
+                __m128i va=lower16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(a)));
+                __m128i vb=lower16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(b)));
+                if (_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb))!=0xffff) return false;
+                a+=16;
+                b+=16;
+                n-=16;
+            }
+#endif
+            return iequals_scalar(a, b, n);
+        }
+        
+        /**
+         * Well-known headers bucketed by name size
+         */
+        struct known_index_t {
+            known_index_t() {
+                std::fill(std::begin(heads), std::end(heads), 0);
+                std::fill(std::begin(next), std::end(next), 0);
+                // Build the chains backwards so each bucket keeps header_id order
+                for (std::size_t i=static_cast<std::size_t>(header_id::count)-1; i>0; i--) {
+                    std::size_t s=known_headers[i].size;
+                    next[i]=heads[s];
+                    heads[s]=i;
+                }
+            }
+            std::uint8_t heads[max_known_size+1];
+            std::uint8_t next[static_cast<std::size_t>(header_id::count)];
+        };
+        
+        const known_index_t &known_index() {
+            static const known_index_t index;
+            return index;
+        }
+    }   // End of namespace details
+    
+    header_id lookup_header_id(const string_ref_t &name) {
+        if (name.size()>details::max_known_size) return header_id::unknown;
+        const details::known_index_t &index=details::known_index();
+        for (std::size_t i=index.heads[name.size()]; i!=0; i=index.next[i]) {
+            if (details::iequals_scalar(name.data(), details::known_headers[i].name, name.size()))
+                return details::known_headers[i].id;
+        }
+        return header_id::unknown;
+    }
+    
+    string_ref_t header_name(header_id id) {
+        const details::known_header_t &h=details::known_headers[static_cast<std::size_t>(id)];
+        return string_ref_t(h.name, h.size);
+    }
+    
+    bool iequals(const string_ref_t &a, const string_ref_t &b) {
+        return a.size()==b.size() && details::iequals(a.data(), b.data(), a.size());
+    }
+    
+    void headers_t::clear() {
+        buffer_.clear();
+        entries_.clear();
+        clear_index();
+    }
+    
+    void headers_t::clear_index()
+    { std::fill(std::begin(first_), std::end(first_), 0); }
+    
+    void headers_t::rebuild_index() {
+        clear_index();
+        for (std::size_t i=entries_.size(); i>0; i--) {
+            first_[static_cast<std::size_t>(entries_[i-1].id)]=i;
+        }
+    }
+    
+    void headers_t::tag_last() {
+        entry_t &e=entries_.back();
+        std::uint32_t &old=first_[static_cast<std::size_t>(e.id)];
+        if (old==entries_.size()) old=0;
+        e.id=lookup_header_id(string_ref_t(buffer_.data()+e.offset, e.name_size));
+        std::uint32_t &slot=first_[static_cast<std::size_t>(e.id)];
+        if (e.id!=header_id::unknown && slot==0) slot=entries_.size();
+    }
+    
+    void headers_t::push_back(const string_ref_t &name, const string_ref_t &value) {
+        // The value may refer to buffer_, which can move when the name is appended
+        std::less<const char *> before;
+        const char *base=buffer_.data();
+        bool inside=!before(value.data(), base) && before(value.data(), base+buffer_.size());
+        std::size_t offset=inside ? value.data()-base : 0;
+        push_back_name(name.data(), name.size());
+        append_value(inside ? buffer_.data()+offset : value.data(), value.size());
+    }
+    
+    void headers_t::push_back_name(const char *at, std::size_t length) {
+        entry_t e={std::uint32_t(buffer_.size()), std::uint32_t(length), 0, header_id::unknown};
+        buffer_.append(at, length);
+        entries_.push_back(e);
+        tag_last();
+    }
+    
+    void headers_t::append_name(const char *at, std::size_t length) {
+        // Name comes in pieces only when the parser input is split, re-tag with the full name
+        buffer_.append(at, length);
+        entries_.back().name_size+=length;
+        tag_last();
+    }
+    
+    void headers_t::append_value(const char *at, std::size_t length) {
+        buffer_.append(at, length);
+        entries_.back().value_size+=length;
+    }
+    
+    headers_t::const_iterator headers_t::erase(const_iterator i) {
+        // The bytes stay in the buffer until cleared
+        entries_.erase(entries_.begin()+i.index());
+        rebuild_index();
+        return const_iterator(this, i.index());
+    }
+    
+    headers_t::const_iterator headers_t::find(const string_ref_t &name, bool case_sensitive) const {
+        header_id id=lookup_header_id(name);
+        if (id!=header_id::unknown) {
+            if (!case_sensitive) return find(id);
+            for (std::size_t i=first_[static_cast<std::size_t>(id)]; i!=0 && i<=entries_.size(); i++) {
+                const entry_t &e=entries_[i-1];
+                if (e.id==id && string_ref_t(buffer_.data()+e.offset, e.name_size)==name)
+                    return const_iterator(this, i-1);
+            }
+            return end();
+        }
+        for (std::size_t i=0; i<entries_.size(); i++) {
+            const entry_t &e=entries_[i];
+            if (e.id!=header_id::unknown || e.name_size!=name.size()) continue;
+            const char *p=buffer_.data()+e.offset;
+            if (case_sensitive ? std::memcmp(p, name.data(), name.size())==0 : details::iequals(p, name.data(), name.size()))
+                return const_iterator(this, i);
+        }
+        return end();
+    }
+}   // End of namespace http
@@ -0,0 +1,296 @@
+//
+//  headers.h
+//  coroserver
+//
+
+#ifndef __coroserver__headers__
+#define __coroserver__headers__
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <iterator>
+#include <utility>
+#include <boost/utility/string_ref.hpp>
+
+namespace http {
+    typedef boost::string_ref string_ref_t;
+    typedef std::pair<string_ref_t, string_ref_t> header_t;
+
+    /**
+     * Well-known headers, recognized when a header is added
+     */
+    enum class header_id : std::uint8_t {
+        unknown,
+        accept,
+        accept_encoding,
+        accept_language,
+        authorization,
+        cache_control,
+        connection,
+        content_encoding,
+        content_length,
+        content_type,
+        cookie,
+        date,
+        etag,
+        expect,
+        host,
+        if_modified_since,
+        if_none_match,
+        keep_alive,
+        last_modified,
+        location,
+        proxy_connection,
+        range,
+        referer,
+        server,
+        set_cookie,
+        transfer_encoding,
+        upgrade,
+        user_agent,
+        vary,
+        // Must be the last one
+        count,
+    };
+
+    /**
+     * Id of a well-known header name, case insensitive, header_id::unknown for others
+     */
+    header_id lookup_header_id(const string_ref_t &name);
+
+    /**
+     * Canonical name of a well-known header, i.e. "Content-Length"
+     */
+    string_ref_t header_name(header_id id);
+
+    /**
+     * Case insensitive ASCII comparison, uses SSE2 if available
+     */
+    bool iequals(const string_ref_t &a, const string_ref_t &b);
+
+    /**
+     * HTTP header block
+     *
+     * Names and values are stored back to back in one buffer, the entries only keep offsets,
+     * well-known headers are tagged with an id and the first one of each id is found in O(1).
+     *
+     * Iterators yield std::pair<string_ref_t, string_ref_t> referring to the buffer, they are
+     * invalidated when headers are added, removed, or cleared
+     */
+    class headers_t {
+        struct entry_t {
+            std::uint32_t offset;
+            std::uint32_t name_size;
+            std::uint32_t value_size;
+            header_id id;
+        };
+        typedef std::vector<entry_t> entries_t;
+
+    public:
+        typedef header_t value_type;
+
+        class const_iterator : public std::iterator<std::random_access_iterator_tag, const header_t> {
+        public:
+            const_iterator()
+            : headers_(nullptr)
+            , index_(0)
+            {}
+
+            const_iterator(const headers_t *headers, std::size_t index)
+            : headers_(headers)
+            , index_(index)
+            {}
+
+            const header_t &operator*() const
+            { current_=headers_->at(index_); return current_; }
+
+            const header_t *operator->() const
+            { return &(operator*()); }
+
+            /**
+             * Id of the header this iterator points to
+             */
+            header_id id() const
+            { return headers_->entries_[index_].id; }
+
+            std::size_t index() const
+            { return index_; }
+
+            const_iterator &operator++()
+            { ++index_; return *this; }
+
+            const_iterator operator++(int)
+            { const_iterator r(*this); ++index_; return r; }
+
+            const_iterator &operator--()
+            { --index_; return *this; }
+
+            const_iterator operator--(int)
+            { const_iterator r(*this); --index_; return r; }
+
+            const_iterator &operator+=(std::ptrdiff_t n)
+            { index_+=n; return *this; }
+
+            const_iterator &operator-=(std::ptrdiff_t n)
+            { index_-=n; return *this; }
+
+            const_iterator operator+(std::ptrdiff_t n) const
+            { return const_iterator(headers_, index_+n); }
+
+            const_iterator operator-(std::ptrdiff_t n) const
+            { return const_iterator(headers_, index_-n); }
+
+            std::ptrdiff_t operator-(const const_iterator &other) const
+            { return std::ptrdiff_t(index_)-std::ptrdiff_t(other.index_); }
+
+            header_t operator[](std::ptrdiff_t n) const
+            { return headers_->at(index_+n); }
+
+            bool operator==(const const_iterator &other) const
+            { return index_==other.index_; }
+
+            bool operator!=(const const_iterator &other) const
+            { return index_!=other.index_; }
+
+            bool operator<(const const_iterator &other) const
+            { return index_<other.index_; }
+
+            bool operator>(const const_iterator &other) const
+            { return index_>other.index_; }
+
+            bool operator<=(const const_iterator &other) const
+            { return index_<=other.index_; }
+
+            bool operator>=(const const_iterator &other) const
+            { return index_>=other.index_; }
+
+        private:
+            const headers_t *headers_;
+            std::size_t index_;
+            mutable header_t current_;
+        };
+        typedef const_iterator iterator;
+
+        headers_t()
+        { clear_index(); }
+
+        std::size_t size() const
+        { return entries_.size(); }
+
+        bool empty() const
+        { return entries_.empty(); }
+
+        const_iterator begin() const
+        { return const_iterator(this, 0); }
+
+        const_iterator end() const
+        { return const_iterator(this, entries_.size()); }
+
+        /**
+         * Name and value of the n-th header
+         */
+        value_type at(std::size_t n) const {
+            const entry_t &e=entries_[n];
+            const char *p=buffer_.data()+e.offset;
+            return value_type(string_ref_t(p, e.name_size), string_ref_t(p+e.name_size, e.value_size));
+        }
+
+        /**
+         * Remove all headers, the capacity is kept
+         */
+        void clear();
+
+        void reserve(std::size_t headers, std::size_t bytes) {
+            entries_.reserve(headers);
+            buffer_.reserve(bytes);
+        }
+
+        /**
+         * Add a header, name and value are copied
+         */
+        void push_back(const value_type &h)
+        { push_back(h.first, h.second); }
+
+        void push_back(const string_ref_t &name, const string_ref_t &value);
+
+        /**
+         * Start a new header, used by parsers which get name and value in pieces
+         */
+        void push_back_name(const char *at, std::size_t length);
+
+        /**
+         * Append to the name of the last header
+         */
+        void append_name(const char *at, std::size_t length);
+
+        /**
+         * Append to the value of the last header
+         */
+        void append_value(const char *at, std::size_t length);
+
+        /**
+         * Remove a header, following iterators are invalidated
+         */
+        const_iterator erase(const_iterator i);
+
+        /**
+         * Find the first header with the name
+         */
+        const_iterator find(const string_ref_t &name, bool case_sensitive=false) const;
+
+        /**
+         * Find the first well-known header in O(1)
+         */
+        const_iterator find(header_id id) const {
+            std::size_t n=first_[static_cast<std::size_t>(id)];
+            return n ? const_iterator(this, n-1) : end();
+        }
+
+        /**
+         * Value of the first header with the id, empty if not found
+         */
+        string_ref_t value(header_id id) const {
+            std::size_t n=first_[static_cast<std::size_t>(id)];
+            return n ? at(n-1).second : string_ref_t();
+        }
+
+        bool contains(header_id id) const
+        { return first_[static_cast<std::size_t>(id)]!=0; }
+
+    private:
+        void clear_index();
+        void rebuild_index();
+        void tag_last();
+
+        std::string buffer_;
+        entries_t entries_;
+        // Index+1 of the first entry for each well-known header, 0 if absent
+        std::uint32_t first_[static_cast<std::size_t>(header_id::count)];
+    };
+
+    template<typename Headers>
+    inline typename Headers::const_iterator find_header(const Headers &headers, const string_ref_t &key, bool case_sensitive=false) {
+        for (typename Headers::const_iterator i=headers.begin(); i!=headers.end(); ++i) {
+            if (case_sensitive) {
+                if (i->first==key) {
+                    return i;
+                }
+            } else {
+                if (iequals(i->first, key)) {
+                    return i;
+                }
+            }
+        }
+        return headers.end();
+    }
+
+    inline headers_t::const_iterator find_header(const headers_t &headers, const string_ref_t &key, bool case_sensitive=false)
+    { return headers.find(key, case_sensitive); }
+
+    inline headers_t::const_iterator find_header(const headers_t &headers, header_id id)
+    { return headers.find(id); }
+}   // End of namespace http
+
+#endif /* defined(__coroserver__headers__) */
@@ -6,8 +6,15 @@
 //  Copyright (c) 2013 0d0a.com. All rights reserved.
 //
 
-#include <map>
+#include <array>
+#include <ctime>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <climits>
 #include <iostream>
+#include <map>
+#include <unistd.h>
 #include <boost/interprocess/streams/vectorstream.hpp>
 #include "http-parser/http_parser.h"
 #include "http_protocol.h"
@@ -17,83 +24,438 @@ namespace http {
     typedef std::function<bool(session_t &)> parse_callback_t;
     
     namespace details {
-        const std::map<status_code, std::string> status_code_msg_map={
-            {CONTINUE                       , "Continue"},
-            {SWITCHING_PROTOCOLS            , "Switching Protocols"},
-            {OK                             , "OK"},
-            {CREATED                        , "Created"},
-            {ACCEPTED                       , "Accepted"},
-            {NON_AUTHORITATIVE_INFORMATION  , "Non-Authoritative Information"},
-            {NO_CONTENT                     , "No Content"},
-            {RESET_CONTENT                  , "Reset Content"},
-            {PARTIAL_CONTENT                , "Partial Content"},
-            {MULTIPLE_CHOICES               , "Multiple Choices"},
-            {MOVED_PERMANENTLY              , "Moved Permanently"},
-            {FOUND                          , "Found"},
-            {SEE_OTHER                      , "See Other"},
-            {NOT_MODIFIED                   , "Not Modified"},
-            {USE_PROXY                      , "Use Proxy"},
-            {TEMPORARY_REDIRECT             , "Temporary Redirect"},
-            {BAD_REQUEST                    , "Bad Request"},
-            {UNAUTHORIZED                   , "Unauthorized"},
-            {PAYMENT_REQUIRED               , "Payment Required"},
-            {FORBIDDEN                      , "Forbidden"},
-            {NOT_FOUND                      , "Not Found"},
-            {METHOD_NOT_ALLOWED             , "Method Not Allowed"},
-            {NOT_ACCEPTABLE                 , "Not Acceptable"},
-            {PROXY_AUTHENTICATION_REQUIRED  , "Proxy Authentication Required"},
-            {REQUEST_TIMEOUT                , "Request Timeout"},
-            {CONFLICT                       , "Conflict"},
-            {GONE                           , "Gone"},
-            {LENGTH_REQUIRED                , "Length Required"},
-            {PRECONDITION_FAILED            , "Precondition Failed"},
-            {REQUEST_ENTITY_TOO_LARGE       , "Request Entity Too Large"},
-            {REQUEST_URI_TOO_LONG           , "Request-URI Too Long"},
-            {UNSUPPORTED_MEDIA_TYPE         , "Unsupported Media Type"},
-            {REQUESTED_RANGE_NOT_SATISFIABLE, "Requested Range Not Satisfiable"},
-            {EXPECTATION_FAILED             , "Expectation Failed"},
-            {INTERNAL_SERVER_ERROR          , "Internal Server Error"},
-            {NOT_IMPLEMENTED                , "Not Implemented"},
-            {BAD_GATEWAY                    , "Bad Gateway"},
-            {SERVICE_UNAVAILABLE            , "Service Unavailable"},
-            {GATEWAY_TIMEOUT                , "Gateway Timeout"},
-            {HTTP_VERSION_NOT_SUPPORTED     , "HTTP Version Not Supported"},
+        struct name_t {
+            const char *data;
+            size_t size;
+        };
+        
+#define HTTP_STATUS_LINE(code, msg) {"HTTP/1.1 " #code " " msg "\r\n", sizeof("HTTP/1.1 " #code " " msg "\r\n")-1}
+        /**
+         * Rendered status lines, indexed by status class and the last 2 digits
+         */
+        constexpr name_t status_lines[6][18]={
+            {},
+            {
+                HTTP_STATUS_LINE(100, "Continue"),
+                HTTP_STATUS_LINE(101, "Switching Protocols"),
+            },
+            {
+                HTTP_STATUS_LINE(200, "OK"),
+                HTTP_STATUS_LINE(201, "Created"),
+                HTTP_STATUS_LINE(202, "Accepted"),
+                HTTP_STATUS_LINE(203, "Non-Authoritative Information"),
+                HTTP_STATUS_LINE(204, "No Content"),
+                HTTP_STATUS_LINE(205, "Reset Content"),
+                HTTP_STATUS_LINE(206, "Partial Content"),
+            },
+            {
+                HTTP_STATUS_LINE(300, "Multiple Choices"),
+                HTTP_STATUS_LINE(301, "Moved Permanently"),
+                HTTP_STATUS_LINE(302, "Found"),
+                HTTP_STATUS_LINE(303, "See Other"),
+                HTTP_STATUS_LINE(304, "Not Modified"),
+                HTTP_STATUS_LINE(305, "Use Proxy"),
+                {nullptr, 0},
+                HTTP_STATUS_LINE(307, "Temporary Redirect"),
+            },
+            {
+                HTTP_STATUS_LINE(400, "Bad Request"),
+                HTTP_STATUS_LINE(401, "Unauthorized"),
+                HTTP_STATUS_LINE(402, "Payment Required"),
+                HTTP_STATUS_LINE(403, "Forbidden"),
+                HTTP_STATUS_LINE(404, "Not Found"),
+                HTTP_STATUS_LINE(405, "Method Not Allowed"),
+                HTTP_STATUS_LINE(406, "Not Acceptable"),
+                HTTP_STATUS_LINE(407, "Proxy Authentication Required"),
+                HTTP_STATUS_LINE(408, "Request Timeout"),
+                HTTP_STATUS_LINE(409, "Conflict"),
+                HTTP_STATUS_LINE(410, "Gone"),
+                HTTP_STATUS_LINE(411, "Length Required"),
+                HTTP_STATUS_LINE(412, "Precondition Failed"),
+                HTTP_STATUS_LINE(413, "Request Entity Too Large"),
+                HTTP_STATUS_LINE(414, "Request-URI Too Long"),
+                HTTP_STATUS_LINE(415, "Unsupported Media Type"),
+                HTTP_STATUS_LINE(416, "Requested Range Not Satisfiable"),
+                HTTP_STATUS_LINE(417, "Expectation Failed"),
+            },
+            {
+                HTTP_STATUS_LINE(500, "Internal Server Error"),
+                HTTP_STATUS_LINE(501, "Not Implemented"),
+                HTTP_STATUS_LINE(502, "Bad Gateway"),
+                HTTP_STATUS_LINE(503, "Service Unavailable"),
+                HTTP_STATUS_LINE(504, "Gateway Timeout"),
+                HTTP_STATUS_LINE(505, "HTTP Version Not Supported"),
+            },
         };
+#undef HTTP_STATUS_LINE
         
-        const std::map<method, std::string> method_name_map={
-            {DELETE, "DELETE"},
-            {GET, "GET"},
-            {HEAD, "HEAD"},
-            {POST, "POST"},
-            {PUT, "PUT"},
+#define HTTP_METHOD_NAME(name) {name, sizeof(name)-1}
+        /**
+         * Method names, indexed by http::method
+         */
+        constexpr name_t method_names[]={
+            HTTP_METHOD_NAME("DELETE"),
+            HTTP_METHOD_NAME("GET"),
+            HTTP_METHOD_NAME("HEAD"),
+            HTTP_METHOD_NAME("POST"),
+            HTTP_METHOD_NAME("PUT"),
             /* pathological */
-            {CONNECT, "CONNECT"},
-            {OPTIONS, "OPTIONS"},
-            {TRACE, "TRACE"},
+            HTTP_METHOD_NAME("CONNECT"),
+            HTTP_METHOD_NAME("OPTIONS"),
+            HTTP_METHOD_NAME("TRACE"),
             /* webdav */
-            {COPY, "COPY"},
-            {LOCK, "LOCK"},
-            {MKCOL, "MKCOL"},
-            {MOVE, "MOVE"},
-            {PROPFIND, "PROPFIND"},
-            {PROPPATCH, "PROPPATCH"},
-            {SEARCH, "SEARCH"},
-            {UNLOCK, "UNLOCK"},
+            HTTP_METHOD_NAME("COPY"),
+            HTTP_METHOD_NAME("LOCK"),
+            HTTP_METHOD_NAME("MKCOL"),
+            HTTP_METHOD_NAME("MOVE"),
+            HTTP_METHOD_NAME("PROPFIND"),
+            HTTP_METHOD_NAME("PROPPATCH"),
+            HTTP_METHOD_NAME("SEARCH"),
+            HTTP_METHOD_NAME("UNLOCK"),
             /* subversion */
-            {REPORT, "REPORT"},
-            {MKACTIVITY, "MKACTIVITY"},
-            {CHECKOUT, "CHECKOUT"},
-            {MERGE, "MERGE"},
+            HTTP_METHOD_NAME("REPORT"),
+            HTTP_METHOD_NAME("MKACTIVITY"),
+            HTTP_METHOD_NAME("CHECKOUT"),
+            HTTP_METHOD_NAME("MERGE"),
             /* upnp */
-            {MSEARCH, "MSEARCH"},
-            {NOTIFY, "NOTIFY"},
-            {SUBSCRIBE, "SUBSCRIBE"},
-            {UNSUBSCRIBE, "UNSUBSCRIBE"},
+            HTTP_METHOD_NAME("M-SEARCH"),
+            HTTP_METHOD_NAME("NOTIFY"),
+            HTTP_METHOD_NAME("SUBSCRIBE"),
+            HTTP_METHOD_NAME("UNSUBSCRIBE"),
             /* RFC-5789 */
-            {PATCH, "PATCH"},
-            {PURGE, "PURGE"},
+            HTTP_METHOD_NAME("PATCH"),
+            HTTP_METHOD_NAME("PURGE"),
+        };
+#undef HTTP_METHOD_NAME
+        static_assert(sizeof(method_names)/sizeof(method_names[0])==PURGE+1, "Method name table is out of sync with http::method");
+        
+        /**
+         * Responses never having a body, nor framing headers (RFC 7230 3.3)
+         */
+        inline bool bodyless_status(unsigned code)
+        { return code/100==1 || code==NO_CONTENT || code==NOT_MODIFIED; }
+        
+        constexpr char connection_close[]="Connection: close\r\n";
+        constexpr char connection_keep_alive[]="Connection: keep-alive\r\nKeep-Alive: timeout=";
+        constexpr char keep_alive_max[]=", max=";
+        
+        /**
+         * Write decimal representation of v at p, returns the end
+         */
+        inline char *format_uint(char *p, unsigned long long v) {
+            char buf[24];
+            char *q=buf+sizeof(buf);
+            do {
+                *--q='0'+v%10;
+                v/=10;
+            } while (v);
+            size_t n=buf+sizeof(buf)-q;
+            memcpy(p, q, n);
+            return p+n;
+        }
+        
+        /**
+         * Write hexadecimal representation of v at p, returns the end
+         */
+        inline char *format_hex(char *p, unsigned long long v) {
+            char tmp[16];
+            char *t=tmp;
+            do {
+                *t++="0123456789abcdef"[v & 0xf];
+                v>>=4;
+            } while (v);
+            while (t>tmp) *p++=*--t;
+            return p;
+        }
+        
+        inline void append_uint(std::string &out, unsigned long long v) {
+            char buf[24];
+            out.append(buf, format_uint(buf, v)-buf);
+        }
+        
+        /**
+         * Render Connection and Keep-Alive headers into buf, max=0 means no limit
+         *
+         * Keep-Alive timeout is in seconds, rounded up
+         */
+        inline string_ref_t keep_alive_headers(char *buf, net::timeout_t timeout, int max) {
+            char *p=buf;
+            memcpy(p, connection_keep_alive, sizeof(connection_keep_alive)-1);
+            p=format_uint(p+sizeof(connection_keep_alive)-1, (timeout.count()+999)/1000);
+            if (max>0) {
+                memcpy(p, keep_alive_max, sizeof(keep_alive_max)-1);
+                p=format_uint(p+sizeof(keep_alive_max)-1, max);
+            }
+            *p++='\r';
+            *p++='\n';
+            return string_ref_t(buf, p-buf);
+        }
+        constexpr size_t keep_alive_headers_size=sizeof(connection_keep_alive)+sizeof(keep_alive_max)+48;
+        
+        /**
+         * Connection and Keep-Alive headers of the response, keep_alive is cleared if the
+         * connection is going to be closed
+         */
+        inline string_ref_t connection_headers(const session_t &session, char *buf, bool &keep_alive) {
+            if (!keep_alive) return connection_close;
+            if (session.max_keepalive()==0) {
+                // Limitless keep-alive
+                return keep_alive_headers(buf, session.read_timeout(), 0);
+            }
+            if (session.max_keepalive()>session.count()) {
+                // Keep-alive in progress
+                return keep_alive_headers(buf, session.read_timeout(), session.max_keepalive()-session.count());
+            }
+            // Max limit reached, stop keeping alive
+            keep_alive=false;
+            return connection_close;
+        }
+        
+        /**
+         * Date and Server headers, rendered at most once per second per thread
+         */
+        struct date_server_block_t {
+            std::time_t time;
+            size_t date_size;
+            size_t size;
+            char data[128];
+        };
+        
+        /**
+         * Returns "Date: ...\r\nServer: ...\r\n", the first date_size bytes are the Date header
+         */
+        inline const date_server_block_t &date_server_block() {
+            static thread_local date_server_block_t block;
+            std::time_t now=std::time(nullptr);
+            if (now!=block.time || block.size==0) {
+                std::tm tm;
+                gmtime_r(&now, &tm);
+                block.date_size=strftime(block.data, sizeof(block.data), "Date: %a, %d %b %Y %H:%M:%S GMT\r\n", &tm);
+                int n=snprintf(block.data+block.date_size, sizeof(block.data)-block.date_size, "Server: %s\r\n", server_name);
+                block.size=block.date_size+n;
+                block.time=now;
+            }
+            return block;
+        }
+        
+        /**
+         * Append the parts of the Date/Server block the response doesn't have already
+         */
+        inline void append_date_server(std::string &out, bool has_date, bool has_server) {
+            const date_server_block_t &ds=date_server_block();
+            std::size_t begin=has_date ? ds.date_size : 0;
+            std::size_t end=has_server ? ds.date_size : ds.size;
+            out.append(ds.data+begin, end-begin);
+        }
+        
+        /**
+         * Empty the body without giving up its capacity
+         */
+        // NOTE: Why there is no clear() in ovectorstream?
+        inline void clear_body(body_stream_t &body_stream) {
+            std::string v;
+            body_stream.swap_vector(v);
+            v.clear();
+            body_stream.swap_vector(v);
+        }
+        
+        inline bool write_all(int fd, const char *data, std::size_t size) {
+            while (size>0) {
+                ssize_t n=::write(fd, data, size);
+                if (n<0) {
+                    if (errno==EINTR) continue;
+                    return false;
+                }
+                data+=n;
+                size-=n;
+            }
+            return true;
+        }
+        
+        inline void append(std::string &out, const string_ref_t &s)
+        { out.append(s.data(), s.size()); }
+        
+        /**
+         * Status line and response headers
+         *
+         * Returns false if the status code is unknown
+         */
+        bool render_status_headers(std::string &out, const response_t &resp, bool content_length) {
+            string_ref_t line=status_line(resp.code());
+            if (line.empty() && resp.status_message().empty()) {
+                // Unknown HTTP status code
+                return false;
+            }
+            if (!resp.status_message().empty()) {
+                // Supplied status message
+                out.append("HTTP/1.1 ");
+                append_uint(out, resp.code());
+                out.push_back(' ');
+                out.append(resp.status_message());
+                out.append("\r\n");
+            } else {
+                out.append(line.data(), line.size());
+            }
+            
+            for (headers_t::const_iterator i=resp.headers().begin(); i!=resp.headers().end(); ++i) {
+                if (!content_length && i.id()==header_id::content_length) continue;
+                append(out, i->first);
+                out.append(": ");
+                append(out, i->second);
+                out.append("\r\n");
+            }
+            return true;
+        }
+        
+        /**
+         * Body sent with the head, the prepared one if there is
+         */
+        inline const std::string &body_of(const response_t &resp)
+        { return resp.prepared() ? resp.prepared()->body : resp.body(); }
+        
+        /**
+         * Body worth compressing, only checks the response itself
+         */
+        bool compressible(const response_t &resp, const compression_options_t &opt) {
+            if (!opt.enabled || resp.has_file_body() || resp.prepared()) return false;
+            switch (resp.code()) {
+                case NO_CONTENT:
+                case PARTIAL_CONTENT:
+                case NOT_MODIFIED:
+                    return false;
+                default:
+                    break;
+            }
+            return resp.code()>=200
+                && !resp.body().empty()
+                && resp.body().size()>=opt.min_size
+                && !resp.headers().contains(header_id::content_encoding)
+                && compressible_type(resp.headers().value(header_id::content_type));
+        }
+        
+        /**
+         * True if a Vary header already covers Accept-Encoding
+         */
+        bool varies_on_encoding(const headers_t &headers) {
+            for (headers_t::const_iterator i=headers.find(header_id::vary); i!=headers.end(); ++i) {
+                if (i.id()!=header_id::vary) continue;
+                string_ref_t v=i->second;
+                if (v.find('*')!=string_ref_t::npos) return true;
+                for (std::size_t n=0; n+15<=v.size(); n++) {
+                    if (iequals(v.substr(n, 15), "accept-encoding")) return true;
+                }
+            }
+            return false;
+        }
+        
+        /**
+         * Compress the body if the client accepts it, or switch a prepared response to its compressed variant
+         */
+        void compress_response(session_t &session) {
+            const compression_options_t &opt=session.compression();
+            response_t &resp=session.response();
+            if (!opt.enabled) return;
+            if (resp.prepared()) {
+                if (!resp.prepared()->compressible) return;
+                content_coding c=negotiate_coding(session.request().headers().value(header_id::accept_encoding));
+                if (c==content_coding::identity) return;
+                prepared_response_ptr v=compressed_variant(*resp.prepared(), c, opt.variant_level);
+                if (v) resp.prepared(v);
+                return;
+            }
+            if (!compressible(resp, opt)) return;
+            // Caches need to know the body depends on Accept-Encoding, even if it's not compressed this time
+            if (!varies_on_encoding(resp.headers()))
+                resp.headers().push_back("Vary", "Accept-Encoding");
+            content_coding c=negotiate_coding(session.request().headers().value(header_id::accept_encoding));
+            if (c==content_coding::identity) return;
+            std::string out;
+            if (!compress(c, adaptive_level(opt), resp.body(), out) || out.size()>=resp.body().size())
+                return;
+            resp.body_stream().swap_vector(out);
+            resp.headers().push_back("Content-Encoding", coding_name(c));
+        }
+        
+        /**
+         * Render status line, headers and the empty line ending the head
+         *
+         * Returns false if the status code is unknown, a bodyless 500 head is rendered instead
+         *
+         * @param extra_headers rendered headers appended after the others, i.e. Connection and Keep-Alive
+         * @param content_length add Content-Length if the response has none
+         */
+        bool render_head(std::string &out, const response_t &resp, const string_ref_t &extra_headers, bool content_length) {
+            out.clear();
+            if (resp.prepared()) {
+                const prepared_response_t &p=*resp.prepared();
+                out.append(p.head);
+                append_date_server(out, p.has_date, p.has_server);
+                out.append("Content-Length: ");
+                append_uint(out, p.body.size());
+                out.append("\r\n");
+                append(out, extra_headers);
+                out.append("\r\n");
+                return true;
+            }
+            if (!render_status_headers(out, resp, true)) {
+                out.clear();
+                string_ref_t line=status_line(INTERNAL_SERVER_ERROR);
+                out.append(line.data(), line.size());
+                append(out, extra_headers);
+                out.append("Content-Length: 0\r\n\r\n");
+                return false;
+            }
+            append_date_server(out, resp.headers().contains(header_id::date), resp.headers().contains(header_id::server));
+            if (content_length && !resp.headers().contains(header_id::content_length)) {
+                out.append("Content-Length: ");
+                append_uint(out, resp.has_file_body() ? resp.file_body().size : resp.body().size());
+                out.append("\r\n");
+            }
+            append(out, extra_headers);
+            out.append("\r\n");
+            return true;
+        }
+        
+        struct http_metrics_t {
+            const route_metrics_t *unrouted;
+            net::metrics::counter keepalive_requests;
+            net::metrics::counter upstream_reused;
+            net::metrics::counter upstream_connected;
+            net::metrics::counter proxy_relayed;
+            net::metrics::counter proxy_failed;
+            net::metrics::histogram proxy_latency;
+            net::metrics::counter shed;
         };
         
+        const http_metrics_t &http_metrics() {
+            static const http_metrics_t metrics{
+                route_metrics("none"),
+                net::metrics::make_counter("http_keepalive_requests_total",
+                                           "Requests received on a connection after its first request"),
+                net::metrics::make_counter("http_proxy_upstream_connections_total",
+                                           "Upstream connections used by the proxy",
+                                           {{"reused", "true"}}),
+                net::metrics::make_counter("http_proxy_upstream_connections_total",
+                                           "Upstream connections used by the proxy",
+                                           {{"reused", "false"}}),
+                net::metrics::make_counter("http_proxy_responses_total",
+                                           "Upstream responses relayed by the proxy",
+                                           {{"result", "relayed"}}),
+                net::metrics::make_counter("http_proxy_responses_total",
+                                           "Upstream responses relayed by the proxy",
+                                           {{"result", "failed"}}),
+                net::metrics::make_histogram("http_proxy_response_duration_seconds",
+                                             "Time to relay an upstream response"),
+                net::metrics::make_counter("http_requests_shed_total",
+                                           "Requests answered with 503 while the server is overloaded"),
+            };
+            return metrics;
+        }
+        
+        inline std::uint64_t elapsed_us(std::chrono::steady_clock::time_point start) {
+            return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now()-start).count();
+        }
+        
         namespace request {
             struct parser {
                 enum parser_state{
@@ -102,25 +464,36 @@ namespace http {
                     url,
                     field,
                     value,
+                    headers,
                     body,
                     end
                 };
                 
+                static constexpr std::size_t buf_size=1024;
+                
                 request_t &req() { return session_.request(); }
+                std::string &buffer() { return req().buffer_; }
+                
+                string_ref_t ref(size_t off, size_t len)
+                { return string_ref_t(buffer().data()+off, len); }
                 
                 int on_message_begin() {
+                    session_.start_=std::chrono::steady_clock::now();
                     req().clear();
-                    url_.clear();
+                    url_off_=url_len_=0;
+                    received_=0;
+                    reject_=OK;
+                    expect_continue_=false;
+                    discard_=false;
+                    session_.body_error_=OK;
                     state_=start;
                     return 0;
                 }
                 int on_url(const char *at, size_t length) {
-                    if(state_==url)
-                        url_.append(at, length);
-                    else {
-                        url_.reserve(1024);
-                        url_.assign(at, length);
-                    }
+                    if(state_!=url)
+                        url_off_=buffer().size();
+                    buffer().append(at, length);
+                    url_len_+=length;
                     state_=url;
                     return 0;
                 }
@@ -128,57 +501,41 @@ namespace http {
                     return 0;
                 }
                 int on_header_field(const char *at, size_t length) {
-                    if (state_==field) {
-                        req().headers().rbegin()->first.append(at, length);
-                    } else {
-                        req().headers().push_back(header_t());
-                        req().headers().rbegin()->first.reserve(256);
-                        req().headers().rbegin()->first.assign(at, length);
-                    }
+                    if (state_==field)
+                        req().headers().append_name(at, length);
+                    else
+                        req().headers().push_back_name(at, length);
                     state_=field;
                     return 0;
                 }
                 int on_header_value(const char *at, size_t length) {
-                    if (state_==value)
-                        req().headers().rbegin()->second.append(at, length);
-                    else {
-                        req().headers().rbegin()->second.reserve(256);
-                        req().headers().rbegin()->second.assign(at, length);
-                    }
+                    req().headers().append_value(at, length);
                     state_=value;
                     return 0;
                 }
                 int on_headers_complete() {
-                    return 0;
-                }
-                int on_body(const char *at, size_t length) {
-                    req().body_stream().write(at, length);
-                    state_=body;
-                    return 0;
-                }
-                int on_message_complete() {
-                    state_=end;
+                    // The request buffer doesn't grow any more, it's safe to refer to it now
                     req().method((method)(parser_.method));
                     req().http_major(parser_.http_major);
                     req().http_minor(parser_.http_minor);
                     http_parser_url u;
-                    http_parser_parse_url(url_.c_str(),
-                                          url_.size(),
-                                          req().method()==CONNECT,
-                                          &u);
+                    if(http_parser_parse_url(buffer().data()+url_off_,
+                                             url_len_,
+                                             req().method()==CONNECT,
+                                             &u)!=0)
+                    {
+                        u.field_set=0;
+                    }
                     // Components for proxy requests
                     // NOTE: Schema, user info, host, and port may only exist in proxy requests
                     if(u.field_set & 1 << UF_SCHEMA) {
-                        req().schema(std::string(url_.begin()+u.field_data[UF_SCHEMA].off,
-                                                 url_.begin()+u.field_data[UF_SCHEMA].off+u.field_data[UF_SCHEMA].len));
+                        req().schema_=url_field(u, UF_SCHEMA);
                     }
                     if(u.field_set & 1 << UF_USERINFO) {
-                        req().user_info(std::string(url_.begin()+u.field_data[UF_USERINFO].off,
-                                                    url_.begin()+u.field_data[UF_USERINFO].off+u.field_data[UF_USERINFO].len));
+                        req().user_info_=url_field(u, UF_USERINFO);
                     }
                     if(u.field_set & 1 << UF_HOST) {
-                        req().host(std::string(url_.begin()+u.field_data[UF_HOST].off,
-                                               url_.begin()+u.field_data[UF_HOST].off+u.field_data[UF_HOST].len));
+                        req().host_=url_field(u, UF_HOST);
                     }
                     if(u.field_set & 1 << UF_PORT) {
                         req().port(u.port);
@@ -187,26 +544,96 @@ namespace http {
                     }
                     // Common components
                     if(u.field_set & 1 << UF_PATH) {
-                        req().path(std::string(url_.begin()+u.field_data[UF_PATH].off,
-                                               url_.begin()+u.field_data[UF_PATH].off+u.field_data[UF_PATH].len));
+                        req().path_=url_field(u, UF_PATH);
                     }
                     if(u.field_set & 1 << UF_QUERY) {
-                        req().query(std::string(url_.begin()+u.field_data[UF_QUERY].off,
-                                                url_.begin()+u.field_data[UF_QUERY].off+u.field_data[UF_QUERY].len));
+                        req().query_=url_field(u, UF_QUERY);
                     }
                     req().keep_alive(http_should_keep_alive(&parser_));
-                    return (should_continue_=cb_(session_)) ? 0 : -1;
+                    
+                    // Requests without a body are dispatched when complete as usual
+                    bool chunked=parser_.flags & F_CHUNKED;
+                    if (parser_.upgrade || !(chunked || (parser_.content_length>0 && parser_.content_length!=ULLONG_MAX)))
+                        return 0;
+                    const body_options_t &options=session_.body_options();
+                    if (options.max_size>0 && !chunked && parser_.content_length>options.max_size) {
+                        // Rejected before reading any of it
+                        reject_=REQUEST_ENTITY_TOO_LARGE;
+                        state_=headers;
+                        http_parser_pause(&parser_, 1);
+                        return 0;
+                    }
+                    expect_continue_=(req().http_major()>1 || (req().http_major()==1 && req().http_minor()>=1))
+                                     && iequals(req().headers().value(header_id::expect), "100-continue");
+                    if (options.streaming) {
+                        // Dispatch now, "100 Continue" is sent when the handler starts reading
+                        state_=headers;
+                        http_parser_pause(&parser_, 1);
+                    } else {
+                        send_continue();
+                    }
+                    return 0;
+                }
+                int on_body(const char *at, size_t length) {
+                    received_+=length;
+                    state_=body;
+                    const body_options_t &options=session_.body_options();
+                    if (options.max_size>0 && received_>options.max_size) {
+                        session_.body_error_=REQUEST_ENTITY_TOO_LARGE;
+                        return -1;
+                    }
+                    if (discard_) return 0;
+                    if (reading_) {
+                        // Hand the chunk to read_body(), it stays in buf_ until the next read
+                        chunk_=string_ref_t(at, length);
+                        http_parser_pause(&parser_, 1);
+                        return 0;
+                    }
+                    return store_body(at, length) ? 0 : -1;
+                }
+                int on_message_complete() {
+                    state_=end;
+                    // Pause here and handle the request after http_parser_execute returns,
+                    // by then we know whether more requests are following in the same read
+                    http_parser_pause(&parser_, 1);
+                    return 0;
                 }
                 
+                string_ref_t url_field(const http_parser_url &u, http_parser_url_fields f)
+                { return ref(url_off_+u.field_data[f].off, u.field_data[f].len); }
+                
                 http_parser parser_;
-                std::string url_;
+                size_t url_off_;
+                size_t url_len_;
                 session_t &session_;
                 parse_callback_t &cb_;
                 parser_state state_;
-                bool should_continue_;
+                // Input not parsed yet points into buf_
+                char buf_[buf_size];
+                const char *p_=buf_;
+                size_t len_=0;
+                std::uint64_t received_=0;
+                status_code reject_=OK;
+                bool expect_continue_=false;
+                // The handler has been called after the headers
+                bool dispatched_=false;
+                // read_body() is waiting for chunk_
+                bool reading_=false;
+                bool discard_=false;
+                string_ref_t chunk_;
                 
                 parser(session_t &session, parse_callback_t &cb);
+                ~parser();
                 bool parse();
+                bool parse_loop();
+                bool fill();
+                int execute();
+                void reject(status_code code);
+                void send_continue();
+                bool store_body(const char *at, size_t length);
+                bool read_body(string_ref_t &chunk);
+                bool drain();
+                std::size_t feed(const char *data, size_t size);
             };
             
             static int on_message_begin(http_parser*p) {
@@ -251,30 +678,195 @@ namespace http {
             {
                 parser_.data=reinterpret_cast<void*>(this);
                 http_parser_init(&parser_, HTTP_REQUEST);
+                session_.parser_=this;
+            }
+            
+            parser::~parser() {
+                session_.parser_=nullptr;
             }
             
             bool parser::parse() {
-                should_continue_=true;
+                bool ret=parse_loop();
+                // Send out responses still batched in the stream
+                session_.raw_stream().flush();
+                return ret;
+            }
+            
+            bool parser::parse_loop() {
                 state_=none;
-                constexpr int buf_size=1024;
-                char buf[buf_size];
-                int recved=0;
-                int nparsed=0;
                 while (session_.raw_stream()) {
-                    // Read some data
-                    recved = session_.raw_stream().readsome(buf, buf_size);
-                    if (recved<=0) {
+                    if (len_==0 && !fill()) {
                         // Connection closed
                         return true;
                     }
-                    nparsed=http_parser_execute(&parser_, &settings_, buf, recved);
-                    if (!should_continue_) {
-                        break;
+                    int r=execute();
+                    if (r<0) {
+                        // Parse error, or the body is too large
+                        if (session_.body_error_!=OK) reject(session_.body_error_);
+                        return false;
                     }
-                    if (nparsed!=recved) {
-                        // Parse error
+                    if (r==0) continue;
+                    if (state_==headers) {
+                        if (reject_!=OK) {
+                            reject(reject_);
+                            return true;
+                        }
+                        // Streaming body, the handler reads it with read_body()
+                        dispatched_=true;
+                        session_.pipelined_=false;
+                        session_.unparsed_=string_ref_t();
+                        bool ret=cb_(session_);
+                        dispatched_=false;
+                        if (!ret || (state_!=end && !drain())) {
+                            // Connection is closing, or the rest of the body can't be skipped
+                            return true;
+                        }
+                        continue;
+                    }
+                    // A request is complete
+                    // Pipelined requests are already here, their responses will be flushed together
+                    session_.pipelined_=!parser_.upgrade
+                                        && (len_>0 || session_.raw_stream().buffered_input()>0);
+                    // After CONNECT or Upgrade the rest is not HTTP, hand it to the handler
+                    session_.unparsed_=parser_.upgrade ? string_ref_t(p_, len_) : string_ref_t();
+                    if (!cb_(session_) || parser_.upgrade) {
+                        // Connection is closing, or is no longer talking HTTP
+                        return true;
+                    }
+                }
+                return true;
+            }
+            
+            /**
+             * Read more input into buf_, returns false if the connection is closed
+             */
+            bool parser::fill() {
+                if (session_.raw_stream().buffered_input()==0) {
+                    // Going to wait for the client, flush responses batched so far
+                    session_.raw_stream().flush();
+                }
+                int recved=session_.raw_stream().readsome(buf_, buf_size);
+                if (recved<=0) return false;
+                p_=buf_;
+                len_=recved;
+                return true;
+            }
+            
+            /**
+             * Parse the input in buf_, returns 1 if the parser has paused, 0 if all input has been
+             * consumed, and -1 on error
+             */
+            int parser::execute() {
+                size_t nparsed=http_parser_execute(&parser_, &settings_, p_, len_);
+                p_+=nparsed;
+                len_-=nparsed;
+                if (HTTP_PARSER_ERRNO(&parser_)==HPE_PAUSED) {
+                    http_parser_pause(&parser_, 0);
+                    return 1;
+                }
+                return HTTP_PARSER_ERRNO(&parser_)==HPE_OK && len_==0 ? 0 : -1;
+            }
+            
+            /**
+             * Answer without reading the body, the connection is closed afterwards
+             */
+            void parser::reject(status_code code) {
+                string_ref_t line=status_line(code);
+                session_.raw_stream().write(line.data(), line.size());
+                session_.raw_stream() << "Connection: close\r\nContent-Length: 0\r\n\r\n";
+                session_.raw_stream().flush();
+            }
+            
+            void parser::send_continue() {
+                if (!expect_continue_) return;
+                expect_continue_=false;
+                session_.raw_stream() << "HTTP/1.1 100 Continue\r\n\r\n";
+                session_.raw_stream().flush();
+            }
+            
+            bool parser::store_body(const char *at, size_t length) {
+                request_t &r=req();
+                const body_options_t &options=session_.body_options();
+                if (r.body_fd_<0 && options.spill_size>0 && r.body().size()+length>options.spill_size) {
+                    // Move what we have so far into a temp file, which is gone once closed
+                    std::string path=options.spill_dir+"/coroserver-body-XXXXXX";
+                    int fd=mkstemp(&path[0]);
+                    if (fd<0) {
+                        session_.body_error_=INTERNAL_SERVER_ERROR;
+                        return false;
+                    }
+                    unlink(path.c_str());
+                    r.body_fd_=fd;
+                    r.spilled_size_=r.body().size();
+                    if (!write_all(fd, r.body().data(), r.body().size())) {
+                        session_.body_error_=INTERNAL_SERVER_ERROR;
                         return false;
                     }
+                    if (!r.body().empty())
+                        clear_body(r.body_stream());
+                }
+                if (r.body_fd_>=0) {
+                    if (!write_all(r.body_fd_, at, length)) {
+                        session_.body_error_=INTERNAL_SERVER_ERROR;
+                        return false;
+                    }
+                    r.spilled_size_+=length;
+                    return true;
+                }
+                r.body_stream().write(at, length);
+                return true;
+            }
+            
+            bool parser::read_body(string_ref_t &chunk) {
+                if (!dispatched_ || state_==end || session_.body_error_!=OK)
+                    return false;
+                send_continue();
+                reading_=true;
+                chunk_=string_ref_t();
+                while (state_!=end) {
+                    if (len_==0 && !fill()) break;
+                    if (execute()<0) break;
+                    if (!chunk_.empty()) {
+                        reading_=false;
+                        chunk=chunk_;
+                        return true;
+                    }
+                }
+                reading_=false;
+                return false;
+            }
+            
+            /**
+             * Parse requests already in memory, the callback is called for each complete request
+             */
+            std::size_t parser::feed(const char *data, size_t size) {
+                std::size_t n=0;
+                p_=data;
+                len_=size;
+                while (len_>0) {
+                    int r=execute();
+                    if (r<0) break;
+                    if (r>0 && state_==end) {
+                        n++;
+                        if (!cb_(session_)) break;
+                    }
+                }
+                len_=0;
+                return n;
+            }
+            
+            /**
+             * Skip the body the handler didn't read, returns false if the connection can't be reused
+             */
+            bool parser::drain() {
+                if (expect_continue_ || session_.body_error_!=OK) {
+                    // The client is still waiting for "100 Continue", or is sending too much
+                    return false;
+                }
+                discard_=true;
+                while (state_!=end) {
+                    if (len_==0 && !fill()) return false;
+                    if (execute()<0) return false;
                 }
                 return true;
             }
@@ -305,43 +897,127 @@ namespace http {
                     return 0;
                 }
                 int on_header_field(const char *at, size_t length) {
-                    if (state_==field) {
-                        resp().headers().rbegin()->first.append(at, length);
-                    } else {
-                        resp().headers().push_back(header_t());
-                        resp().headers().rbegin()->first.reserve(256);
-                        resp().headers().rbegin()->first.assign(at, length);
-                    }
+                    if (state_==field)
+                        resp().headers().append_name(at, length);
+                    else
+                        resp().headers().push_back_name(at, length);
                     state_=field;
                     return 0;
                 }
                 int on_header_value(const char *at, size_t length) {
-                    if (state_==value)
-                        resp().headers().rbegin()->second.append(at, length);
-                    else {
-                        resp().headers().rbegin()->second.reserve(256);
-                        resp().headers().rbegin()->second.assign(at, length);
-                    }
+                    resp().headers().append_value(at, length);
                     state_=value;
                     return 0;
                 }
                 int on_headers_complete() {
-                    return 0;
+                    resp().http_major(parser_.http_major);
+                    resp().http_minor(parser_.http_minor);
+                    resp().code(status_code(parser_.status_code));
+                    if (parser_.status_code/100==1 && parser_.status_code!=101) {
+                        // Interim response, the final one follows on the same connection
+                        interim_=true;
+                        return 1;
+                    }
+                    if (relay_)
+                        relay_head();
+                    // Response to HEAD has no body whatever the headers say
+                    return head_request_ ? 1 : 0;
                 }
                 int on_body(const char *at, size_t length) {
-                    resp().body_stream().write(at, length);
+                    if (relay_)
+                        relay_body(at, length);
+                    else
+                        resp().body_stream().write(at, length);
                     state_=body;
                     return 0;
                 }
                 int on_message_complete() {
+                    if (interim_) {
+                        interim_=false;
+                        return 0;
+                    }
                     state_=end;
-                    resp().http_major(parser_.http_major);
-                    resp().http_minor(parser_.http_minor);
-                    resp().code(status_code(parser_.status_code));
                     resp().keep_alive(http_should_keep_alive(&parser_));
+                    if (relay_ && chunked_out_) {
+                        relay_->write("0\r\n\r\n", 5);
+                    }
                     should_continue_=false;
                     return 0;
                 }
+                
+                /**
+                 * True if the body ends when the upstream closes the connection
+                 */
+                bool close_delimited() const {
+                    unsigned code=parser_.status_code;
+                    if (head_request_ || bodyless_status(code)) return false;
+                    return !(parser_.flags & F_CHUNKED) && parser_.content_length==std::uint64_t(-1);
+                }
+                
+                /**
+                 * Forward status line and end-to-end headers, body framing is decided here
+                 */
+                void relay_head() {
+                    std::string &out=*head_buffer_;
+                    out.clear();
+                    string_ref_t line=status_line(resp().code());
+                    if (line.empty()) {
+                        out.append("HTTP/1.1 ");
+                        append_uint(out, resp().code());
+                        out.append(" \r\n");
+                    } else {
+                        append(out, line);
+                    }
+                    for (headers_t::const_iterator i=resp().headers().begin(); i!=resp().headers().end(); ++i) {
+                        switch (i.id()) {
+                            case header_id::connection:
+                            case header_id::keep_alive:
+                            case header_id::proxy_connection:
+                            case header_id::transfer_encoding:
+                                // Hop-by-hop
+                                continue;
+                            default:
+                                break;
+                        }
+                        append(out, i->first);
+                        out.append(": ");
+                        append(out, i->second);
+                        out.append("\r\n");
+                    }
+                    if (parser_.flags & F_CHUNKED) {
+                        // http_parser removes chunk framing, put it back
+                        chunked_out_=true;
+                    } else if (close_delimited()) {
+                        // HTTP/1.0 clients don't know chunked, they get the body until close
+                        if (client_http11_)
+                            chunked_out_=true;
+                        else
+                            client_keep_alive_=false;
+                    }
+                    if (chunked_out_)
+                        out.append("Transfer-Encoding: chunked\r\n");
+                    out.append(client_keep_alive_ ? "Connection: keep-alive\r\n" : connection_close);
+                    out.append("\r\n");
+                    relay_->write(out.data(), out.size());
+                    // Don't hold the head until the body fills the buffer
+                    relay_->flush();
+                    head_sent_=true;
+                }
+                
+                void relay_body(const char *at, size_t length) {
+                    if (length==0) return;
+                    if (chunked_out_) {
+                        char buf[20];
+                        char *p=format_hex(buf, length);
+                        *p++='\r';
+                        *p++='\n';
+                        relay_->write(buf, p-buf);
+                        relay_->write(at, length);
+                        relay_->write("\r\n", 2);
+                    } else {
+                        relay_->write(at, length);
+                    }
+                }
 
                 std::istream &is_;
                 response_t &response_;
@@ -349,6 +1025,16 @@ namespace http {
                 std::string url_;
                 parser_state state_;
                 bool should_continue_;
+                // Relay mode, the body is written to relay_ instead of the response
+                std::ostream *relay_=nullptr;
+                std::string *head_buffer_=nullptr;
+                bool head_request_=false;
+                bool client_http11_=true;
+                bool client_keep_alive_=true;
+                bool chunked_out_=false;
+                bool head_sent_=false;
+                // Skipping a 1xx response other than 101
+                bool interim_=false;
                 
                 parser(std::istream &is, response_t &resp);
                 bool parse();
@@ -401,7 +1087,8 @@ namespace http {
             bool parser::parse() {
                 should_continue_=true;
                 state_=none;
-                constexpr int buf_size=1024;
+                // Relayed bodies go through this buffer, it bounds what is held in memory
+                constexpr int buf_size=net::bf_size;
                 char buf[buf_size];
                 int recved=0;
                 int nparsed=0;
@@ -409,12 +1096,25 @@ namespace http {
                     // Read some data
                     recved = is_.readsome(buf, buf_size);
                     if (recved<=0) {
-                        // Connection closed
-                        return true;
+                        // Connection closed, which ends a response without Content-Length
+                        if (should_continue_)
+                            http_parser_execute(&parser_, &settings_, buf, 0);
+                        return !should_continue_;
                     }
                     nparsed=http_parser_execute(&parser_, &settings_, buf, recved);
+                    if (relay_ && head_sent_) {
+                        // Pass what we have on, the client write blocks if it can't keep up
+                        relay_->flush();
+                        if (!*relay_) {
+                            // Client is gone
+                            return false;
+                        }
+                    }
                     if (!should_continue_) {
-                        // TODO: Should I put extra data back into stream?
+                        if (nparsed!=recved) {
+                            // Extra data after the response, the connection can't be reused
+                            resp().keep_alive(false);
+                        }
                         break;
                     }
                     if (nparsed!=recved) {
@@ -422,11 +1122,60 @@ namespace http {
                         return false;
                     }
                 }
-                return true;
+                return !should_continue_;
             }
         }   // End of namespace response
     }   // End of namespace details
     
+    request_t::~request_t() {
+        if (body_fd_>=0)
+            close(body_fd_);
+    }
+    
+    const route_metrics_t *route_metrics(const std::string &route) {
+        static std::mutex mutex;
+        static std::map<std::string, std::unique_ptr<route_metrics_t>> routes;
+        std::lock_guard<std::mutex> lock(mutex);
+        std::unique_ptr<route_metrics_t> &m=routes[route];
+        if (!m) {
+            static const char *classes[]={"1xx", "2xx", "3xx", "4xx", "5xx"};
+            m.reset(new route_metrics_t);
+            for (int i=0; i<5; i++) {
+                m->requests[i]=net::metrics::make_counter("http_requests_total",
+                                                          "Requests handled by route and status class",
+                                                          {{"route", route}, {"code", classes[i]}});
+            }
+            m->bytes=net::metrics::make_counter("http_response_bytes_total",
+                                                "Response body bytes by route",
+                                                {{"route", route}});
+            m->latency=net::metrics::make_histogram("http_request_duration_seconds",
+                                                    "Time from the first byte of the request to the end of the response",
+                                                    {{"route", route}});
+        }
+        return m.get();
+    }
+    
+    bool metrics_handler::operator()(session_t &session) const {
+        if (session.request().method()!=GET && session.request().method()!=HEAD) {
+            session.response().code(METHOD_NOT_ALLOWED);
+            session.response().headers().push_back("Allow", "GET, HEAD");
+            return true;
+        }
+        std::string out;
+        net::metrics::render(out);
+        session.response().headers().push_back("Content-Type", "text/plain; version=0.0.4");
+        session.response().headers().push_back("Cache-Control", "no-store");
+        session.response().body_stream().write(out.data(), out.size());
+        return true;
+    }
+    
+    namespace details {
+        std::size_t parse_request_buffer(session_t &session, const char *data, std::size_t size, request_handler_t &handler) {
+            request::parser p(session, handler);
+            return p.feed(data, size);
+        }
+    }   // End of namespace details
+    
     void request_t::clear() {
         http_major_=0;
         http_minor_=0;
@@ -437,13 +1186,18 @@ namespace http {
         port_=0;
         path_.clear();
         query_.clear();
+        params_.clear();
         headers_.clear();
         keep_alive_=false;
-        // NOTE: Why there is no clear() in ovectorstream?
-        if (!body().empty()) {
-            std::string empty;
-            body_stream().swap_vector(empty);
+        buffer_.clear();
+        arena_.reset();
+        if (!body().empty())
+            details::clear_body(body_stream());
+        if (body_fd_>=0) {
+            close(body_fd_);
+            body_fd_=-1;
         }
+        spilled_size_=0;
     }
     
     void response_t::clear() {
@@ -453,11 +1207,23 @@ namespace http {
         status_message_.clear();
         headers_.clear();
         keep_alive_=false;
-        // NOTE: Why there is no clear() in ovectorstream?
-        if (!body().empty()) {
-            std::string empty;
-            body_stream().swap_vector(empty);
-        }
+        if (!body().empty())
+            details::clear_body(body_stream());
+        file_body_=file_body_t();
+        prepared_.reset();
+        trailers_.clear();
+    }
+    
+    string_ref_t status_line(status_code code) {
+        unsigned c=code;
+        if (c<100 || c>=600 || c%100>=18) return string_ref_t();
+        const details::name_t &n=details::status_lines[c/100][c%100];
+        return n.data ? string_ref_t(n.data, n.size) : string_ref_t();
+    }
+    
+    string_ref_t method_name(method m) {
+        if (unsigned(m)>PURGE) return string_ref_t();
+        return string_ref_t(details::method_names[m].data, details::method_names[m].size);
     }
     
     bool parse_request(session_t &session, parse_callback_t &req_cb) {
@@ -467,97 +1233,365 @@ namespace http {
     
     bool request_callback(session_t &session, request_handler_t &handler) {
         bool ret=true;
+        bool failed=false;
+        session.stream_mode_=session_t::stream_none;
+        session.stream_bytes_=0;
+        session.route_metrics_=nullptr;
+        std::uint64_t bytes=0;
+        if (session.count()>0)
+            details::http_metrics().keepalive_requests.inc();
+        net::admission_service *admission=session.raw_stream().admission();
+        if (admission && admission->overloaded()) {
+            // Fail fast instead of joining the queue, responses to pipelined requests go first
+            const std::string &rejection=admission->rejection();
+            session.raw_stream().write(rejection.data(), rejection.size());
+            session.raw_stream().flush();
+            details::http_metrics().shed.inc();
+            return false;
+        }
         try {
             session.response().clear();
             // Returning false from handle_request indicates the handler doesn't want the connection to keep alive
             ret = handler(session) && session.keep_alive();
         } catch(...) {
-            session.raw_stream() << "HTTP/1.1 500 Internal Server Error\r\n";
+            if (session.raw()) {
+                session.raw_stream() << "HTTP/1.1 500 Internal Server Error\r\n";
+            } else {
+                // Drop whatever the handler has done to the response
+                session.response().clear();
+                session.response().code(INTERNAL_SERVER_ERROR);
+            }
+            ret=false;
+            failed=true;
+        }
+        if (session.body_error_!=OK) {
+            // The body couldn't be received, the connection can't be reused either
+            if (!session.raw() && session.stream_mode_==session_t::stream_none) {
+                session.response().clear();
+                session.response().code(session.body_error_);
+            }
+            ret=false;
+        }
+        if (session.body_unskippable()) {
+            // Say so in the response instead of dropping the connection after it
+            ret=false;
         }
         
         if (session.raw()) {
             // Do nothing here
             // Handler handles whole HTTP response by itself, include status, headers, and body
+        } else if (session.stream_mode_!=session_t::stream_none) {
+            // Streamed by the handler, finish it unless the handler has failed halfway, the client
+            // sees a truncated body then
+            if (session.stream_mode_!=session_t::stream_done && (failed || !session.end_response()))
+                ret=false;
+            ret=ret && session.stream_keep_alive_;
+            bytes=session.stream_bytes_;
         } else {
-            if (ret) {
-                char buf[100];
-                if (session.max_keepalive()!=0) {
-                    if (session.max_keepalive()>session.count()) {
-                        // Keep-alive in progress
-                        session.response().headers().push_back({"Connection", "keep-alive"});
-                        sprintf(buf, "timeout=%d, max=%d", session.read_timeout(), session.max_keepalive()-session.count());
-                        session.response().headers().push_back({"Keep-Alive", buf});
-                    } else {
-                        // Max limit reached, stop keeping alive
-                        session.response().headers().push_back({"Connection", "close"});
-                        ret=false;
-                    }
+            char buf[details::keep_alive_headers_size];
+            string_ref_t connection=details::connection_headers(session, buf, ret);
+            details::compress_response(session);
+            const std::string &body=details::body_of(session.response());
+            bytes=session.response().has_file_body() ? session.response().file_body().size : body.size();
+            if (session.pipelined() && body.size()<net::bf_size && !session.response().has_file_body()) {
+                // More requests are waiting, put the response into the stream buffer and send it
+                // together with the following ones
+                if (details::render_head(session.head_buffer_, session.response(), connection)) {
+                    session.raw_stream().write(session.head_buffer_.data(), session.head_buffer_.size());
+                    session.raw_stream().write(body.data(), body.size());
                 } else {
-                    // Limitless keep-alive
-                    session.response().headers().push_back({"Connection", "keep-alive"});
-                    sprintf(buf, "timeout=%d", session.read_timeout());
-                    session.response().headers().push_back({"Keep-Alive", buf});
+                    session.raw_stream().write(session.head_buffer_.data(), session.head_buffer_.size());
                 }
-            } else {
-                session.response().headers().push_back({"Connection", "close"});
+            } else if (!write_response(session.raw_stream(), session.response(), session.head_buffer_, connection)) {
+                // Fewer bytes than announced may have gone out, the connection can't be reused
                 ret=false;
             }
-            session.raw_stream() << session.response();
         }
-        session.raw_stream().flush();
+        if (!session.pipelined())
+            session.raw_stream().flush();
         session.inc_count();
+        // Requests no router has claimed are recorded under "none"
+        const route_metrics_t *route=session.route_metrics_ ? session.route_metrics_ : details::http_metrics().unrouted;
+        // Cache hits are sent from the prepared response, the code of the response isn't set
+        const response_t &resp=session.response();
+        int status_class=(resp.prepared() ? resp.prepared()->code : resp.code())/100;
+        route->requests[status_class<1 ? 0 : (status_class>5 ? 4 : status_class-1)].inc();
+        route->bytes.inc(bytes);
+        route->latency.observe(details::elapsed_us(session.start_));
         return ret;
     }
-
-    std::ostream &operator<<(std::ostream &s, response_t &resp) {
-        std::map<status_code, std::string>::const_iterator i=details::status_code_msg_map.find(resp.code());
-        if (i==details::status_code_msg_map.end() && resp.status_message().empty()) {
-            // Unknown HTTP status code
-            s << "HTTP/1.1 500 Internal Server Error\r\n";
-        } else {
-            char buf[100];
-            sprintf(buf, "%lu", resp.body().size());
-            
-            s << "HTTP/1.1 " << resp.code() << ' ';
-            if (!resp.status_message().empty()) {
-                // Supplied status message
-                s << resp.status_message();
+    
+    bool session_t::read_body(string_ref_t &chunk) {
+        return parser_ && parser_->read_body(chunk);
+    }
+    
+    bool session_t::receive_body() {
+        if (!parser_ || !parser_->dispatched_)
+            return body_error_==OK;
+        string_ref_t chunk;
+        while (parser_->read_body(chunk)) {
+            if (!parser_->store_body(chunk.data(), chunk.size()))
+                return false;
+        }
+        return body_complete() && body_error_==OK;
+    }
+    
+    bool session_t::body_complete() const {
+        return !parser_ || !parser_->dispatched_ || parser_->state_==details::request::parser::end;
+    }
+    
+    bool session_t::body_unskippable() const {
+        return !body_complete() && parser_->expect_continue_;
+    }
+    
+    bool session_t::begin_response(std::int64_t content_length) {
+        if (raw_ || stream_mode_!=stream_none) return false;
+        headers_t &headers=response_.headers();
+        // Framing is decided here, not by the handler
+        for (headers_t::const_iterator i=headers.begin(); i!=headers.end();) {
+            if (i.id()==header_id::content_length || i.id()==header_id::transfer_encoding) {
+                i=headers.erase(i);
             } else {
-                s << i->second << "\r\n";
-            }
-
-            bool server_found=false;
-            bool content_len_found=false;
-            for (auto &i : resp.headers()) {
-                s << i.first << ": " << i.second << "\r\n";
-                if (boost::algorithm::iequals(i.first, "server")) server_found=true;
-                if (boost::algorithm::iequals(i.first, "content-length")) content_len_found=true;
+                ++i;
             }
-            if (!server_found) s << "Server: " << server_name << "\r\n";
-            if (!content_len_found) s << "Content-Length: " << buf << "\r\n";
-            s << "\r\n" << resp.body();
+        }
+        bool http11=request_.http_major()>1 || (request_.http_major()==1 && request_.http_minor()>=1);
+        stream_keep_alive_=request_.keep_alive() && !body_unskippable();
+        stream_head_only_=request_.method()==HEAD;
+        if (details::bodyless_status(response_.code())) {
+            // Nothing to frame, write_body() refuses anything but an empty piece
+            stream_mode_=stream_fixed;
+            stream_remaining_=0;
+        } else if (content_length>=0) {
+            char buf[24];
+            headers.push_back("Content-Length", string_ref_t(buf, details::format_uint(buf, content_length)-buf));
+            stream_mode_=stream_fixed;
+            stream_remaining_=content_length;
+        } else if (http11) {
+            headers.push_back("Transfer-Encoding", "chunked");
+            stream_mode_=stream_chunked;
+        } else {
+            // HTTP/1.0 client, the body ends when the connection is closed
+            stream_keep_alive_=false;
+            stream_mode_=stream_until_close;
+        }
+        char buf[details::keep_alive_headers_size];
+        string_ref_t connection=details::connection_headers(*this, buf, stream_keep_alive_);
+        // Framing headers have been set above
+        if (!details::render_head(head_buffer_, response_, connection, false)) {
+            // Unknown status code, a bodyless 500 is sent instead
+            stream_mode_=stream_done;
+            stream_keep_alive_=false;
+        }
+        std::array<boost::asio::const_buffer, 1> head={{
+            boost::asio::const_buffer(head_buffer_.data(), head_buffer_.size()),
+        }};
+        // Sent right away so the client gets the first byte as early as possible
+        if (!raw_stream_.write_buffers(head)) {
+            stream_mode_=stream_done;
+            stream_keep_alive_=false;
+            return false;
+        }
+        return stream_mode_!=stream_done;
+    }
+    
+    bool session_t::write_body(const char *data, std::size_t size) {
+        switch (stream_mode_) {
+            case stream_none:
+            case stream_done:
+                return false;
+            case stream_fixed:
+                if (size>stream_remaining_) return false;
+                stream_remaining_-=size;
+                break;
+            default:
+                break;
+        }
+        if (size==0 || stream_head_only_) return true;
+        stream_bytes_+=size;
+        bool ok;
+        if (stream_mode_==stream_chunked) {
+            char buf[24];
+            char *p=details::format_hex(buf, size);
+            *p++='\r';
+            *p++='\n';
+            std::array<boost::asio::const_buffer, 3> buffers={{
+                boost::asio::const_buffer(buf, p-buf),
+                boost::asio::const_buffer(data, size),
+                boost::asio::const_buffer("\r\n", 2),
+            }};
+            ok=raw_stream_.write_buffers(buffers);
+        } else {
+            std::array<boost::asio::const_buffer, 1> buffers={{
+                boost::asio::const_buffer(data, size),
+            }};
+            ok=raw_stream_.write_buffers(buffers);
+        }
+        if (!ok) {
+            stream_mode_=stream_done;
+            stream_keep_alive_=false;
+        }
+        return ok;
+    }
+    
+    bool session_t::end_response() {
+        switch (stream_mode_) {
+            case stream_none:
+            case stream_done:
+                return false;
+            case stream_fixed:
+                if (stream_remaining_>0) {
+                    // Short body, the connection can't be reused
+                    stream_mode_=stream_done;
+                    stream_keep_alive_=false;
+                    raw_stream_.flush();
+                    return false;
+                }
+                break;
+            case stream_until_close:
+                stream_keep_alive_=false;
+                break;
+            case stream_chunked:
+                if (!stream_head_only_) {
+                    head_buffer_.assign("0\r\n");
+                    for (const header_t &h : response_.trailers()) {
+                        details::append(head_buffer_, h.first);
+                        head_buffer_.append(": ");
+                        details::append(head_buffer_, h.second);
+                        head_buffer_.append("\r\n");
+                    }
+                    head_buffer_.append("\r\n");
+                    raw_stream_.write(head_buffer_.data(), head_buffer_.size());
+                }
+                break;
+        }
+        stream_mode_=stream_done;
+        if (!raw_stream_.flush()) {
+            stream_keep_alive_=false;
+            return false;
+        }
+        return true;
+    }
+    
+    std::ostream &operator<<(std::ostream &s, response_t &resp) {
+        std::string head;
+        if (details::render_head(head, resp, string_ref_t())) {
+            s << head << details::body_of(resp);
+        } else {
+            s << head;
         }
         return s;
     }
     
-    // Client side
+    bool write_response(net::async_tcp_stream &s, response_t &resp, std::string &buffer, const string_ref_t &extra_headers) {
+        // Status line and headers are in one buffer, the body is sent from where it is,
+        // writev puts both into the same segment so no Nagle/delayed-ACK stall in between
+        bool has_body=details::render_head(buffer, resp, extra_headers);
+        if (resp.has_file_body()) {
+            std::array<boost::asio::const_buffer, 1> head={{
+                boost::asio::const_buffer(buffer.data(), buffer.size()),
+            }};
+            if (!has_body)
+                return s.write_buffers(head);
+            // The head goes out first, the file follows straight from the page cache
+            const file_body_t &f=resp.file_body();
+            return s.write_buffers(head) && s.send_file(f.fd, f.offset, f.size);
+        }
+        const std::string &body=details::body_of(resp);
+        std::array<boost::asio::const_buffer, 2> buffers={{
+            boost::asio::const_buffer(buffer.data(), buffer.size()),
+            boost::asio::const_buffer(body.data(), has_body ? body.size() : 0),
+        }};
+        return s.write_buffers(buffers);
+    }
     
-    // Send request
-    std::ostream &operator<<(std::ostream &s, request_t &req) {
-        std::map<method, std::string>::const_iterator i=details::method_name_map.find(req.method());
-        if (i==details::method_name_map.end()) {
-            // Unknow method
-            return s;
+    prepared_response_ptr prepare_response(const response_t &resp, const compression_options_t &compression) {
+        if (resp.has_file_body())
+            return prepared_response_ptr();
+        std::shared_ptr<prepared_response_t> p=std::make_shared<prepared_response_t>();
+        if (!details::render_status_headers(p->head, resp, false))
+            return prepared_response_ptr();
+        p->code=resp.code();
+        p->body=details::body_of(resp);
+        p->has_date=resp.headers().contains(header_id::date);
+        p->has_server=resp.headers().contains(header_id::server);
+        if (details::compressible(resp, compression)) {
+            if (!details::varies_on_encoding(resp.headers()))
+                p->head.append("Vary: Accept-Encoding\r\n");
+            p->compressible=true;
         }
-
-        s << i->second << ' ' << req.path();
-        if (!req.query().empty()) {
-            s << '?' << req.query();
+        return p;
+    }
+    
+    prepared_response_ptr compressed_variant(const prepared_response_t &p, content_coding c, int level) {
+        if (!p.compressible || c==content_coding::identity || c>=content_coding::count)
+            return prepared_response_ptr();
+        std::size_t i=static_cast<std::size_t>(c);
+        // Compressing the whole body takes a while, nobody waits for it, other requests for the
+        // same variant are sent the identity response until it's published
+        if (p.building[i].load(std::memory_order_acquire) || p.building[i].exchange(true))
+            return std::atomic_load(&p.variants[i]);
+        std::shared_ptr<prepared_response_t> n=std::make_shared<prepared_response_t>();
+        if (!compress(c, level, p.body, n->body) || n->body.size()>=p.body.size()) {
+            // Not worth it, the variant is the identity response itself
+            n->body=p.body;
+            n->head=p.head;
+        } else {
+            n->head=p.head;
+            n->head.append("Content-Encoding: ");
+            details::append(n->head, coding_name(c));
+            n->head.append("\r\n");
         }
-        s << " HTTP/" << req.http_major() << '.' << req.http_minor() << "\r\n";
-        for (header_t &h : req.headers()) {
-            s << h.first << ": " << h.second << "\r\n";
+        n->code=p.code;
+        n->has_date=p.has_date;
+        n->has_server=p.has_server;
+        prepared_response_ptr v=n;
+        std::atomic_store(&p.variants[i], v);
+        return v;
+    }
+    
+    // Client side
+    
+    // Send request
+    namespace details {
+        /**
+         * Request line and end-to-end headers, framing and Connection are left to the caller
+         */
+        bool write_request_head(std::ostream &s, request_t &req) {
+            string_ref_t name=method_name(req.method());
+            if (name.empty()) {
+                // Unknow method
+                return false;
+            }
+            
+            s << name << ' ' << req.path();
+            if (!req.query().empty()) {
+                s << '?' << req.query();
+            }
+            s << " HTTP/" << req.http_major() << '.' << req.http_minor() << "\r\n";
+            for (headers_t::const_iterator i=req.headers().begin(); i!=req.headers().end(); ++i) {
+                switch (i.id()) {
+                    case header_id::connection:
+                    case header_id::keep_alive:
+                    case header_id::proxy_connection:
+                    case header_id::transfer_encoding:
+                    case header_id::content_length:
+                        // Hop-by-hop or framing
+                        continue;
+                    case header_id::expect:
+                        // The body follows right away, a proxied client has been sent "100 Continue" by us
+                        continue;
+                    default:
+                        break;
+                }
+                s << i->first << ": " << i->second << "\r\n";
+            }
+            return true;
         }
+    }   // End of namespace details
+    
+    std::ostream &operator<<(std::ostream &s, request_t &req) {
+        if (!details::write_request_head(s, req)) return s;
         s << "Content-Length: " << req.body().size() << "\r\n";
         if (req.keep_alive()) {
             s << "Connection: keep-alive\r\n";
@@ -572,10 +1606,82 @@ namespace http {
         return s;
     }
     
+    bool relay_request(net::upstream_connection &upstream, session_t &session) {
+        request_t &req=session.request();
+        std::ostream &s=upstream.stream();
+        if (session.body_complete()) {
+            // Nothing left to read from the client, send what's buffered
+            bool keep_alive=req.keep_alive();
+            req.keep_alive(true);
+            s << req;
+            req.keep_alive(keep_alive);
+            return bool(s);
+        }
+        if (!details::write_request_head(s, req)) return false;
+        // Same framing as the client, a streaming body has either of them
+        bool chunked=req.headers().contains(header_id::transfer_encoding);
+        if (chunked) {
+            s << "Transfer-Encoding: chunked\r\n";
+        } else {
+            s << "Content-Length: " << req.headers().value(header_id::content_length) << "\r\n";
+        }
+        s << "Connection: keep-alive\r\n\r\n";
+        string_ref_t chunk;
+        while (session.read_body(chunk)) {
+            if (chunked) s << std::hex << chunk.size() << std::dec << "\r\n";
+            s.write(chunk.data(), chunk.size());
+            if (chunked) s << "\r\n";
+            // Don't read more from the client until the upstream has taken this
+            if (!s.flush()) return false;
+        }
+        if (!session.body_complete() || session.body_error()!=OK) return false;
+        if (chunked) s << "0\r\n\r\n";
+        return bool(s.flush());
+    }
+    
     // Parse response
     bool parse_response(std::istream &is, response_t &resp) {
         details::response::parser p(is, resp);
         return p.parse();
     }
+    
+    bool parse_response(net::upstream_connection &upstream, response_t &resp) {
+        bool ret=parse_response(upstream.stream(), resp);
+        // Reusable only if the response is fully read and the upstream agrees
+        upstream.keep_alive(ret && resp.keep_alive() && upstream.stream().buffered_input()==0);
+        return ret;
+    }
+    
+    bool relay_response(net::upstream_connection &upstream, session_t &session) {
+        const details::http_metrics_t &metrics=details::http_metrics();
+        std::chrono::steady_clock::time_point start=std::chrono::steady_clock::now();
+        (upstream.reused() ? metrics.upstream_reused : metrics.upstream_connected).inc();
+        const request_t &req=session.request();
+        details::response::parser p(upstream.stream(), session.response());
+        p.relay_=&session.raw_stream();
+        p.head_buffer_=&session.head_buffer_;
+        p.head_request_=req.method()==HEAD;
+        p.client_http11_=req.http_major()>1 || (req.http_major()==1 && req.http_minor()>=1);
+        p.client_keep_alive_=session.keep_alive();
+        bool ret=p.parse();
+        upstream.keep_alive(ret
+                            && session.response().keep_alive()
+                            && !p.close_delimited()
+                            && upstream.stream().buffered_input()==0);
+        (ret ? metrics.proxy_relayed : metrics.proxy_failed).inc();
+        metrics.proxy_latency.observe(details::elapsed_us(start));
+        if (!ret) {
+            if (!p.head_sent_ && session.raw_stream()) {
+                // Nothing has been sent to the client yet
+                string_ref_t line=status_line(BAD_GATEWAY);
+                session.raw_stream().write(line.data(), line.size());
+                session.raw_stream() << details::connection_close << "Content-Length: 0\r\n\r\n";
+            }
+            session.raw_stream().flush();
+            return false;
+        }
+        session.raw_stream().flush();
+        return p.client_keep_alive_;
+    }
 }   // End of namespace http
 
@@ -12,18 +12,33 @@
 #define HTTP_SERVER_NAME "coroserver"
 #define HTTP_SERVER_VERSION "0.1"
 
+#include <cstdint>
+#include <chrono>
 #include <list>
 #include <string>
 #include <vector>
 #include <iostream>
 #include <memory>
+#include <atomic>
+#include <boost/utility/string_ref.hpp>
 #include <boost/interprocess/streams/vectorstream.hpp>
 #include <boost/algorithm/string/predicate.hpp>
 #include "async_stream.h"
+#include "arena.h"
+#include "headers.h"
+#include "compression.h"
+#include "metrics.h"
+#include "upstream_pool.h"
 
 namespace http {
     extern const char *server_name;
     
+    namespace details {
+        namespace request {
+            struct parser;
+        }   // End of namespace request
+    }   // End of namespace details
+    
     enum method {
         DELETE,
         GET,
@@ -103,25 +118,68 @@ namespace http {
     };
     
     typedef boost::interprocess::basic_ovectorstream<std::string> body_stream_t;
-    typedef std::pair<std::string, std::string> header_t;
-    typedef std::vector<header_t> headers_t;
-
-    inline headers_t::const_iterator find_header(const headers_t &headers, const std::string &key, bool case_sensitive=false) {
-        for (headers_t::const_iterator i=headers.begin(); i!=headers.end(); ++i) {
-            if (case_sensitive) {
-                if (boost::algorithm::equals(i->first, key)) {
-                    return i;
-                }
-            } else {
-                if (boost::algorithm::iequals(i->first, key)) {
-                    return i;
-                }
-            }
-        }
-        return headers.end();
-    }
+    /**
+     * Path parameter captured by router, name refers to the route pattern and value refers to the path
+     */
+    typedef std::pair<string_ref_t, string_ref_t> param_t;
+    typedef std::vector<param_t> params_t;
+    
+    /**
+     * Part of an open file sent as the response body with sendfile() instead of body()
+     */
+    struct file_body_t {
+        /**
+         * Keeps the file open until the response has been sent
+         */
+        std::shared_ptr<const void> owner;
+        int fd=-1;
+        std::uint64_t offset=0;
+        std::uint64_t size=0;
+    };
+    
+    /**
+     * How request bodies are received, see session_t::body_options()
+     */
+    struct body_options_t {
+        /**
+         * Larger bodies are rejected with 413, 0 means unlimited
+         *
+         * A Content-Length over the limit is rejected before the body is sent if the client asked
+         * for "Expect: 100-continue", a chunked body when the limit is crossed
+         */
+        std::uint64_t max_size=0;
+        /**
+         * Call the handler as soon as the headers are in, the handler pulls the body with
+         * session_t::read_body() or session_t::receive_body()
+         */
+        bool streaming=false;
+        /**
+         * Bodies larger than this are written to an unlinked temp file in spill_dir instead of
+         * body(), 0 means never
+         */
+        std::uint64_t spill_size=0;
+        std::string spill_dir="/tmp";
+    };
     
+    /**
+     * HTTP request
+     *
+     * URL components and headers of a parsed request refer to the request buffers, which stay
+     * unchanged until the next request on the same connection begins or headers are added, call
+     * to_string() to get an owned copy
+     *
+     * Values set explicitly and handler scratch memory come from the request arena, which is reset
+     * together with the request
+     */
     struct request_t {
+        request_t() = default;
+        
+        // Non-copyable, the string refs point into the request buffer
+        request_t(const request_t&) = delete;
+        request_t& operator=(const request_t&) = delete;
+        
+        ~request_t();
+        
         /**
          * Clear request
          */
@@ -157,29 +215,29 @@ namespace http {
         /**
          * Schema in URL, may only exist in proxy requests
          */
-        const std::string &schema() const
+        string_ref_t schema() const
         { return schema_; }
         
-        void schema(const std::string &v)
-        { schema_=v; }
+        void schema(const string_ref_t &v)
+        { schema_=own(v); }
         
         /**
          * User info in URL, may only exist in proxy requests
          */
-        const std::string &user_info() const
+        string_ref_t user_info() const
         { return user_info_; }
         
-        void user_info(const std::string &v)
-        { user_info_=v; }
+        void user_info(const string_ref_t &v)
+        { user_info_=own(v); }
         
         /**
          * Host in URL, may only exist in proxy requests
          */
-        const std::string &host() const
+        string_ref_t host() const
         { return host_; }
         
-        void host(const std::string &v)
-        { host_=v; }
+        void host(const string_ref_t &v)
+        { host_=own(v); }
         
         /**
          * Port in URL, may only exist in proxy requests
@@ -193,20 +251,39 @@ namespace http {
         /**
          * Path in URL
          */
-        const std::string &path() const
+        string_ref_t path() const
         { return path_; }
         
-        void path(const std::string &v)
-        { path_=v; }
+        void path(const string_ref_t &v)
+        { path_=own(v); }
         
         /**
          * Query part in URL
          */
-        const std::string &query() const
+        string_ref_t query() const
         { return query_; }
         
-        void query(const std::string &v)
-        { query_=v; }
+        void query(const string_ref_t &v)
+        { query_=own(v); }
+        
+        /**
+         * Path parameters captured by router, i.e. "id" in "/user/:id"
+         */
+        const params_t &params() const
+        { return params_; }
+        
+        params_t &params()
+        { return params_; }
+        
+        /**
+         * Value of a path parameter, empty if it's not captured
+         */
+        string_ref_t param(const string_ref_t &name) const {
+            for (const param_t &p : params_) {
+                if (p.first==name) return p.second;
+            }
+            return string_ref_t();
+        }
         
         /**
          * HTTP Headers
@@ -217,6 +294,12 @@ namespace http {
         headers_t &headers()
         { return headers_; }
         
+        /**
+         * Add a header, name and value are copied into the request
+         */
+        void add_header(const string_ref_t &name, const string_ref_t &value)
+        { headers_.push_back(name, value); }
+        
         /**
          * Keep-alive flag
          */
@@ -238,19 +321,101 @@ namespace http {
         body_stream_t &body_stream()
         { return body_stream_; }
         
+        /**
+         * Temp file holding the body if it has been spilled, -1 otherwise, body() is empty then
+         */
+        int body_fd() const
+        { return body_fd_; }
+        
+        /**
+         * Size of the body received so far, in body() or in the temp file
+         */
+        std::uint64_t body_size() const
+        { return body_fd_>=0 ? spilled_size_ : body().size(); }
+        
+        /**
+         * Memory arena released when the request is cleared
+         */
+        net::arena &arena()
+        { return arena_; }
+        
     private:
+        /**
+         * Keep a copy of the value alive until the request is cleared
+         */
+        string_ref_t own(const string_ref_t &v)
+        { return arena_.copy(v); }
+        
         short http_major_;
         short http_minor_;
         http::method method_;
-        std::string schema_;
-        std::string user_info_;
-        std::string host_;
+        string_ref_t schema_;
+        string_ref_t user_info_;
+        string_ref_t host_;
         int port_;
-        std::string path_;
-        std::string query_;
+        string_ref_t path_;
+        string_ref_t query_;
+        params_t params_;
         headers_t headers_;
         bool keep_alive_;
         body_stream_t body_stream_;
+        int body_fd_=-1;
+        std::uint64_t spilled_size_=0;
+        // Raw URL of the parsed request, capacity is kept across requests
+        std::string buffer_;
+        net::arena arena_;
+        
+        friend struct details::request::parser;
+    };
+    
+    /**
+     * Metrics of the requests handled by one route
+     */
+    struct route_metrics_t {
+        /**
+         * Requests by status class, 1xx to 5xx
+         */
+        net::metrics::counter requests[5];
+        /**
+         * Response body bytes
+         */
+        net::metrics::counter bytes;
+        /**
+         * From the first byte of the request to the end of the response, in microseconds
+         */
+        net::metrics::histogram latency;
+    };
+    
+    /**
+     * Metrics of the route with the label, made on first use and kept until exit
+     */
+    const route_metrics_t *route_metrics(const std::string &route);
+    
+    struct prepared_response_t;
+    typedef std::shared_ptr<const prepared_response_t> prepared_response_ptr;
+    
+    /**
+     * Response rendered ahead of time, can be sent any number of times without rendering it again
+     */
+    struct prepared_response_t {
+        status_code code;
+        /**
+         * Status line and headers, without the default Date and Server, Content-Length and the empty line
+         */
+        std::string head;
+        std::string body;
+        bool has_date=false;
+        bool has_server=false;
+        /**
+         * Rendered with "Vary: Accept-Encoding", compressed variants can be made
+         */
+        bool compressible=false;
+        /**
+         * Compressed variants indexed by content_coding, made on first use by the request setting
+         * building, requests coming in meanwhile are sent this response
+         */
+        mutable std::atomic<bool> building[static_cast<std::size_t>(content_coding::count)]={};
+        mutable prepared_response_ptr variants[static_cast<std::size_t>(content_coding::count)];
     };
     
     struct response_t {
@@ -325,6 +490,36 @@ namespace http {
         body_stream_t &body_stream()
         { return body_stream_; }
         
+        /**
+         * File body, replaces body() if set
+         */
+        const file_body_t &file_body() const
+        { return file_body_; }
+        
+        void file_body(const file_body_t &v)
+        { file_body_=v; }
+        
+        bool has_file_body() const
+        { return file_body_.fd>=0; }
+        
+        /**
+         * Trailers sent after a chunked streaming body, see session_t::begin_response()
+         */
+        const headers_t &trailers() const
+        { return trailers_; }
+        
+        headers_t &trailers()
+        { return trailers_; }
+        
+        /**
+         * Prepared response, sent instead of code, headers and body if set
+         */
+        const prepared_response_ptr &prepared() const
+        { return prepared_; }
+        
+        void prepared(const prepared_response_ptr &v)
+        { prepared_=v; }
+        
     private:
         short http_major_;
         short http_minor_;
@@ -333,6 +528,9 @@ namespace http {
         headers_t headers_;
         bool keep_alive_;
         body_stream_t body_stream_;
+        file_body_t file_body_;
+        prepared_response_ptr prepared_;
+        headers_t trailers_;
     };
     
     /**
@@ -367,24 +565,33 @@ namespace http {
         { return response_; }
         
         /**
-         * Read timeout
+         * Scratch memory for the handler, reset before next request is parsed
+         *
+         * Use net::arena_allocator, net::arena_string_t and net::arena_vector_t for temporary
+         * strings and containers to keep a keep-alive connection off the heap
+         */
+        net::arena &arena()
+        { return request_.arena(); }
+        
+        /**
+         * Read timeout, in milliseconds
          *
          * Timeout for single read operation, may also apply to idle time between request
          */
-        int read_timeout() const
+        net::timeout_t read_timeout() const
         { return raw_stream().read_timeout(); }
         
-        inline void read_timeout(int sec)
-        { raw_stream().read_timeout(sec); }
+        inline void read_timeout(net::timeout_t timeout)
+        { raw_stream().read_timeout(timeout); }
         
         /**
-         * Write timeout
+         * Write timeout, in milliseconds
          */
-        int write_timeout() const
+        net::timeout_t write_timeout() const
         { return raw_stream().write_timeout(); }
         
-        inline void write_timeout(int sec)
-        { raw_stream().write_timeout(sec); }
+        inline void write_timeout(net::timeout_t timeout)
+        { raw_stream().write_timeout(timeout); }
         
         /**
          * Raw mode means the response should be handled by the request handler
@@ -404,6 +611,119 @@ namespace http {
         inline void max_keepalive(int n)
         { max_keepalive_=n; }
         
+        /**
+         * True if more requests have already been received after the current one, the response
+         * is then sent together with the following ones
+         */
+        inline bool pipelined() const
+        { return pipelined_; }
+        
+        /**
+         * Compression of response bodies, off by default
+         */
+        inline const compression_options_t &compression() const
+        { return compression_; }
+        
+        inline void compression(const compression_options_t &v)
+        { compression_=v; }
+        
+        /**
+         * Size limit, streaming and spilling of request bodies, set it in the open handler
+         */
+        inline const body_options_t &body_options() const
+        { return body_options_; }
+        
+        inline void body_options(const body_options_t &v)
+        { body_options_=v; }
+        
+        /**
+         * Next piece of a streaming request body, valid until the next call
+         *
+         * "100 Continue" is sent first if the client is waiting for it, so a handler that rejects
+         * the request without reading the body never gets it sent over the network. The part of
+         * the body left unread when the handler returns is skipped, or the connection is closed if
+         * the client hasn't been told to continue.
+         *
+         * @return false at the end of the body, or if it's too large or the connection failed,
+         *         see body_complete() and body_error()
+         */
+        bool read_body(string_ref_t &chunk);
+        
+        /**
+         * Read the rest of a streaming request body into request().body(), or the temp file if
+         * it's larger than body_options().spill_size
+         *
+         * @return true if the whole body has been received, always true when not streaming
+         */
+        bool receive_body();
+        
+        /**
+         * True if all of the request body has been received
+         */
+        bool body_complete() const;
+        
+        /**
+         * REQUEST_ENTITY_TOO_LARGE if the body has crossed body_options().max_size, or
+         * INTERNAL_SERVER_ERROR if it couldn't be spilled, OK otherwise
+         *
+         * The response is replaced with this status and the connection is closed after the
+         * handler returns, unless the response has been sent by then
+         */
+        inline status_code body_error() const
+        { return body_error_; }
+        
+        /**
+         * Metrics the request is recorded in, set by router to the matching route
+         */
+        inline const route_metrics_t *route_metrics() const
+        { return route_metrics_; }
+        
+        inline void route_metrics(const route_metrics_t *v)
+        { route_metrics_=v; }
+        
+        /**
+         * Bytes received after a CONNECT or Upgrade request, which the handler must deal with
+         * before reading from raw_stream(), empty for other requests
+         */
+        inline string_ref_t unparsed() const
+        { return unparsed_; }
+        
+        /**
+         * Send the status line and headers of response() now, the body follows with write_body()
+         *
+         * The body is sent with the given Content-Length, or chunked if it's negative, or until
+         * the connection is closed for HTTP/1.0 clients. Connection headers are decided here the
+         * same way as for buffered responses. The response is finished by end_response() or when
+         * the handler returns; if the handler throws, the connection is closed. 1xx, 204 and 304
+         * responses get no framing headers and no body.
+         *
+         * @return false if the head couldn't be sent
+         */
+        bool begin_response(std::int64_t content_length=-1);
+        
+        /**
+         * Send a piece of the body, returns after it has been written to the socket
+         *
+         * @return false if the write failed or exceeds the Content-Length
+         */
+        bool write_body(const char *data, std::size_t size);
+        
+        inline bool write_body(const string_ref_t &s)
+        { return write_body(s.data(), s.size()); }
+        
+        /**
+         * Finish a streaming response, the trailers of response() are sent after a chunked body
+         *
+         * @return false if the body is shorter than Content-Length or the write failed
+         */
+        bool end_response();
+        
+        /**
+         * True if the head of the response has been sent by begin_response()
+         */
+        inline bool streaming() const
+        { return stream_mode_!=stream_none; }
+        
         /**
          * Return true means the remote peer wants the connection keep alive
          */
@@ -456,24 +776,80 @@ namespace http {
         { return yield_context(); }
         
         /**
-         * Spawn new coroutine within the strand
+         * Spawn new coroutine within the strand, the stack comes from the pool of the connection
          */
         template <typename Function>
         void spawn(BOOST_ASIO_MOVE_ARG(Function) function) {
-            boost::asio::spawn(strand(), BOOST_ASIO_MOVE_CAST(Function)(function));
+            raw_stream().spawn(BOOST_ASIO_MOVE_CAST(Function)(function));
         }
         
     private:
+        enum stream_mode_t {
+            stream_none,
+            stream_fixed,
+            stream_chunked,
+            stream_until_close,
+            stream_done,
+        };
+        
+        /**
+         * True if the rest of the body can't be skipped because the client is waiting for
+         * "100 Continue", the connection has to be closed after the response
+         */
+        bool body_unskippable() const;
+        
         request_t request_;
         response_t response_;
         bool raw_=false;
         net::async_tcp_stream &raw_stream_;
         int count_=0;
         int max_keepalive_=0;
+        bool pipelined_=false;
+        compression_options_t compression_;
+        body_options_t body_options_;
+        details::request::parser *parser_=nullptr;
+        status_code body_error_=OK;
+        const route_metrics_t *route_metrics_=nullptr;
+        // When the first byte of the request was parsed
+        std::chrono::steady_clock::time_point start_;
+        string_ref_t unparsed_;
+        // Rendered response head, capacity is kept across requests
+        std::string head_buffer_;
+        stream_mode_t stream_mode_=stream_none;
+        std::uint64_t stream_remaining_=0;
+        std::uint64_t stream_bytes_=0;
+        bool stream_keep_alive_=false;
+        bool stream_head_only_=false;
+        
+        friend struct details::request::parser;
+        friend bool request_callback(session_t &session, std::function<bool(session_t &)> &handler);
+        friend bool relay_response(net::upstream_connection &upstream, session_t &session);
     };
     
     typedef std::function<bool(session_t &)> request_handler_t;
     
+    /**
+     * Rendered "HTTP/1.1 NNN Reason\r\n", empty for unknown status codes
+     */
+    string_ref_t status_line(status_code code);
+    
+    /**
+     * Method name as it appears in the request line, empty for unknown methods
+     */
+    string_ref_t method_name(method m);
+    
+    /**
+     * Handler rendering net::metrics in Prometheus text format, i.e.
+     * {url_equals("/metrics"), http::metrics_handler()}
+     */
+    struct metrics_handler {
+        bool operator()(session_t &session) const;
+        
+        template<typename Arg>
+        bool operator()(session_t &session, Arg &) const
+        { return (*this)(session); }
+    };
+    
     template<typename... Args>
     bool default_open_handler(session_t &session, const Args &...)
     { return true; }
@@ -493,6 +869,55 @@ namespace http {
     bool request_callback(session_t &session, std::function<bool(session_t &)> &handler);
     std::ostream &operator<<(std::ostream &s, response_t &resp);
     
+    /**
+     * Send response with one gathering write, the head is rendered into buffer and the body is sent in place,
+     * a file body is sent with net::async_stream::send_file() after the head
+     *
+     * @param extra_headers rendered headers, i.e. Connection and Keep-Alive, added after the response headers
+     */
+    bool write_response(net::async_tcp_stream &s,
+                        response_t &resp,
+                        std::string &buffer,
+                        const string_ref_t &extra_headers=string_ref_t());
+    
+    namespace details {
+        /**
+         * Render the status line and headers the way request_callback does, extra headers come
+         * last, Content-Length is added unless the handler has set it or content_length is false
+         *
+         * @return false for unknown status codes, a bodyless 500 is rendered instead
+         */
+        bool render_head(std::string &out,
+                         const response_t &resp,
+                         const string_ref_t &extra_headers,
+                         bool content_length=true);
+        
+        /**
+         * Run the request parser over bytes already in memory, the handler is called for each
+         * complete request and nothing is read from or written to the socket by the parser
+         *
+         * @return number of requests parsed
+         */
+        std::size_t parse_request_buffer(session_t &session, const char *data, std::size_t size, request_handler_t &handler);
+    }   // End of namespace details
+    
+    /**
+     * Render the response so it can be sent again later, returns null for unknown status codes
+     * and responses with a file body
+     *
+     * @param compression the prepared response gets "Vary: Accept-Encoding" and can have compressed
+     *                    variants if compression is enabled and the response is worth compressing
+     */
+    prepared_response_ptr prepare_response(const response_t &resp,
+                                           const compression_options_t &compression=compression_options_t());
+    
+    /**
+     * Compressed variant of a compressible prepared response, made once and kept with it
+     *
+     * Null while another request is making it, the identity response is sent then
+     */
+    prepared_response_ptr compressed_variant(const prepared_response_t &p, content_coding c, int level);
+    
     /**
      * Handle HTTP protocol handler with argument
      */
@@ -603,6 +1028,39 @@ namespace http {
     bool parse_response(std::istream &is, response_t &resp);
     inline std::istream &operator>>(std::istream &is, response_t &resp)
     { parse_response(is, resp); return is; }
+    
+    /**
+     * Parse response from a pooled upstream connection, the connection is marked keep-alive if
+     * the response has been fully read and the upstream wants to keep it alive
+     *
+     * Interim 1xx responses other than 101 are skipped, resp gets the final response
+     */
+    bool parse_response(net::upstream_connection &upstream, response_t &resp);
+    inline net::upstream_connection &operator>>(net::upstream_connection &upstream, response_t &resp)
+    { parse_response(upstream, resp); return upstream; }
+    
+    /**
+     * Send the request of the session to upstream, the body is read from the client and passed on
+     * piece by piece if it's streaming, with the same framing the client has used
+     *
+     * The upstream is always asked to keep the connection alive so it can go back to the pool.
+     *
+     * @return false if the upstream has failed or the body couldn't be received, see
+     *         session_t::body_error()
+     */
+    bool relay_request(net::upstream_connection &upstream, session_t &session);
+    
+    /**
+     * Relay the response from upstream to the client of the session, which must be in raw mode
+     *
+     * The head is forwarded as soon as it's parsed, the body is passed on as it arrives through a
+     * bounded buffer, re-chunked if the upstream sent it chunked or until close. Responds 502 if
+     * the upstream fails before the head is sent. Interim 1xx responses other than 101 are
+     * skipped, like parse_response() does.
+     *
+     * @return false if the client connection can't be kept alive
+     */
+    bool relay_response(net::upstream_connection &upstream, session_t &session);
 }   // End of namespace http
 
 #endif /* defined(__coroserver__http_protocol__) */
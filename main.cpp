@@ -11,7 +11,11 @@
 #include "server.h"
 #include "http_protocol.h"
 #include "routing.h"
+#include "static_files.h"
+#include "response_cache.h"
 #include "calculator.h"
+#include "tunnel.h"
+#include "alloc_stats.h"
 
 #include "condition_variable.hpp"
 
@@ -23,7 +27,7 @@ typedef int arg_t;
 // Test redirection
 bool handle_alt_index(http::session_t &session, arg_t &arg) {
     session.response().code(http::SEE_OTHER);
-    http::headers_t::const_iterator i=http::find_header(session.request().headers(), "host");
+    http::headers_t::const_iterator i=http::find_header(session.request().headers(), http::header_id::host);
     if (i!=session.request().headers().end()) {
         session.response().headers().push_back(*i);
     }
@@ -47,6 +51,8 @@ bool handle_index(http::session_t &session, arg_t &arg) {
     ss << "<H1>Changing session argument from " << arg << " to " << arg+2 << "</H1><HR/>\r\n";
     arg+=2;
     ss << "<P>" << session.count() << " requests have been processed in this session.<P/>\r\n";
+    // Handlers may resume on another thread, per-request figures come from the microbenchmarks
+    ss << "<P>" << net::thread_alloc_stats().allocations << " heap allocations have been made by this thread.<P/>\r\n";
     ss << "<TABLE border=1>\r\n";
     ss << "<TR><TD>Schema</TD><TD>" << session.request().schema() << "</TD></TR>\r\n";
     ss << "<TR><TD>User Info</TD><TD>" << session.request().user_info() << "</TD></TR>\r\n";
@@ -60,6 +66,17 @@ bool handle_index(http::session_t &session, arg_t &arg) {
         ss << "<TR><TD>" << h.first << "</TD><TD>" << h.second << "</TD></TR>\r\n";
     }
     ss << "</TABLE>\r\n";
+    ss << "<P><A href=\"/lines.html\">Lines</A><P/>\r\n";
+    ss << "</BODY></HTML>\r\n";
+    return true;
+}
+
+// Test cached response, depends on nothing but the URL
+bool handle_lines(http::session_t &session, arg_t &arg) {
+    using namespace std;
+    session.response().body_stream().reserve(16384);
+    ostream &ss=session.response().body_stream();
+    ss << "<HTML>\r\n<TITLE>Lines</TITLE><BODY>\r\n";
     for(int i=0; i<1000; i++) {
         ss << "Line" << i << "<BR/>\r\n";
     }
@@ -67,6 +84,48 @@ bool handle_index(http::session_t &session, arg_t &arg) {
     return true;
 }
 
+// Test streaming response
+bool handle_stream(http::session_t &session, arg_t &arg) {
+    session.response().headers().push_back("Content-Type", "text/plain");
+    session.response().headers().push_back("Trailer", "X-Line-Count");
+    if (!session.begin_response())
+        return false;
+    std::string chunk;
+    int lines=0;
+    for (int i=0; i<100; i++) {
+        chunk.clear();
+        for (int j=0; j<100; j++, lines++) {
+            chunk+="Line ";
+            chunk+=std::to_string(lines);
+            chunk+="\r\n";
+        }
+        // Returns after the chunk has been written to the socket
+        if (!session.write_body(chunk))
+            return false;
+    }
+    session.response().trailers().push_back("X-Line-Count", std::to_string(lines));
+    return session.end_response();
+}
+
+// Test streaming request body
+bool handle_upload(http::session_t &session, arg_t &arg) {
+    if (session.request().method()!=http::POST && session.request().method()!=http::PUT) {
+        session.response().code(http::METHOD_NOT_ALLOWED);
+        session.response().headers().push_back("Allow", "POST, PUT");
+        return true;
+    }
+    // Nothing has been sent by the client yet if it's waiting for "100 Continue"
+    std::uint64_t size=0;
+    http::string_ref_t chunk;
+    while (session.read_body(chunk))
+        size+=chunk.size();
+    if (!session.body_complete())
+        return false;
+    session.response().headers().push_back("Content-Type", "text/plain");
+    session.response().body_stream() << size << " bytes received\r\n";
+    return true;
+}
+
 // Test deferred process with spawn
 bool handle_other(http::session_t &session, arg_t &arg) {
     boost::asio::condition_flag flag(session);
@@ -97,47 +156,110 @@ bool handle_other(http::session_t &session, arg_t &arg) {
     return true;
 }
 
+// Test CONNECT tunnel
+bool handle_connect(http::session_t &session) {
+    session.raw(true);
+    std::string host=session.request().host().to_string();
+    if (host.find(':')!=std::string::npos) {
+        // IPv6 literal
+        host='['+host+']';
+    }
+    std::unique_ptr<net::async_tcp_stream> upstream;
+    try {
+        upstream.reset(new net::async_tcp_stream(session.yield_context(), host, std::to_string(session.request().port())));
+    } catch(boost::system::system_error &e) {
+        http::string_ref_t line=http::status_line(http::BAD_GATEWAY);
+        session.raw_stream().write(line.data(), line.size());
+        session.raw_stream() << "Connection: close\r\nContent-Length: 0\r\n\r\n";
+        return false;
+    }
+    http::string_ref_t line=http::status_line(http::OK);
+    session.raw_stream().write(line.data(), line.size());
+    session.raw_stream() << "\r\n";
+    session.raw_stream().flush();
+    // Client may have sent the first bytes together with the request
+    upstream->write(session.unparsed().data(), session.unparsed().size());
+    // Byte counts go to net_tunnel_bytes_total in /metrics
+    net::tunnel(session.raw_stream(), *upstream, std::chrono::seconds(60));
+    return false;
+}
+
 // Test client connection
 bool handle_proxy(http::session_t &session) {
-    http::headers_t::const_iterator i=http::find_header(session.request().headers(), "host");
+    if (session.request().method()==http::CONNECT)
+        return handle_connect(session);
+    http::headers_t::const_iterator i=http::find_header(session.request().headers(), http::header_id::host);
     if (i==session.request().headers().end()) {
         session.response().code(http::BAD_REQUEST);
         return false;
     }
+    net::upstream_connection upstream(session.yield_context(), i->second.to_string(), "80");
+    if (!http::relay_request(upstream, session)) {
+        // A failed body is answered by the framework
+        session.response().code(http::BAD_GATEWAY);
+        return false;
+    }
     session.raw(true);
-    net::async_tcp_stream s(session.yield_context(), i->second, "80");
-    s << session.request();
-    s >> session.response();
-    session.raw_stream() << session.response();
-    session.raw_stream().flush();
-    return true;
+    return http::relay_response(upstream, session);
 }
 
 int main(int argc, const char *argv[]) {
     std::size_t num_threads = 3;
     try {
         http::protocol_handler<> hproxy;
+        hproxy.set_open_handler([](http::session_t &session)->bool{
+            // Request bodies are passed on as they arrive
+            http::body_options_t body;
+            body.max_size=64*1024*1024;
+            body.streaming=true;
+            session.body_options(body);
+            return true;
+        });
         hproxy.set_request_handler(&handle_proxy);
         
         http::protocol_handler<arg_t> handler;
         handler.set_default_argument(42);
         handler.set_open_handler([](http::session_t &session, arg_t &arg)->bool{
-            session.read_timeout(5);
-            session.write_timeout(5);
+            session.read_timeout(std::chrono::seconds(5));
+            session.write_timeout(std::chrono::seconds(5));
             session.max_keepalive(3);
+            http::compression_options_t compression;
+            compression.enabled=true;
+            session.compression(compression);
+            http::body_options_t body;
+            body.max_size=64*1024*1024;
+            body.streaming=true;
+            session.body_options(body);
             return true;
         });
+        http::static_files_options_t static_options;
+        // Only the asset directory is published, not the working directory
+        static_options.strip_prefix="/static";
+        static_options.max_age=std::chrono::seconds(3600);
         handler.set_request_handler(http::router<arg_t>({
             {http::url_equals("/"), &handle_alt_index},
+            // The index shows the request headers and session state, only the lines are cached
             {http::url_equals("/index.html"), &handle_index},
+            {http::url_equals("/lines.html"), http::cached(&handle_lines)},
             {http::url_starts_with("/index") && http::url_ends_with(".htm"), &handle_alt_index},
             {http::url_equals("/favicon.ico"), &handle_not_found},
+            {http::url_equals("/stream"), &handle_stream},
+            {http::url_equals("/upload"), &handle_upload},
+            {http::url_equals("/metrics"), http::metrics_handler()},
+            {http::url_starts_with("/static/"), http::static_files("static", static_options)},
             {http::any(), &handle_other},
         }));
+        net::server_options_t server_options;
+        // Sample the stack usage of some connections, see net_coroutine_stack_used_bytes in /metrics
+        server_options.stack.sample_rate=64;
+        // Shed load once handlers wait more than 5ms to run, and cap the connections
+        server_options.admission.target=std::chrono::milliseconds(5);
+        server_options.max_connections=10000;
         net::server s({{"[0::0]:20000", handler}, {"[0::0]:20001", hproxy}, {"[0::0]:30000", &calculator::protocol_handler}},
                  [](boost::asio::io_service &)->bool { return true; },
                  [](boost::asio::io_service &){},
-                 num_threads);
+                 num_threads,
+                 server_options);
         if (!s.initialized()) {
             // TODO: Log error
         }
@@ -0,0 +1,284 @@
+//
+//  metrics.cpp
+//  coroserver
+//
+
+#include <cstdio>
+#include <mutex>
+#include <memory>
+#include <stdexcept>
+#include "metrics.h"
+
+namespace net {
+    namespace metrics {
+        namespace details {
+            enum kind_t {
+                counter_kind,
+                gauge_kind,
+                histogram_kind,
+            };
+
+            struct series_t {
+                // Rendered as {name="value",...}, empty without labels
+                std::string labels;
+                std::size_t slot;
+            };
+
+            struct family_t {
+                std::string name;
+                std::string help;
+                kind_t kind;
+                double scale;
+                std::vector<double> bounds;
+                std::vector<series_t> series;
+            };
+
+            struct registry_t {
+                std::mutex mutex;
+                // Slot 0 is the sink of default constructed metrics
+                std::size_t next_slot=1;
+                std::vector<std::unique_ptr<family_t>> families;
+                std::vector<shard_t *> shards;
+            };
+
+            registry_t &registry() {
+                // Never destroyed, threads may still update metrics during exit
+                static registry_t *r=new registry_t;
+                return *r;
+            }
+
+            shard_t *register_shard() {
+                shard_t *shard=new shard_t;
+                for (std::atomic<block_t *> &b : shard->blocks)
+                    b.store(nullptr, std::memory_order_relaxed);
+                registry_t &r=registry();
+                std::lock_guard<std::mutex> lock(r.mutex);
+                r.shards.push_back(shard);
+                return shard;
+            }
+
+            block_t *allocate_block(shard_t &shard, std::size_t n) {
+                if (n>=max_blocks) throw std::length_error("Too many metrics");
+                block_t *b=new block_t;
+                for (std::atomic<std::uint64_t> &s : b->slots)
+                    s.store(0, std::memory_order_relaxed);
+                // Published to render(), which may run on another thread
+                shard.blocks[n].store(b, std::memory_order_release);
+                return b;
+            }
+
+            void append_escaped(std::string &out, const std::string &s) {
+                for (char c : s) {
+                    switch (c) {
+                        case '\\':
+                            out+="\\\\";
+                            break;
+                        case '"':
+                            out+="\\\"";
+                            break;
+                        case '\n':
+                            out+="\\n";
+                            break;
+                        default:
+                            out+=c;
+                    }
+                }
+            }
+
+            std::string render_labels(const labels_t &labels) {
+                std::string s;
+                for (const std::pair<std::string, std::string> &l : labels) {
+                    s+=s.empty() ? "{" : ",";
+                    s+=l.first;
+                    s+="=\"";
+                    append_escaped(s, l.second);
+                    s+='"';
+                }
+                if (!s.empty()) s+='}';
+                return s;
+            }
+
+            /**
+             * Labels of a series with one more label added
+             */
+            std::string with_label(const std::string &labels, const char *name, const std::string &value) {
+                std::string s=labels.empty() ? std::string("{") : labels.substr(0, labels.size()-1)+",";
+                s+=name;
+                s+="=\"";
+                s+=value;
+                s+="\"}";
+                return s;
+            }
+
+            std::size_t allocate(const std::string &name,
+                                 const std::string &help,
+                                 const labels_t &labels,
+                                 kind_t kind,
+                                 std::size_t slots,
+                                 double scale=1,
+                                 const std::vector<double> &bounds=std::vector<double>())
+            {
+                std::string l=render_labels(labels);
+                registry_t &r=registry();
+                std::lock_guard<std::mutex> lock(r.mutex);
+                family_t *f=nullptr;
+                for (std::unique_ptr<family_t> &i : r.families) {
+                    if (i->name==name) {
+                        f=i.get();
+                        break;
+                    }
+                }
+                if (!f) {
+                    r.families.emplace_back(new family_t{name, help, kind, scale, bounds, std::vector<series_t>()});
+                    f=r.families.back().get();
+                } else if (f->kind!=kind) {
+                    throw std::invalid_argument("Metric "+name+" exists with another type");
+                }
+                for (const series_t &s : f->series) {
+                    if (s.labels==l) return s.slot;
+                }
+                // A series never straddles two blocks, slots are looked up by block
+                if (r.next_slot/block_slots!=(r.next_slot+slots-1)/block_slots)
+                    r.next_slot=(r.next_slot/block_slots+1)*block_slots;
+                if (r.next_slot+slots>block_slots*max_blocks) throw std::length_error("Too many metrics");
+                f->series.push_back(series_t{l, r.next_slot});
+                r.next_slot+=slots;
+                return f->series.back().slot;
+            }
+
+            /**
+             * Sum of a slot over all threads, called with the registry locked
+             */
+            std::uint64_t sum(const registry_t &r, std::size_t slot) {
+                std::uint64_t v=0;
+                for (shard_t *shard : r.shards) {
+                    block_t *b=shard->blocks[slot/block_slots].load(std::memory_order_acquire);
+                    if (b) v+=b->slots[slot%block_slots].load(std::memory_order_relaxed);
+                }
+                return v;
+            }
+
+            void append_number(std::string &out, double v) {
+                char buf[32];
+                int n=snprintf(buf, sizeof(buf), "%.9g", v);
+                out.append(buf, n);
+            }
+
+            void append_number(std::string &out, std::uint64_t v) {
+                char buf[24];
+                int n=snprintf(buf, sizeof(buf), "%llu", static_cast<unsigned long long>(v));
+                out.append(buf, n);
+            }
+
+            void render_histogram(std::string &out, const registry_t &r, const family_t &f) {
+                static const double quantiles[]={0.5, 0.9, 0.99};
+                std::vector<std::uint64_t> buckets(bucket_count);
+                std::string q;
+                for (const series_t &s : f.series) {
+                    std::uint64_t count=0;
+                    for (std::size_t b=0; b<bucket_count; b++) {
+                        buckets[b]=sum(r, s.slot+b);
+                        count+=buckets[b];
+                    }
+                    // A fine bucket is counted in the first bound it fits under
+                    std::size_t b=0;
+                    std::uint64_t cumulative=0;
+                    for (double bound : f.bounds) {
+                        while (b<bucket_count && buckets_t::upper(b)*f.scale<=bound)
+                            cumulative+=buckets[b++];
+                        char le[32];
+                        snprintf(le, sizeof(le), "%g", bound);
+                        out+=f.name+"_bucket"+with_label(s.labels, "le", le)+" ";
+                        append_number(out, cumulative);
+                        out+='\n';
+                    }
+                    out+=f.name+"_bucket"+with_label(s.labels, "le", "+Inf")+" ";
+                    append_number(out, count);
+                    out+='\n';
+                    out+=f.name+"_sum"+s.labels+" ";
+                    append_number(out, sum(r, s.slot+bucket_count)*f.scale);
+                    out+='\n';
+                    out+=f.name+"_count"+s.labels+" ";
+                    append_number(out, count);
+                    out+='\n';
+                    // Quantiles from the fine buckets, the middle of the bucket is taken
+                    for (double quantile : quantiles) {
+                        char label[8];
+                        snprintf(label, sizeof(label), "%g", quantile);
+                        std::uint64_t rank=static_cast<std::uint64_t>(quantile*count+0.5);
+                        std::uint64_t seen=0;
+                        double v=0;
+                        for (std::size_t i=0; i<bucket_count && count>0; i++) {
+                            seen+=buckets[i];
+                            if (seen>=rank && buckets[i]>0) {
+                                std::uint64_t lower=i==0 ? 0 : buckets_t::upper(i-1)+1;
+                                v=(lower+buckets_t::upper(i))/2.0*f.scale;
+                                break;
+                            }
+                        }
+                        q+=f.name+"_quantile"+with_label(s.labels, "quantile", label)+" ";
+                        append_number(q, v);
+                        q+='\n';
+                    }
+                }
+                out+="# HELP "+f.name+"_quantile Quantiles of "+f.name+"\n";
+                out+="# TYPE "+f.name+"_quantile gauge\n";
+                out+=q;
+            }
+        }   // End of namespace details
+
+        const std::vector<double> &latency_bounds() {
+            static const std::vector<double> bounds{
+                0.0001, 0.00025, 0.0005,
+                0.001, 0.0025, 0.005,
+                0.01, 0.025, 0.05,
+                0.1, 0.25, 0.5,
+                1, 2.5, 5, 10,
+            };
+            return bounds;
+        }
+
+        counter make_counter(const std::string &name, const std::string &help, const labels_t &labels) {
+            return counter(details::allocate(name, help, labels, details::counter_kind, 1));
+        }
+
+        gauge make_gauge(const std::string &name, const std::string &help, const labels_t &labels) {
+            return gauge(details::allocate(name, help, labels, details::gauge_kind, 1));
+        }
+
+        histogram make_histogram(const std::string &name,
+                                 const std::string &help,
+                                 const labels_t &labels,
+                                 double scale,
+                                 const std::vector<double> &bounds)
+        {
+            // Buckets followed by the sum
+            return histogram(details::allocate(name, help, labels, details::histogram_kind, details::bucket_count+1, scale, bounds));
+        }
+
+        void render(std::string &out) {
+            static const char *types[]={"counter", "gauge", "histogram"};
+            details::registry_t &r=details::registry();
+            std::lock_guard<std::mutex> lock(r.mutex);
+            for (const std::unique_ptr<details::family_t> &f : r.families) {
+                out+="# HELP "+f->name+" "+f->help+"\n";
+                out+="# TYPE "+f->name+" "+types[f->kind]+"\n";
+                if (f->kind==details::histogram_kind) {
+                    details::render_histogram(out, r, *f);
+                    continue;
+                }
+                for (const details::series_t &s : f->series) {
+                    std::uint64_t v=details::sum(r, s.slot);
+                    out+=f->name+s.labels+" ";
+                    if (f->kind==details::gauge_kind) {
+                        // Copies of a gauge may be negative, the sum wraps back
+                        details::append_number(out, static_cast<double>(static_cast<std::int64_t>(v)));
+                    } else {
+                        details::append_number(out, v);
+                    }
+                    out+='\n';
+                }
+            }
+        }
+    }   // End of namespace metrics
+}   // End of namespace net
@@ -0,0 +1,191 @@
+//
+//  metrics.h
+//  coroserver
+//
+
+#ifndef __coroserver__metrics__
+#define __coroserver__metrics__
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <utility>
+
+namespace net {
+    /**
+     * Process-wide metrics registry
+     *
+     * Every thread updates its own copy of each value without locking or sharing cache lines
+     * with other threads, the copies are summed up when the registry is rendered. Copies of
+     * threads that have exited are kept so counters never go back.
+     */
+    namespace metrics {
+        typedef std::vector<std::pair<std::string, std::string>> labels_t;
+
+        /**
+         * Log-linear buckets, exact below 2^(SubBits+1) and 2^SubBits per power of 2 above, values
+         * are capped at 2^MaxBits
+         */
+        template<int SubBits, int MaxBits=40>
+        struct log_linear_buckets {
+            static constexpr int sub_bits=SubBits;
+            static constexpr int max_bits=MaxBits;
+            static constexpr std::size_t count=(2<<sub_bits)+(max_bits-sub_bits-1)*(1<<sub_bits);
+
+            static std::size_t bucket_of(std::uint64_t v) {
+                if (v<(2u<<sub_bits)) return static_cast<std::size_t>(v);
+                if (v>=(std::uint64_t(1)<<max_bits)) v=(std::uint64_t(1)<<max_bits)-1;
+                int msb=63-__builtin_clzll(v);
+                std::size_t top=static_cast<std::size_t>(v>>(msb-sub_bits))-(1<<sub_bits);
+                return (2<<sub_bits)+(msb-sub_bits-1)*(1<<sub_bits)+top;
+            }
+
+            /**
+             * Largest value falling into bucket b
+             */
+            static std::uint64_t upper(std::size_t b) {
+                if (b<(2u<<sub_bits)) return b;
+                std::size_t g=(b-(2<<sub_bits))>>sub_bits;
+                std::uint64_t top=(1<<sub_bits)+((b-(2<<sub_bits)) & ((1<<sub_bits)-1));
+                int shift=static_cast<int>(g)+1;
+                return ((top+1)<<shift)-1;
+            }
+        };
+
+        template<int SubBits, int MaxBits>
+        constexpr std::size_t log_linear_buckets<SubBits, MaxBits>::count;
+
+        namespace details {
+            constexpr std::size_t block_slots=1024;
+            constexpr std::size_t max_blocks=1024;
+
+            struct block_t {
+                std::atomic<std::uint64_t> slots[block_slots];
+            };
+
+            /**
+             * Values of one thread, blocks are allocated when first touched
+             */
+            struct shard_t {
+                std::atomic<block_t *> blocks[max_blocks];
+            };
+
+            shard_t *register_shard();
+            block_t *allocate_block(shard_t &shard, std::size_t n);
+
+            inline std::atomic<std::uint64_t> &slot(std::size_t i) {
+                static thread_local shard_t *shard;
+                if (!shard) shard=register_shard();
+                block_t *b=shard->blocks[i/block_slots].load(std::memory_order_relaxed);
+                if (!b) b=allocate_block(*shard, i/block_slots);
+                return b->slots[i%block_slots];
+            }
+
+            inline void add(std::size_t i, std::uint64_t n) {
+                std::atomic<std::uint64_t> &s=slot(i);
+                // Only this thread writes the slot, the readers just need to see a whole value
+                s.store(s.load(std::memory_order_relaxed)+n, std::memory_order_relaxed);
+            }
+
+            // Exact below 16 and 8 per power of 2 above
+            typedef log_linear_buckets<3> buckets_t;
+            constexpr std::size_t bucket_count=buckets_t::count;
+        }   // End of namespace details
+
+        /**
+         * Monotonic counter
+         */
+        class counter {
+        public:
+            counter() = default;
+
+            inline void inc(std::uint64_t n=1) const
+            { details::add(slot_, n); }
+
+        private:
+            explicit counter(std::size_t slot) : slot_(slot) {}
+            // Slot 0 is a sink for default constructed metrics
+            std::size_t slot_=0;
+
+            friend counter make_counter(const std::string &, const std::string &, const labels_t &);
+        };
+
+        /**
+         * Value that goes up and down, the copies of all threads are added up
+         */
+        class gauge {
+        public:
+            gauge() = default;
+
+            inline void add(std::int64_t n) const
+            { details::add(slot_, static_cast<std::uint64_t>(n)); }
+
+            inline void inc() const
+            { add(1); }
+
+            inline void dec() const
+            { add(-1); }
+
+        private:
+            explicit gauge(std::size_t slot) : slot_(slot) {}
+            std::size_t slot_=0;
+
+            friend gauge make_gauge(const std::string &, const std::string &, const labels_t &);
+        };
+
+        /**
+         * HDR-style histogram of non-negative integers, i.e. latencies in microseconds
+         *
+         * Values are counted in log-linear buckets with at most 12.5% relative error, rendered as
+         * a Prometheus histogram with the given bounds plus a "_quantile" gauge for p50, p90 and p99
+         */
+        class histogram {
+        public:
+            histogram() = default;
+
+            inline void observe(std::uint64_t v) const {
+                if (slot_==0) return;
+                details::add(slot_+details::buckets_t::bucket_of(v), 1);
+                details::add(slot_+details::bucket_count, v);
+            }
+
+        private:
+            explicit histogram(std::size_t slot) : slot_(slot) {}
+            std::size_t slot_=0;
+
+            friend histogram make_histogram(const std::string &, const std::string &, const labels_t &, double, const std::vector<double> &);
+        };
+
+        /**
+         * Upper bounds in seconds used for latency histograms, 100us to 10s
+         */
+        const std::vector<double> &latency_bounds();
+
+        /**
+         * Get the metric with the name and labels, it's created on first use
+         *
+         * These take a lock, keep the returned handle instead of calling them for every update
+         */
+        counter make_counter(const std::string &name, const std::string &help, const labels_t &labels=labels_t());
+        gauge make_gauge(const std::string &name, const std::string &help, const labels_t &labels=labels_t());
+
+        /**
+         * @param scale multiplied to observed values when rendered, 1e-6 for microseconds rendered in seconds
+         * @param bounds upper bounds of the rendered buckets, after scaling
+         */
+        histogram make_histogram(const std::string &name,
+                                 const std::string &help,
+                                 const labels_t &labels=labels_t(),
+                                 double scale=1e-6,
+                                 const std::vector<double> &bounds=latency_bounds());
+
+        /**
+         * Append all metrics in Prometheus text exposition format
+         */
+        void render(std::string &out);
+    }   // End of namespace metrics
+}   // End of namespace net
+
+#endif /* defined(__coroserver__metrics__) */
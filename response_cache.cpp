@@ -0,0 +1,280 @@
+//
+//  response_cache.cpp
+//  coroserver
+//
+
+#include <cstring>
+#include <cstdlib>
+#include "response_cache.h"
+
+namespace http {
+    namespace details {
+        inline bool cacheable_code(status_code code) {
+            switch (code) {
+                case OK:
+                case NON_AUTHORITATIVE_INFORMATION:
+                case MULTIPLE_CHOICES:
+                case MOVED_PERMANENTLY:
+                case NOT_FOUND:
+                case GONE:
+                    return true;
+                default:
+                    return false;
+            }
+        }
+
+        inline bool directive_value(const string_ref_t &directive, const string_ref_t &name, net::timeout_t &v) {
+            if (directive.size()<=name.size() || !iequals(directive.substr(0, name.size()), name))
+                return false;
+            v=std::chrono::seconds(std::strtoll(std::string(directive.data()+name.size(), directive.size()-name.size()).c_str(), nullptr, 10));
+            return true;
+        }
+
+        /**
+         * Take the next element off a comma separated header value, without surrounding spaces
+         */
+        inline string_ref_t next_token(string_ref_t &list) {
+            std::size_t comma=list.find(',');
+            string_ref_t d=list.substr(0, comma);
+            list.remove_prefix(comma==string_ref_t::npos ? list.size() : comma+1);
+            while (!d.empty() && d.front()==' ') d.remove_prefix(1);
+            while (!d.empty() && d.back()==' ') d.remove_suffix(1);
+            return d;
+        }
+
+        /**
+         * True if every header named by the Vary headers of the response is part of the key,
+         * Accept-Encoding is handled by the compressed variants
+         */
+        bool vary_covered(const response_t &resp, const std::vector<std::string> &vary) {
+            for (headers_t::const_iterator i=resp.headers().begin(); i!=resp.headers().end(); ++i) {
+                if (i.id()!=header_id::vary) continue;
+                string_ref_t list=i->second;
+                while (!list.empty()) {
+                    string_ref_t name=next_token(list);
+                    if (name.empty() || iequals(name, "Accept-Encoding")) continue;
+                    if (name=="*") return false;
+                    bool found=false;
+                    for (const std::string &v : vary) {
+                        if (iequals(name, v)) {
+                            found=true;
+                            break;
+                        }
+                    }
+                    if (!found) return false;
+                }
+            }
+            return true;
+        }
+
+        /**
+         * Check the response made by the handler, ttl and stale are taken from Cache-Control if set
+         */
+        bool cacheable(const session_t &session, const std::vector<std::string> &vary, net::timeout_t &ttl, net::timeout_t &stale) {
+            const response_t &resp=session.response();
+            if (session.raw() || session.streaming() || resp.has_file_body() || !cacheable_code(resp.code()))
+                return false;
+            if (resp.headers().contains(header_id::set_cookie) || !vary_covered(resp, vary))
+                return false;
+            bool shared=false;
+            string_ref_t cc=resp.headers().value(header_id::cache_control);
+            while (!cc.empty()) {
+                string_ref_t d=next_token(cc);
+                if (iequals(d, "no-store") || iequals(d, "no-cache") || iequals(d, "private"))
+                    return false;
+                net::timeout_t v;
+                if (iequals(d, "public") || directive_value(d, "s-maxage=", v))
+                    shared=true;
+                directive_value(d, "max-age=", ttl);
+                directive_value(d, "stale-while-revalidate=", stale);
+            }
+            // Answers to authenticated requests are for that user only, unless marked otherwise
+            if (session.request().headers().contains(header_id::authorization) && !shared)
+                return false;
+            return ttl.count()>0;
+        }
+    }   // End of namespace details
+
+    response_cache::ticket_t::~ticket_t() {
+        if (refreshing_)
+            cache_->abandon(*this);
+    }
+
+    std::size_t response_cache::key_hash::operator()(const string_ref_t &s) const {
+        // FNV-1a
+        std::uint64_t h=14695981039346656037ULL;
+        for (char c : s) {
+            h^=static_cast<unsigned char>(c);
+            h*=1099511628211ULL;
+        }
+        return static_cast<std::size_t>(h);
+    }
+
+    response_cache::response_cache(const response_cache_options_t &options)
+    : options_(options)
+    , hits_(0)
+    , stale_hits_(0)
+    , misses_(0)
+    {
+        if (options_.shards==0) options_.shards=1;
+        for (std::size_t i=0; i<options_.shards; i++) {
+            shards_.emplace_back(new shard_t);
+        }
+        shard_budget_=options_.max_bytes/options_.shards;
+    }
+
+    string_ref_t response_cache::make_key(session_t &session) const {
+        // Built in the request arena, keys are only copied when an entry is stored
+        const request_t &req=session.request();
+        std::size_t size=req.path().size()+1+req.query().size();
+        for (const std::string &name : options_.vary) {
+            headers_t::const_iterator i=find_header(req.headers(), name);
+            size+=1+(i!=req.headers().end() ? i->second.size() : 0);
+        }
+        char *p=static_cast<char *>(session.arena().allocate(size, 1));
+        char *q=p;
+        memcpy(q, req.path().data(), req.path().size());
+        q+=req.path().size();
+        *q++='?';
+        memcpy(q, req.query().data(), req.query().size());
+        q+=req.query().size();
+        for (const std::string &name : options_.vary) {
+            headers_t::const_iterator i=find_header(req.headers(), name);
+            *q++='\n';
+            if (i!=req.headers().end()) {
+                memcpy(q, i->second.data(), i->second.size());
+                q+=i->second.size();
+            }
+        }
+        return string_ref_t(p, q-p);
+    }
+
+    bool response_cache::lookup(session_t &session, ticket_t &ticket) {
+        if (session.request().method()!=GET)
+            return false;
+        ticket.cache_=this;
+        ticket.key_=make_key(session);
+        ticket.shard_=key_hash()(ticket.key_)%shards_.size();
+        shard_t &shard=*shards_[ticket.shard_];
+        std::int64_t now=net::timer_wheel::now();
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        index_t::iterator i=shard.index.find(ticket.key_);
+        if (i!=shard.index.end()) {
+            entry_t &e=*i->second;
+            shard.lru.splice(shard.lru.begin(), shard.lru, i->second);
+            if (now<e.expires || (now<e.stale_until && e.refreshing)) {
+                if (now<e.expires) {
+                    hits_.fetch_add(1, std::memory_order_relaxed);
+                } else {
+                    stale_hits_.fetch_add(1, std::memory_order_relaxed);
+                }
+                session.response().prepared(e.response);
+                ticket.result_=e.result;
+                return true;
+            }
+            if (now<e.stale_until) {
+                // This request refreshes the entry, the others get the stale copy meanwhile
+                e.refreshing=true;
+                ticket.refreshing_=true;
+            }
+        }
+        misses_.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    void response_cache::store(session_t &session, ticket_t &ticket, bool result) {
+        if (!ticket.cache_)
+            return;
+        ticket.refreshing_=false;
+        net::timeout_t ttl=options_.ttl;
+        net::timeout_t stale=options_.stale_while_revalidate;
+        prepared_response_ptr p;
+        if (result && details::cacheable(session, options_.vary, ttl, stale))
+            p=prepare_response(session.response(), session.compression());
+        std::int64_t now=net::timer_wheel::now();
+        shard_t &shard=*shards_[ticket.shard_];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        index_t::iterator i=shard.index.find(ticket.key_);
+        if (!p) {
+            // Not cacheable any more
+            if (i!=shard.index.end() && now>=i->second->expires)
+                erase(shard, i->second);
+            return;
+        }
+        std::size_t bytes=sizeof(entry_t)+ticket.key_.size()+p->head.size()+p->body.size();
+        if (bytes>shard_budget_) {
+            if (i!=shard.index.end())
+                erase(shard, i->second);
+            return;
+        }
+        if (i!=shard.index.end()) {
+            entry_t &e=*i->second;
+            shard.bytes-=e.bytes;
+            e.response=p;
+            e.result=result;
+            e.expires=now+ttl.count();
+            e.stale_until=e.expires+stale.count();
+            e.refreshing=false;
+            e.bytes=bytes;
+            shard.bytes+=bytes;
+            shard.lru.splice(shard.lru.begin(), shard.lru, i->second);
+        } else {
+            shard.lru.push_front(entry_t{std::string(ticket.key_.data(), ticket.key_.size()),
+                                         p,
+                                         result,
+                                         now+ttl.count(),
+                                         now+ttl.count()+stale.count(),
+                                         false,
+                                         bytes});
+            const std::string &key=shard.lru.front().key;
+            shard.index.emplace(string_ref_t(key.data(), key.size()), shard.lru.begin());
+            shard.bytes+=bytes;
+        }
+        while (shard.bytes>shard_budget_) {
+            // Least recently used goes first, the new entry is at the front
+            erase(shard, std::prev(shard.lru.end()));
+        }
+    }
+
+    void response_cache::abandon(ticket_t &ticket) {
+        // The handler has thrown, let the next request try again
+        shard_t &shard=*shards_[ticket.shard_];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        index_t::iterator i=shard.index.find(ticket.key_);
+        if (i!=shard.index.end())
+            i->second->refreshing=false;
+    }
+
+    void response_cache::erase(shard_t &shard, lru_t::iterator i) {
+        shard.bytes-=i->bytes;
+        shard.index.erase(string_ref_t(i->key.data(), i->key.size()));
+        shard.lru.erase(i);
+    }
+
+    void response_cache::clear() {
+        for (std::unique_ptr<shard_t> &s : shards_) {
+            std::lock_guard<std::mutex> lock(s->mutex);
+            s->index.clear();
+            s->lru.clear();
+            s->bytes=0;
+        }
+    }
+
+    std::size_t response_cache::size() const {
+        std::size_t n=0;
+        for (const std::unique_ptr<shard_t> &s : shards_) {
+            std::lock_guard<std::mutex> lock(s->mutex);
+            n+=s->lru.size();
+        }
+        return n;
+    }
+
+    std::size_t response_cache::bytes() const {
+        std::size_t n=0;
+        for (const std::unique_ptr<shard_t> &s : shards_) {
+            std::lock_guard<std::mutex> lock(s->mutex);
+            n+=s->bytes;
+        }
+        return n;
+    }
+}   // End of namespace http
@@ -0,0 +1,214 @@
+//
+//  response_cache.h
+//  coroserver
+//
+
+#ifndef __coroserver__response_cache__
+#define __coroserver__response_cache__
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <list>
+#include <mutex>
+#include <memory>
+#include <atomic>
+#include <utility>
+#include <type_traits>
+#include <unordered_map>
+#include "timer_wheel.h"
+#include "http_protocol.h"
+
+namespace http {
+    struct response_cache_options_t {
+        /**
+         * How long an entry is fresh, unless the handler sets "Cache-Control: max-age"
+         */
+        net::timeout_t ttl=std::chrono::seconds(5);
+        /**
+         * How long an expired entry is still served while one request refreshes it, unless the
+         * handler sets "Cache-Control: stale-while-revalidate"
+         */
+        net::timeout_t stale_while_revalidate=std::chrono::seconds(30);
+        /**
+         * Memory budget for keys, heads and bodies, split evenly among shards
+         */
+        std::size_t max_bytes=64*1024*1024;
+        std::size_t shards=16;
+        /**
+         * Request headers the response depends on, their values are part of the key
+         */
+        std::vector<std::string> vary;
+    };
+
+    /**
+     * Rendered responses of GET requests keyed by path, query and the vary headers
+     *
+     * Entries are kept in shards each with its own mutex and LRU list. Only 200, 203, 300, 301,
+     * 404 and 410 responses are stored, and not if the handler went raw, returned false, set a
+     * cookie, or sent "Cache-Control: no-store" or "private". Responses varying on headers not in
+     * the key, and answers to requests with Authorization not marked "public" or "s-maxage", are
+     * not stored either.
+     */
+    class response_cache {
+    public:
+        /**
+         * State of a request between lookup() and store()
+         */
+        class ticket_t {
+        public:
+            ticket_t() = default;
+
+            // Non-copyable
+            ticket_t(const ticket_t&) = delete;
+            ticket_t& operator=(const ticket_t&) = delete;
+
+            /**
+             * Gives up a refresh if the handler didn't finish
+             */
+            ~ticket_t();
+
+            /**
+             * Return value of the handler when the response came from the cache
+             */
+            bool result() const
+            { return result_; }
+
+        private:
+            response_cache *cache_=nullptr;
+            string_ref_t key_;
+            std::size_t shard_=0;
+            bool refreshing_=false;
+            bool result_=true;
+
+            friend class response_cache;
+        };
+
+        response_cache(const response_cache_options_t &options=response_cache_options_t());
+
+        // Non-copyable
+        response_cache(const response_cache&) = delete;
+        response_cache& operator=(const response_cache&) = delete;
+
+        const response_cache_options_t &options() const
+        { return options_; }
+
+        /**
+         * Serve the request from the cache, returns false if the handler needs to be called
+         *
+         * A fresh entry is served, an expired one within the stale window is served to everyone
+         * except the first request noticing it, which refreshes the entry
+         */
+        bool lookup(session_t &session, ticket_t &ticket);
+
+        /**
+         * Store the response made by the handler
+         */
+        void store(session_t &session, ticket_t &ticket, bool result);
+
+        /**
+         * Drop all entries
+         */
+        void clear();
+
+        std::size_t size() const;
+
+        /**
+         * Bytes used by all entries
+         */
+        std::size_t bytes() const;
+
+        std::size_t hits() const
+        { return hits_.load(std::memory_order_relaxed); }
+
+        /**
+         * Expired entries served while being refreshed
+         */
+        std::size_t stale_hits() const
+        { return stale_hits_.load(std::memory_order_relaxed); }
+
+        std::size_t misses() const
+        { return misses_.load(std::memory_order_relaxed); }
+
+    private:
+        struct entry_t {
+            std::string key;
+            prepared_response_ptr response;
+            bool result;
+            std::int64_t expires;
+            std::int64_t stale_until;
+            bool refreshing;
+            std::size_t bytes;
+        };
+        typedef std::list<entry_t> lru_t;
+
+        struct key_hash {
+            std::size_t operator()(const string_ref_t &s) const;
+        };
+        // Keys refer to entry_t::key
+        typedef std::unordered_map<string_ref_t, lru_t::iterator, key_hash> index_t;
+
+        struct shard_t {
+            std::mutex mutex;
+            // Most recently used first
+            lru_t lru;
+            index_t index;
+            std::size_t bytes=0;
+        };
+
+        string_ref_t make_key(session_t &session) const;
+        void abandon(ticket_t &ticket);
+        void erase(shard_t &shard, lru_t::iterator i);
+
+        response_cache_options_t options_;
+        std::vector<std::unique_ptr<shard_t>> shards_;
+        std::size_t shard_budget_;
+        std::atomic<std::size_t> hits_;
+        std::atomic<std::size_t> stale_hits_;
+        std::atomic<std::size_t> misses_;
+    };
+
+    /**
+     * Request handler wrapped with a response cache, can be used with router<> and router<Arg>
+     */
+    template<typename Handler>
+    class cached_handler {
+    public:
+        cached_handler(const Handler &handler, const std::shared_ptr<response_cache> &cache)
+        : handler_(handler)
+        , cache_(cache)
+        {}
+
+        template<typename... Arg>
+        bool operator()(session_t &session, Arg &... arg) {
+            response_cache::ticket_t ticket;
+            if (cache_->lookup(session, ticket))
+                return ticket.result();
+            bool ret=handler_(session, arg...);
+            cache_->store(session, ticket, ret);
+            return ret;
+        }
+
+        const std::shared_ptr<response_cache> &cache() const
+        { return cache_; }
+
+    private:
+        Handler handler_;
+        std::shared_ptr<response_cache> cache_;
+    };
+
+    /**
+     * Wrap a handler with a new response cache, i.e. {url_equals("/lines.html"), cached(&handle_lines)}
+     *
+     * The response must only depend on the path, the query, and the request headers in options.vary
+     */
+    template<typename Handler>
+    cached_handler<typename std::decay<Handler>::type> cached(Handler &&handler,
+                                                            const response_cache_options_t &options=response_cache_options_t())
+    {
+        return cached_handler<typename std::decay<Handler>::type>(std::forward<Handler>(handler),
+                                                                  std::make_shared<response_cache>(options));
+    }
+}   // End of namespace http
+
+#endif /* defined(__coroserver__response_cache__) */
@@ -8,53 +8,416 @@
 
 #include <memory>
 #include <map>
+#include <algorithm>
 #include <boost/algorithm/string/predicate.hpp>
 #include "http_protocol.h"
 #include "routing.h"
 
 namespace http {
-    routing_pred_t any() {
-        return [](session_t &session)->bool{
+    namespace details {
+        typedef std::vector<std::string> segments_t;
+        constexpr size_t max_segments=32;
+        
+        inline char lower(char c)
+        { return (c>='A' && c<='Z') ? c-'A'+'a' : c; }
+        
+        inline std::string lower(const std::string &s) {
+            std::string ret(s);
+            std::transform(ret.begin(), ret.end(), ret.begin(), [](char c){ return lower(c); });
+            return ret;
+        }
+        
+        inline bool segment_equals(const string_ref_t &s, const std::string &p, bool case_sensitive) {
+            if (case_sensitive)
+                return s==string_ref_t(p);
+            return boost::algorithm::iequals(s, p);
+        }
+        
+        inline bool is_param(const std::string &segment)
+        { return segment.size()>1 && segment[0]==':'; }
+        
+        /**
+         * Split path into segments between '/', returns number of segments, or max_segments+1 if too many
+         */
+        size_t split(const string_ref_t &path, string_ref_t *segs) {
+            size_t n=0;
+            const char *b=path.data();
+            const char *e=path.data()+path.size();
+            for (;;) {
+                const char *p=std::find(b, e, '/');
+                if (n>=max_segments) return max_segments+1;
+                segs[n++]=string_ref_t(b, p-b);
+                if (p==e) break;
+                b=p+1;
+            }
+            return n;
+        }
+        
+        segments_t split(const std::string &pattern) {
+            string_ref_t segs[max_segments];
+            size_t n=split(string_ref_t(pattern), segs);
+            segments_t ret;
+            for (size_t i=0; i<std::min(n, max_segments); i++)
+                ret.push_back(segs[i].to_string());
+            return ret;
+        }
+        
+        /**
+         * Match segments of path with a pattern, captures parameters into params if it's not null
+         */
+        bool match_segments(const segments_t &pattern,
+                            bool case_sensitive,
+                            const string_ref_t &path,
+                            params_t *params)
+        {
+            string_ref_t segs[max_segments];
+            size_t n=split(path, segs);
+            if (n!=pattern.size()) return false;
+            for (size_t i=0; i<n; i++) {
+                if (is_param(pattern[i])) {
+                    if (segs[i].empty()) return false;
+                } else if (!segment_equals(segs[i], pattern[i], case_sensitive)) {
+                    return false;
+                }
+            }
+            if (params) {
+                for (size_t i=0; i<n; i++) {
+                    if (is_param(pattern[i]))
+                        params->push_back(param_t(string_ref_t(pattern[i]).substr(1), segs[i]));
+                }
+            }
             return true;
+        }
+        
+        /**
+         * Radix tree of lower-cased keys, values are route indices in ascending order
+         */
+        class radix_tree {
+        public:
+            void insert(const std::string &key, size_t value) {
+                node *n=&root_;
+                size_t pos=0;
+                while (pos<key.size()) {
+                    node_ptr *child=nullptr;
+                    for (node_ptr &c : n->children) {
+                        if (c->label[0]==key[pos]) {
+                            child=&c;
+                            break;
+                        }
+                    }
+                    if (!child) {
+                        n->children.emplace_back(new node);
+                        n->children.back()->label=key.substr(pos);
+                        n=n->children.back().get();
+                        pos=key.size();
+                        break;
+                    }
+                    node *c=child->get();
+                    size_t common=0;
+                    while (common<c->label.size() && pos+common<key.size() && c->label[common]==key[pos+common])
+                        common++;
+                    if (common<c->label.size()) {
+                        // Split the edge so the key ends at a node
+                        node_ptr mid(new node);
+                        mid->label=c->label.substr(0, common);
+                        c->label.erase(0, common);
+                        mid->children.push_back(std::move(*child));
+                        *child=std::move(mid);
+                        c=child->get();
+                    }
+                    n=c;
+                    pos+=common;
+                }
+                n->values.push_back(value);
+            }
+            
+            /**
+             * Call f with values of every key that is a prefix of [begin, end), shorter keys first,
+             * stops when f returns false
+             */
+            template<typename Iterator, typename Function>
+            void prefixes(Iterator begin, Iterator end, Function f) const {
+                const node *n=&root_;
+                if (!f(n->values, begin)) return;
+                Iterator i=begin;
+                while (i!=end) {
+                    n=n->find(lower(*i));
+                    if (!n) return;
+                    for (char c : n->label) {
+                        if (i==end || lower(*i)!=c) return;
+                        ++i;
+                    }
+                    if (!f(n->values, i)) return;
+                }
+            }
+            
+        private:
+            struct node;
+            typedef std::unique_ptr<node> node_ptr;
+            struct node {
+                const node *find(char c) const {
+                    for (const node_ptr &n : children)
+                        if (n->label[0]==c) return n.get();
+                    return nullptr;
+                }
+                std::string label;
+                std::vector<size_t> values;
+                std::vector<node_ptr> children;
+            };
+            node root_;
+        };
+        
+        /**
+         * Tree of lower-cased path segments, ":name" segments go to the param branch
+         */
+        class segment_tree {
+        public:
+            void insert(const segments_t &pattern, size_t value) {
+                node *n=&root_;
+                for (const std::string &seg : pattern) {
+                    if (is_param(seg)) {
+                        if (!n->param) n->param.reset(new node);
+                        n=n->param.get();
+                    } else {
+                        std::string key=lower(seg);
+                        node_ptr &c=n->statics[key];
+                        if (!c) c.reset(new node);
+                        n=c.get();
+                    }
+                }
+                n->values.push_back(value);
+            }
+            
+            /**
+             * Returns the smallest value below limit whose pattern is accepted by pred
+             */
+            template<typename Pred>
+            size_t find(const string_ref_t *segs, size_t n, size_t limit, Pred pred) const
+            { return find(&root_, segs, n, limit, pred); }
+            
+        private:
+            struct node;
+            typedef std::unique_ptr<node> node_ptr;
+            struct node {
+                std::map<std::string, node_ptr> statics;
+                node_ptr param;
+                std::vector<size_t> values;
+            };
+            
+            template<typename Pred>
+            size_t find(const node *nd, const string_ref_t *segs, size_t n, size_t limit, Pred pred) const {
+                if (n==0) {
+                    for (size_t v : nd->values) {
+                        if (v>=limit) break;
+                        if (pred(v)) return v;
+                    }
+                    return no_route;
+                }
+                size_t best=no_route;
+                if (!nd->statics.empty()) {
+                    // Lower-case the segment on stack, segments are usually short
+                    char buf[256];
+                    if (segs->size()<=sizeof(buf)) {
+                        std::transform(segs->begin(), segs->end(), buf, [](char c){ return lower(c); });
+                        auto i=nd->statics.find(std::string(buf, segs->size()));
+                        if (i!=nd->statics.end())
+                            best=find(i->second.get(), segs+1, n-1, limit, pred);
+                    }
+                }
+                if (nd->param && !segs->empty()) {
+                    size_t v=find(nd->param.get(), segs+1, n-1, std::min(best, limit), pred);
+                    if (v<best) best=v;
+                }
+                return best;
+            }
+            
+            node root_;
         };
+        
+        class route_index {
+        public:
+            route_index(const std::vector<routing_pred_t> &preds)
+            : preds_(preds)
+            , patterns_(preds.size())
+            {
+                for (size_t i=0; i<preds_.size(); i++) {
+                    const routing_pred_t &p=preds_[i];
+                    metrics_.push_back(route_metrics(label(p, i)));
+                    switch (p.kind()) {
+                        case routing_pred_t::equals:
+                            equals_.insert(lower(p.pattern()), i);
+                            break;
+                        case routing_pred_t::starts_with:
+                            prefixes_.insert(lower(p.pattern()), i);
+                            break;
+                        case routing_pred_t::ends_with: {
+                            std::string key=lower(p.pattern());
+                            std::reverse(key.begin(), key.end());
+                            suffixes_.insert(key, i);
+                            break;
+                        }
+                        case routing_pred_t::segments:
+                            patterns_[i]=split(p.pattern());
+                            segments_.insert(patterns_[i], i);
+                            break;
+                        default:
+                            custom_.push_back(i);
+                            break;
+                    }
+                }
+            }
+            
+            size_t match(session_t &session) const {
+                request_t &req=session.request();
+                req.params().clear();
+                const string_ref_t path=req.path();
+                size_t best=no_route;
+                
+                // Exact matches
+                equals_.prefixes(path.begin(), path.end(), [&](const std::vector<size_t> &values, string_ref_t::const_iterator i)->bool {
+                    if (i!=path.end()) return true;
+                    best=std::min(best, first_valid(values, best, [&](size_t v){
+                        return !preds_[v].case_sensitive() || path==string_ref_t(preds_[v].pattern());
+                    }));
+                    return false;
+                });
+                
+                // Prefix matches, shorter prefixes first
+                prefixes_.prefixes(path.begin(), path.end(), [&](const std::vector<size_t> &values, string_ref_t::const_iterator)->bool {
+                    best=std::min(best, first_valid(values, best, [&](size_t v){
+                        return !preds_[v].case_sensitive() || boost::algorithm::starts_with(path, preds_[v].pattern());
+                    }));
+                    return true;
+                });
+                
+                // Suffix matches on the reversed path
+                suffixes_.prefixes(path.rbegin(), path.rend(), [&](const std::vector<size_t> &values, string_ref_t::const_reverse_iterator)->bool {
+                    best=std::min(best, first_valid(values, best, [&](size_t v){
+                        return !preds_[v].case_sensitive() || boost::algorithm::ends_with(path, preds_[v].pattern());
+                    }));
+                    return true;
+                });
+                
+                // Patterns with parameters
+                string_ref_t segs[max_segments];
+                size_t n=split(path, segs);
+                if (n<=max_segments) {
+                    size_t v=segments_.find(segs, n, best, [&](size_t v){
+                        return !preds_[v].case_sensitive() || match_segments(patterns_[v], true, path, nullptr);
+                    });
+                    if (v<best) best=v;
+                }
+                
+                // Everything else in table order, only those before the best compiled match matter
+                for (size_t i : custom_) {
+                    if (i>=best) break;
+                    if (preds_[i](session)) {
+                        session.route_metrics(metrics_[i]);
+                        return i;
+                    }
+                    req.params().clear();
+                }
+                if (best!=no_route && preds_[best].kind()==routing_pred_t::segments)
+                    match_segments(patterns_[best], false, path, &req.params());
+                if (best!=no_route)
+                    session.route_metrics(metrics_[best]);
+                return best;
+            }
+            
+        private:
+            /**
+             * Route label in metrics, the pattern for compiled predicates and the position otherwise
+             */
+            static std::string label(const routing_pred_t &p, size_t i) {
+                switch (p.kind()) {
+                    case routing_pred_t::equals:
+                    case routing_pred_t::segments:
+                        return p.pattern();
+                    case routing_pred_t::starts_with:
+                        return p.pattern()+"*";
+                    case routing_pred_t::ends_with:
+                        return "*"+p.pattern();
+                    default:
+                        return "#"+std::to_string(i);
+                }
+            }
+            
+            template<typename Pred>
+            static size_t first_valid(const std::vector<size_t> &values, size_t limit, Pred pred) {
+                for (size_t v : values) {
+                    if (v>=limit) break;
+                    if (pred(v)) return v;
+                }
+                return no_route;
+            }
+            
+            std::vector<routing_pred_t> preds_;
+            std::vector<segments_t> patterns_;
+            radix_tree equals_;
+            radix_tree prefixes_;
+            radix_tree suffixes_;
+            segment_tree segments_;
+            std::vector<size_t> custom_;
+            std::vector<const route_metrics_t *> metrics_;
+        };
+        
+        route_index_ptr compile_routes(const std::vector<routing_pred_t> &preds)
+        { return std::make_shared<route_index>(preds); }
+        
+        size_t match_route(const route_index &index, session_t &session)
+        { return index.match(session); }
+    }   // End of namespace details
+    
+    routing_pred_t any() {
+        // An empty prefix matches everything
+        return routing_pred_t(routing_pred_t::starts_with, "", true, [](session_t &session)->bool{
+            return true;
+        });
     }
     
     routing_pred_t url_equals(const std::string &s, bool case_sensitive) {
         if (case_sensitive) {
-            return [s](session_t &session)->bool{
-                return session.request().path()==s;
-            };
+            return routing_pred_t(routing_pred_t::equals, s, case_sensitive, [s](session_t &session)->bool{
+                return session.request().path()==string_ref_t(s);
+            });
         } else {
-            return [s](session_t &session)->bool{
+            return routing_pred_t(routing_pred_t::equals, s, case_sensitive, [s](session_t &session)->bool{
                 return boost::algorithm::iequals(session.request().path(), s);
-            };
+            });
         }
     }
 
     routing_pred_t url_starts_with(const std::string &s, bool case_sensitive) {
         if (case_sensitive) {
-            return [s](session_t &session)->bool{
+            return routing_pred_t(routing_pred_t::starts_with, s, case_sensitive, [s](session_t &session)->bool{
                 return boost::algorithm::starts_with(session.request().path(), s);
-            };
+            });
         } else {
-            return [s](session_t &session)->bool{
+            return routing_pred_t(routing_pred_t::starts_with, s, case_sensitive, [s](session_t &session)->bool{
                 return boost::algorithm::istarts_with(session.request().path(), s);
-            };
+            });
         }
     }
     
     routing_pred_t url_ends_with(const std::string &s, bool case_sensitive) {
         if (case_sensitive) {
-            return [s](session_t &session)->bool{
+            return routing_pred_t(routing_pred_t::ends_with, s, case_sensitive, [s](session_t &session)->bool{
                 return boost::algorithm::ends_with(session.request().path(), s);
-            };
+            });
         } else {
-            return [s](session_t &session)->bool{
+            return routing_pred_t(routing_pred_t::ends_with, s, case_sensitive, [s](session_t &session)->bool{
                 return boost::algorithm::iends_with(session.request().path(), s);
-            };
+            });
         }
     }
     
+    routing_pred_t url_matches(const std::string &s, bool case_sensitive) {
+        std::shared_ptr<details::segments_t> pattern=std::make_shared<details::segments_t>(details::split(s));
+        return routing_pred_t(routing_pred_t::segments, s, case_sensitive, [pattern, case_sensitive](session_t &session)->bool{
+            return details::match_segments(*pattern, case_sensitive, session.request().path(), &session.request().params());
+        });
+    }
+    
     routing_pred_t operator &&(routing_pred_t c1, routing_pred_t c2) {
         return [c1, c2](session_t &session)->bool {
             return c1(session) && c2(session);
@@ -13,20 +13,103 @@
 #include <functional>
 #include <string>
 #include <list>
+#include <vector>
 #include <memory>
+#include <type_traits>
 
 namespace http {
     struct session_t;
-    typedef std::function<bool(session_t &)> routing_pred_t;
+    
+    /**
+     * Routing predicate
+     *
+     * Predicates created by url_equals, url_starts_with, url_ends_with, url_matches and any are
+     * compiled into lookup trees by router, others are called one by one in table order
+     */
+    struct routing_pred_t {
+        enum kind_t {
+            custom,
+            equals,
+            starts_with,
+            ends_with,
+            segments,
+        };
+        
+        routing_pred_t()
+        : kind_(custom)
+        , case_sensitive_(false)
+        {}
+        
+        /**
+         * Custom predicate from any callable object with signature bool(session_t &)
+         */
+        template<typename Function,
+                 typename=typename std::enable_if<!std::is_same<typename std::decay<Function>::type, routing_pred_t>::value
+                                                  && std::is_convertible<Function, std::function<bool(session_t &)>>::value>::type>
+        routing_pred_t(Function &&fn)
+        : fn_(std::forward<Function>(fn))
+        , kind_(custom)
+        , case_sensitive_(false)
+        {}
+        
+        routing_pred_t(kind_t kind,
+                       const std::string &pattern,
+                       bool case_sensitive,
+                       const std::function<bool(session_t &)> &fn)
+        : fn_(fn)
+        , kind_(kind)
+        , pattern_(pattern)
+        , case_sensitive_(case_sensitive)
+        {}
+        
+        bool operator()(session_t &session) const
+        { return fn_(session); }
+        
+        kind_t kind() const
+        { return kind_; }
+        
+        const std::string &pattern() const
+        { return pattern_; }
+        
+        bool case_sensitive() const
+        { return case_sensitive_; }
+        
+    private:
+        std::function<bool(session_t &)> fn_;
+        kind_t kind_;
+        std::string pattern_;
+        bool case_sensitive_;
+    };
     
     routing_pred_t any();
     routing_pred_t url_equals(const std::string &s, bool case_sensitive=false);
     routing_pred_t url_starts_with(const std::string &s, bool case_sensitive=false);
     routing_pred_t url_ends_with(const std::string &s, bool case_sensitive=false);
+    /**
+     * Match path segment by segment, segments like ":name" match any non-empty segment and are
+     * captured into request().params(), i.e. "/user/:id"
+     */
+    routing_pred_t url_matches(const std::string &s, bool case_sensitive=false);
     routing_pred_t operator &&(routing_pred_t c1, routing_pred_t c2);
     routing_pred_t operator ||(routing_pred_t c1, routing_pred_t c2);
     routing_pred_t operator !(routing_pred_t c);
     
+    namespace details {
+        class route_index;
+        typedef std::shared_ptr<const route_index> route_index_ptr;
+        constexpr std::size_t no_route=std::size_t(-1);
+        
+        /**
+         * Compile predicates into lookup trees
+         */
+        route_index_ptr compile_routes(const std::vector<routing_pred_t> &preds);
+        
+        /**
+         * Returns the index of the first predicate matches the session, or no_route
+         */
+        std::size_t match_route(const route_index &index, session_t &session);
+    }   // End of namespace details
+    
     template<typename... Arg>
     struct router;
     
@@ -35,25 +118,35 @@ namespace http {
         typedef std::function<bool(session_t &, Arg &)> handler_t;
         typedef std::pair<routing_pred_t, handler_t> routing_entry_t;
         typedef std::list<routing_entry_t> routing_table_t;
-        typedef std::shared_ptr<routing_table_t> routing_table_ptr;
+        typedef std::vector<handler_t> handler_list_t;
+        typedef std::shared_ptr<handler_list_t> handler_list_ptr;
 
         router(const routing_table_t &table)
-        : table_(new routing_table_t(table))
-        {}
+        { compile(table); }
         
         router(routing_table_t &&table)
-        : table_(new routing_table_t(std::move(table)))
-        {}
+        { compile(table); }
         
         bool operator()(session_t &session, Arg &arg) {
-            for (routing_entry_t &ent : *table_) {
-                if(ent.first(session))
-                    return ent.second(session, arg);
-            }
-            return false;
+            std::size_t i=details::match_route(*index_, session);
+            if (i==details::no_route)
+                return false;
+            return (*handlers_)[i](session, arg);
         }
         
-        routing_table_ptr table_;
+        details::route_index_ptr index_;
+        handler_list_ptr handlers_;
+        
+    private:
+        void compile(const routing_table_t &table) {
+            std::vector<routing_pred_t> preds;
+            handlers_=std::make_shared<handler_list_t>();
+            for (const routing_entry_t &ent : table) {
+                preds.push_back(ent.first);
+                handlers_->push_back(ent.second);
+            }
+            index_=details::compile_routes(preds);
+        }
     };
 
     template<>
@@ -61,25 +154,35 @@ namespace http {
         typedef std::function<bool(session_t &)> handler_t;
         typedef std::pair<routing_pred_t, handler_t> routing_entry_t;
         typedef std::list<routing_entry_t> routing_table_t;
-        typedef std::shared_ptr<routing_table_t> routing_table_ptr;
+        typedef std::vector<handler_t> handler_list_t;
+        typedef std::shared_ptr<handler_list_t> handler_list_ptr;
         
         router(const routing_table_t &table)
-        : table_(new routing_table_t(table))
-        {}
+        { compile(table); }
         
         router(routing_table_t &&table)
-        : table_(new routing_table_t(std::move(table)))
-        {}
+        { compile(table); }
         
         bool operator()(session_t &session) {
-            for (routing_entry_t &ent : *table_) {
-                if(ent.first(session))
-                    return ent.second(session);
-            }
-            return false;
+            std::size_t i=details::match_route(*index_, session);
+            if (i==details::no_route)
+                return false;
+            return (*handlers_)[i](session);
         }
         
-        routing_table_ptr table_;
+        details::route_index_ptr index_;
+        handler_list_ptr handlers_;
+        
+    private:
+        void compile(const routing_table_t &table) {
+            std::vector<routing_pred_t> preds;
+            handlers_=std::make_shared<handler_list_t>();
+            for (const routing_entry_t &ent : table) {
+                preds.push_back(ent.first);
+                handlers_->push_back(ent.second);
+            }
+            index_=details::compile_routes(preds);
+        }
     };
 }   // End of namespace http
 
@@ -6,8 +6,15 @@
 //  Copyright (c) 2013 0d0a.com. All rights reserved.
 //
 
+#include <algorithm>
 #include <thread>
+#include <unistd.h>
 #include <boost/asio/spawn.hpp>
+#include <boost/asio/steady_timer.hpp>
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
 #include "server.h"
 
 namespace net {
@@ -15,17 +22,40 @@ namespace net {
     using namespace boost::asio;
     using namespace boost::asio::ip;
     
+#if defined(SO_REUSEPORT)
+    typedef boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT> reuse_port;
+#endif
+    
+    namespace {
+        void pin_this_thread(std::size_t n) {
+#if defined(__linux__)
+            unsigned ncpu=std::thread::hardware_concurrency();
+            if (ncpu==0) return;
+            cpu_set_t cpuset;
+            CPU_ZERO(&cpuset);
+            CPU_SET(n % ncpu, &cpuset);
+            pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+#endif
+        }
+    }   // End of anonymous namespace
+    
     server::server(const sap_desc_list_t &sap_desc_list,
                    const initialization_handler_t &initialization_handler,
                    const finalization_handler_t &finalization_handler,
-                   std::size_t thread_pool_size)
+                   std::size_t thread_pool_size,
+                   const server_options_t &options)
     : thread_pool_size_(thread_pool_size)
+    , options_(options)
     , io_service_()
     , initialization_handler_(initialization_handler)
     , finalization_handler_(finalization_handler)
     , init_state_(initialization_handler_(io_service_))
     , signals_(io_service_)
     {
+#if !defined(SO_REUSEPORT)
+        // Cannot bind one endpoint with multiple acceptors on this platform
+        options_.model=threading_model::shared_io_service;
+#endif
         if (init_state_) {
             // Register to handle the signals that indicate when the server should exit.
             // It is safe to register for the same signal multiple times in a program,
@@ -37,40 +67,123 @@ namespace net {
 #endif // defined(SIGQUIT)
             signals_.async_wait([this](system::error_code, int){ close(); });
             
-            // Start listening on endpoints
-            for (const sap_desc_t &sd : sap_desc_list)
-                listen(sd);
-            
-            // Accept incomint connections
-            open();
+            if (options_.model!=threading_model::shared_io_service) {
+                // Every worker listens on all endpoints, the kernel distributes incoming connections
+                for (std::size_t i=0; i<thread_pool_size_; ++i) {
+                    workers_.emplace_back(new worker_t(i));
+                    // Only the worker's thread runs its io_service, its timers need no locking
+                    use_service<timer_wheel_service>(workers_.back()->io_service_).wheel().single_threaded();
+                    for (const sap_desc_t &sd : sap_desc_list)
+                        listen(workers_.back()->io_service_, workers_.back()->saps_, sd, true);
+                }
+                // Accept incoming connections
+                bool stealing=options_.model==threading_model::work_stealing;
+                if (stealing)
+                    stolen_=metrics::make_counter("net_connections_stolen_total", "Connections started by another worker than the accepting one");
+                for (worker_ptr &w : workers_) {
+                    open(w->io_service_, w->saps_, stealing ? w.get() : nullptr);
+                    if (stealing) {
+                        worker_t *worker=w.get();
+                        w->io_service_.post([this, worker](){ schedule(*worker); });
+                    }
+                }
+            } else {
+                // Start listening on endpoints
+                for (const sap_desc_t &sd : sap_desc_list)
+                    listen(io_service_, saps_, sd, false);
+                
+                // Accept incomint connections
+                open(io_service_, saps_);
+            }
         }
     }
     
     
     server::server(const sap_desc_list_t &sap_desc_list,
-                   std::size_t thread_pool_size)
+                   std::size_t thread_pool_size,
+                   const server_options_t &options)
     : server(sap_desc_list,
              [](boost::asio::io_service &)->bool { return true; },
              [](boost::asio::io_service &){},
-             thread_pool_size)
+             thread_pool_size,
+             options)
     {}
     
-    server::~server()
-    { if(init_state_) finalization_handler_(io_service_); }
+    server::~server() {
+        // Connections queued but never started
+        for (worker_ptr &w : workers_) {
+            while (pending_t *p=w->ready_.steal()) {
+                ::close(p->fd);
+                release(*w->saps_[p->sap]);
+                delete p;
+            }
+        }
+        if(init_state_) finalization_handler_(io_service_);
+    }
+    
+    server::endpoint_state_t::endpoint_state_t(const stack_pool_ptr &s, std::size_t m)
+    : stacks(s)
+    , max_connections(m)
+    , connections(0)
+    {}
     
-    void server::listen(const sap_desc_t &sd) {
+    server::sap_t::sap_t(tcp::acceptor &&a,
+                         const protocol_handler_t &h,
+                         const endpoint_t &endpoint,
+                         const endpoint_state_ptr &s,
+                         admission_service *adm,
+                         const tcp &p)
+    : acceptor(std::move(a))
+    , protocol(p)
+    , handler(h)
+    , state(s)
+    , admission(adm)
+    , accepted(metrics::make_counter("net_connections_accepted_total", "Connections accepted", {{"sap", endpoint}}))
+    , accept_errors(metrics::make_counter("net_accept_errors_total", "Failed accepts", {{"sap", endpoint}}))
+    , failed(metrics::make_counter("net_connections_failed_total", "Connections ended by an exception from the protocol handler", {{"sap", endpoint}}))
+    , active(metrics::make_gauge("net_connections_active", "Connections being handled", {{"sap", endpoint}}))
+    , paused(metrics::make_counter("net_accept_pauses_total", "Times accepting has paused for overload or a connection limit", {{"sap", endpoint}}))
+    {}
+    
+    server::endpoint_state_ptr server::endpoint_state(const endpoint_t &endpoint) {
+        endpoint_state_ptr &state=endpoints_[endpoint];
+        if (!state) {
+            std::map<endpoint_t, stack_options_t>::const_iterator i=options_.sap_stacks.find(endpoint);
+            stack_pool_ptr stacks=std::make_shared<net::stack_pool>(i==options_.sap_stacks.end() ? options_.stack : i->second, endpoint);
+            std::map<endpoint_t, std::size_t>::const_iterator j=options_.sap_max_connections.find(endpoint);
+            state=std::make_shared<endpoint_state_t>(stacks, j==options_.sap_max_connections.end() ? options_.max_connections_per_sap : j->second);
+        }
+        return state;
+    }
+    
+    bool server::admit(const sap_t &sap) const {
+        if (sap.admission && sap.admission->overloaded()) return false;
+        if (options_.max_connections>0 && connections_.load(std::memory_order_relaxed)>=options_.max_connections) return false;
+        return sap.state->max_connections==0 || sap.state->connections.load(std::memory_order_relaxed)<sap.state->max_connections;
+    }
+    
+    void server::listen(io_service &ios, sap_list_t &saps, const sap_desc_t &sd, bool reuse_port) {
         const endpoint_t &ep=sd.first;
         // Open the acceptor with the option to reuse the address (i.e. SO_REUSEADDR).
         endpoint_resolver<tcp> resolver;
-        tcp::endpoint endpoint = resolver.resolve(ep, "", io_service_);
+        tcp::endpoint endpoint = resolver.resolve(ep, "", ios);
         
-        sap_ptr sap(new sap_t(tcp::acceptor(io_service_), sd.second));
-        saps_.push_back(sap);
-        sap_list_t::reverse_iterator i=saps_.rbegin();
-        (*i)->first.open(endpoint.protocol());
-        (*i)->first.set_option(tcp::acceptor::reuse_address(true));
-        (*i)->first.bind(endpoint);
-        (*i)->first.listen();
+        admission_service *admission=nullptr;
+        if (options_.admission.target.count()>0) {
+            admission=&use_service<admission_service>(ios);
+            admission->start(options_.admission);
+        }
+        sap_ptr sap(new sap_t(tcp::acceptor(ios), sd.second, ep, endpoint_state(ep), admission, endpoint.protocol()));
+        saps.push_back(sap);
+        sap_list_t::reverse_iterator i=saps.rbegin();
+        (*i)->acceptor.open(endpoint.protocol());
+        (*i)->acceptor.set_option(tcp::acceptor::reuse_address(true));
+#if defined(SO_REUSEPORT)
+        if (reuse_port)
+            (*i)->acceptor.set_option(net::reuse_port(true));
+#endif
+        (*i)->acceptor.bind(endpoint);
+        (*i)->acceptor.listen();
     }
     
     void server::run() {
@@ -78,11 +191,25 @@ namespace net {
             // TODO: Log error
             return;
         }
-        // Create a pool of threads to run all of the io_services.
         std::vector<std::thread> threads;
-        for (std::size_t i=0; i<thread_pool_size_; ++i) {
-            threads.emplace(threads.end(),
-                            std::thread([this](){io_service_.run();}));
+        if (options_.model!=threading_model::shared_io_service) {
+            // One thread per worker, each runs its own io_service
+            for (std::size_t i=0; i<workers_.size(); ++i) {
+                threads.emplace(threads.end(),
+                                std::thread([this, i](){
+                                    if (options_.cpu_affinity)
+                                        pin_this_thread(i);
+                                    workers_[i]->io_service_.run();
+                                }));
+            }
+            // The main io_service only handles signals, returns after close()
+            io_service_.run();
+        } else {
+            // Create a pool of threads to run all of the io_services.
+            for (std::size_t i=0; i<thread_pool_size_; ++i) {
+                threads.emplace(threads.end(),
+                                std::thread([this](){io_service_.run();}));
+            }
         }
         
         // Wait for all threads in the pool to exit.
@@ -90,36 +217,156 @@ namespace net {
             threads[i].join();
     }
     
-    void server::open() {
-        for (sap_ptr &sap : saps_) {
-            spawn(io_service_,
-                  [&](yield_context yield) {
+    void server::open(io_service &ios, sap_list_t &saps, worker_t *worker) {
+        for (std::size_t i=0; i<saps.size(); i++) {
+            sap_ptr &sap=saps[i];
+            spawn(ios,
+                  [this, &ios, &sap, worker, i](yield_context yield) {
+                      steady_timer pause(ios);
                       for (;;) {
                           system::error_code ec;
-                          tcp::socket socket(io_service_);
-                          sap->first.async_accept(socket, yield[ec]);
-                          if (!ec)
-                              handle_connect(std::move(socket), sap->second);
+                          if (!admit(*sap)) {
+                              // New connections wait in the listen backlog meanwhile
+                              sap->paused.inc();
+                              do {
+                                  pause.expires_from_now(options_.admission.probe_interval);
+                                  pause.async_wait(yield[ec]);
+                              } while (!admit(*sap));
+                          }
+                          tcp::socket socket(ios);
+                          sap->acceptor.async_accept(socket, yield[ec]);
+                          if (!ec) {
+                              sap->accepted.inc();
+                              // Counted from now on, queued connections count against the limits
+                              acquire(*sap);
+                              if (worker)
+                                  enqueue(*worker, std::move(socket), i);
+                              else
+                                  handle_connect(ios, std::move(socket), *sap);
+                          } else {
+                              sap->accept_errors.inc();
+                          }
                       }
                   });
         }
     }
     
-    void server::close()
-    { io_service_.stop(); }
-    
-    void server::handle_connect(tcp::socket &&socket, const protocol_handler_t &handler) {
-        spawn(strand(io_service_),
-              // Create a new protocol handler for each connection
-              [this, &socket, handler](yield_context yield) {
-                  async_tcp_stream s(std::move(socket), yield);
-                  try {
-                      handler(s);
-                  } catch (std::exception const& e) {
-                      // TODO: Log error
-                  } catch(...) {
-                      // TODO: Log error
-                  }
-              });
+    void server::close() {
+        io_service_.stop();
+        for (worker_ptr &w : workers_)
+            w->io_service_.stop();
+    }
+    
+    void server::handle_connect(io_service &ios, tcp::socket &&socket, sap_t &sap) {
+        // NOTE: yield_context always dispatches through a strand, with io_service_per_thread the strand
+        // is only ever touched by the owning thread so it never contends
+        net::spawn(strand(ios),
+                   // Create a new protocol handler for each connection
+                   [this, &socket, &sap](yield_context yield) {
+                       async_tcp_stream s(std::move(socket), yield);
+                       // Coroutines spawned by the handler take their stacks from the same pool
+                       s.stack_pool(sap.state->stacks);
+                       s.admission(sap.admission);
+                       sap.active.inc();
+                       try {
+                           sap.handler(s);
+                       } catch (std::exception const& e) {
+                           // TODO: Log error
+                           sap.failed.inc();
+                       } catch(...) {
+                           // TODO: Log error
+                           sap.failed.inc();
+                       }
+                       sap.active.dec();
+                       release(sap);
+                   },
+                   sap.state->stacks);
+    }
+    
+    void server::acquire(sap_t &sap) {
+        connections_.fetch_add(1, std::memory_order_relaxed);
+        sap.state->connections.fetch_add(1, std::memory_order_relaxed);
+    }
+    
+    void server::release(sap_t &sap) {
+        sap.state->connections.fetch_sub(1, std::memory_order_relaxed);
+        connections_.fetch_sub(1, std::memory_order_relaxed);
+    }
+    
+    void server::enqueue(worker_t &worker, tcp::socket &&socket, std::size_t sap) {
+        // Only the descriptor is queued, the socket belongs to the io_service of this worker
+        int fd=::dup(socket.native_handle());
+        if (fd>=0) {
+            std::unique_ptr<pending_t> p(new pending_t{fd, sap, worker.index_});
+            if (worker.ready_.push(p.get())) {
+                p.release();
+                system::error_code ec;
+                socket.close(ec);
+                // Pairs with the fence in schedule(), either the parked worker sees the connection
+                // or we see it parked
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                // Wake an idle worker up, this one first as it's already running
+                for (std::size_t i=0; i<workers_.size(); i++) {
+                    worker_t &w=*workers_[(worker.index_+i)%workers_.size()];
+                    if (w.parked_.load(std::memory_order_relaxed) && w.parked_.exchange(false)) {
+                        wake(w);
+                        break;
+                    }
+                }
+                return;
+            }
+            ::close(fd);
+        }
+        // Out of descriptors or the queue is full, start it right here
+        handle_connect(worker.io_service_, std::move(socket), *worker.saps_[sap]);
+    }
+    
+    void server::schedule(worker_t &worker) {
+        // Oldest first from this worker, then from the others
+        std::unique_ptr<pending_t> p(worker.ready_.steal());
+        for (std::size_t i=1; !p && i<workers_.size(); i++)
+            p.reset(workers_[(worker.index_+i)%workers_.size()]->ready_.steal());
+        if (!p) {
+            worker.parked_.store(true, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            // A connection queued before we've parked doesn't wake us up, look once more
+            for (std::size_t i=0; !p && i<workers_.size(); i++)
+                p.reset(workers_[(worker.index_+i)%workers_.size()]->ready_.steal());
+        }
+        if (!p) {
+            // Back off while there's nothing to do, enqueue() wakes us up earlier
+            worker.interval_=std::min(std::max(worker.interval_*2, options_.steal_interval), options_.max_steal_interval);
+            worker.idle_.expires_from_now(worker.interval_);
+            worker.idle_.async_wait([this, &worker](const system::error_code &){
+                worker.parked_.store(false, std::memory_order_relaxed);
+                schedule(worker);
+            });
+            return;
+        }
+        worker.parked_.store(false, std::memory_order_relaxed);
+        worker.interval_=std::chrono::milliseconds(0);
+        sap_t &sap=*worker.saps_[p->sap];
+        if (p->worker!=worker.index_)
+            stolen_.inc();
+        tcp::socket socket(worker.io_service_);
+        system::error_code ec;
+        socket.assign(sap.protocol, p->fd, ec);
+        if (ec) {
+            ::close(p->fd);
+            sap.accept_errors.inc();
+            release(sap);
+        } else {
+            handle_connect(worker.io_service_, std::move(socket), sap);
+        }
+        // Behind the handlers already queued, so a busy worker leaves its connections to idle ones
+        worker.io_service_.post([this, &worker](){ schedule(worker); });
+    }
+    
+    void server::wake(worker_t &worker) {
+        // The timer belongs to the thread of the worker
+        worker.io_service_.post([&worker](){
+            system::error_code ec;
+            worker.idle_.cancel(ec);
+        });
     }
 }   // End of namespace net
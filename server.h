@@ -9,13 +9,21 @@
 #ifndef server_h_included
 #define server_h_included
 
+#include <atomic>
 #include <functional>
+#include <map>
+#include <memory>
 #include <string>
 #include <vector>
 #include <boost/asio/io_service.hpp>
 #include <boost/asio/ip/tcp.hpp>
 #include <boost/asio/signal_set.hpp>
+#include <boost/asio/steady_timer.hpp>
 #include "async_stream.h"
+#include "metrics.h"
+#include "stack_pool.h"
+#include "admission.h"
+#include "steal_queue.h"
 
 namespace net {
     typedef std::function<bool(boost::asio::io_service&)> initialization_handler_t;
@@ -25,6 +33,70 @@ namespace net {
     typedef std::pair<endpoint_t, protocol_handler_t> sap_desc_t;
     typedef std::vector<sap_desc_t> sap_desc_list_t;
     
+    /**
+     * Threading model of the server
+     */
+    enum class threading_model {
+        /**
+         * All threads run one shared io_service, each connection is protected by a strand
+         */
+        shared_io_service,
+        /**
+         * Each thread runs its own io_service with its own SO_REUSEPORT acceptor per SAP,
+         * a connection never leaves the thread accepted it
+         */
+        io_service_per_thread,
+        /**
+         * Like io_service_per_thread, but an accepted connection is queued on the accepting worker
+         * and started by the first worker getting to it, idle workers steal from busy ones. Once
+         * started a connection stays on its worker, so its strand is never contended
+         */
+        work_stealing,
+    };
+    
+    /**
+     * Server options
+     */
+    struct server_options_t {
+        threading_model model=threading_model::shared_io_service;
+        /**
+         * Pin thread N to CPU N, only effective with io_service_per_thread
+         */
+        bool cpu_affinity=false;
+        /**
+         * How often an idle worker looks for connections to steal, only effective with work_stealing
+         *
+         * The interval doubles up to max_steal_interval while there is nothing to steal, a worker
+         * queueing a connection wakes an idle one up right away
+         */
+        std::chrono::milliseconds steal_interval=std::chrono::milliseconds(1);
+        std::chrono::milliseconds max_steal_interval=std::chrono::milliseconds(64);
+        /**
+         * Coroutine stacks of the connections of SAPs not listed in sap_stacks
+         */
+        stack_options_t stack;
+        /**
+         * Coroutine stacks of the connections of individual SAPs, keyed by endpoint
+         */
+        std::map<endpoint_t, stack_options_t> sap_stacks;
+        /**
+         * Connections handled at once over all SAPs, 0 means no limit
+         *
+         * Accepting pauses at a limit and new connections wait in the listen backlog, a limit may
+         * be exceeded by one connection per acceptor
+         */
+        std::size_t max_connections=0;
+        /**
+         * Connections handled at once by each SAP not listed in sap_max_connections
+         */
+        std::size_t max_connections_per_sap=0;
+        std::map<endpoint_t, std::size_t> sap_max_connections;
+        /**
+         * Load shedding based on the queueing delay of the io_services, off by default
+         */
+        admission_options_t admission;
+    };
+    
     /**
      * Stream-oriented socket server
      */
@@ -35,9 +107,11 @@ namespace net {
          *
          * @param sap_desc_list protocols and their service access points (addresses and ports)
          * @param thread_pool_size number of threads that run simultaneously to process client connections
+         * @param options threading model and other server options
          */
         server(const sap_desc_list_t &sap_desc_list,
-               std::size_t thread_pool_size);
+               std::size_t thread_pool_size,
+               const server_options_t &options=server_options_t());
         
         /**
          * Constructor
@@ -46,11 +120,13 @@ namespace net {
          * @param initialization_handler called before setting up server
          * @param finalization_handler called before server destruction
          * @param thread_pool_size number of threads that run simultaneously to process client connections
+         * @param options threading model and other server options
          */
         server(const sap_desc_list_t &sap_desc_list,
                const initialization_handler_t &initialization_handler,
                const finalization_handler_t &finalization_handler,
-               std::size_t thread_pool_size);
+               std::size_t thread_pool_size,
+               const server_options_t &options=server_options_t());
         
         // Non-copyable
         server(const server&) = delete;
@@ -64,6 +140,12 @@ namespace net {
         inline void operator()()
         { run(); }
         
+        /**
+         * Stop the server from any thread, operator() returns once the threads have exited
+         */
+        inline void stop()
+        { close(); }
+        
         /**
          * Initialization result
          */
@@ -71,22 +153,100 @@ namespace net {
         { return init_state_; }
         
     private:
-        void listen(const sap_desc_t &sd);
-        void open();
+        /**
+         * State of an endpoint shared by its acceptors in all workers
+         */
+        struct endpoint_state_t {
+            endpoint_state_t(const stack_pool_ptr &stacks, std::size_t max_connections);
+            
+            stack_pool_ptr stacks;
+            std::size_t max_connections;
+            std::atomic<std::size_t> connections;
+        };
+        typedef std::shared_ptr<endpoint_state_t> endpoint_state_ptr;
+        
+        /**
+         * Listening socket, its protocol handler, the state of its endpoint, the admission control
+         * of its io_service, and its metrics labeled with the endpoint
+         */
+        struct sap_t {
+            sap_t(boost::asio::ip::tcp::acceptor &&acceptor,
+                  const protocol_handler_t &handler,
+                  const endpoint_t &endpoint,
+                  const endpoint_state_ptr &state,
+                  admission_service *admission,
+                  const boost::asio::ip::tcp &protocol);
+            
+            boost::asio::ip::tcp::acceptor acceptor;
+            boost::asio::ip::tcp protocol;
+            protocol_handler_t handler;
+            endpoint_state_ptr state;
+            // Null without load shedding
+            admission_service *admission;
+            metrics::counter accepted;
+            metrics::counter accept_errors;
+            metrics::counter failed;
+            metrics::gauge active;
+            metrics::counter paused;
+        };
+        typedef std::shared_ptr<sap_t> sap_ptr;
+        typedef std::vector<sap_ptr> sap_list_t;
+        
+        /**
+         * Accepted connection waiting for a worker, the descriptor is assigned to a socket of the
+         * io_service of the worker starting it
+         */
+        struct pending_t {
+            int fd;
+            // Index of the SAP, the same in all workers
+            std::size_t sap;
+            std::size_t worker;
+        };
+        
+        /**
+         * A thread with its own io_service and acceptors, used by io_service_per_thread and
+         * work_stealing
+         */
+        struct worker_t {
+            // Concurrency hint 1 tells Asio only one thread will run this io_service
+            worker_t(std::size_t index) : io_service_(1), index_(index), idle_(io_service_) {}
+            boost::asio::io_service io_service_;
+            std::size_t index_;
+            sap_list_t saps_;
+            details::steal_queue<pending_t> ready_;
+            boost::asio::steady_timer idle_;
+            // Waiting on idle_ with nothing to do, cleared by whoever wakes it up
+            std::atomic<bool> parked_{false};
+            // Current wait, only touched by the worker itself
+            std::chrono::milliseconds interval_{0};
+        };
+        typedef std::unique_ptr<worker_t> worker_ptr;
+        
+        endpoint_state_ptr endpoint_state(const endpoint_t &endpoint);
+        bool admit(const sap_t &sap) const;
+        void acquire(sap_t &sap);
+        void release(sap_t &sap);
+        void listen(boost::asio::io_service &ios, sap_list_t &saps, const sap_desc_t &sd, bool reuse_port);
+        void open(boost::asio::io_service &ios, sap_list_t &saps, worker_t *worker=nullptr);
         void close();
         void run();
-        void handle_connect(boost::asio::ip::tcp::socket &&socket, const protocol_handler_t &handler);
+        void handle_connect(boost::asio::io_service &ios, boost::asio::ip::tcp::socket &&socket, sap_t &sap);
+        void enqueue(worker_t &worker, boost::asio::ip::tcp::socket &&socket, std::size_t sap);
+        void schedule(worker_t &worker);
+        void wake(worker_t &worker);
         
         std::size_t thread_pool_size_;
+        server_options_t options_;
         boost::asio::io_service io_service_;
         boost::asio::signal_set signals_;
         initialization_handler_t initialization_handler_;
         finalization_handler_t finalization_handler_;
         bool init_state_;
-        typedef std::pair<boost::asio::ip::tcp::acceptor, protocol_handler_t> sap_t;
-        typedef std::shared_ptr<sap_t> sap_ptr;
-        typedef std::vector<sap_ptr> sap_list_t;
         sap_list_t saps_;
+        std::vector<worker_ptr> workers_;
+        std::map<endpoint_t, endpoint_state_ptr> endpoints_;
+        std::atomic<std::size_t> connections_{0};
+        metrics::counter stolen_;
     };
 }   // End of namespace net
 
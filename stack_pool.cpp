@@ -0,0 +1,137 @@
+//
+//  stack_pool.cpp
+//  coroserver
+//
+
+#include <cstring>
+#include <new>
+#include <vector>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "stack_pool.h"
+
+namespace net {
+    namespace details {
+        constexpr std::size_t huge_page_size=2*1024*1024;
+        // Written over sampled stacks, a byte still holding it has never been touched
+        constexpr unsigned char stack_fill=0xA5;
+
+        /**
+         * Cached stacks of one geometry, the mapping starts with the guard
+         */
+        struct free_list_t {
+            std::size_t size;
+            std::size_t guard;
+            std::vector<void *> stacks;
+        };
+
+        /**
+         * Stacks cached by one thread, only a few geometries are in use so a vector will do
+         */
+        struct stack_cache_t {
+            std::vector<free_list_t> lists;
+            std::size_t allocations=0;
+
+            free_list_t &list(std::size_t size, std::size_t guard) {
+                for (free_list_t &l : lists) {
+                    if (l.size==size && l.guard==guard) return l;
+                }
+                lists.push_back(free_list_t{size, guard, std::vector<void *>()});
+                return lists.back();
+            }
+        };
+
+        stack_cache_t &stack_cache() {
+            // The stacks cached by a thread are not unmapped when it exits, server threads live as
+            // long as the process
+            static thread_local stack_cache_t *cache;
+            if (!cache) cache=new stack_cache_t;
+            return *cache;
+        }
+
+        std::size_t round_up(std::size_t n, std::size_t unit)
+        { return (n+unit-1)/unit*unit; }
+
+        void *map_stack(std::size_t size, std::size_t guard, bool huge) {
+            void *p=MAP_FAILED;
+#if defined(MAP_HUGETLB)
+            if (huge)
+                p=mmap(nullptr, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+#endif
+            if (p==MAP_FAILED) {
+                // No explicit huge pages reserved, fall back to transparent huge pages
+                p=mmap(nullptr, size+guard, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+                if (p==MAP_FAILED) throw std::bad_alloc();
+#if defined(MADV_HUGEPAGE)
+                if (huge) madvise(p, size, MADV_HUGEPAGE);
+#endif
+            }
+            if (guard>0 && mprotect(p, guard, PROT_NONE)!=0) {
+                munmap(p, size+guard);
+                throw std::bad_alloc();
+            }
+            return p;
+        }
+    }   // End of namespace details
+
+    stack_pool::stack_pool(const stack_options_t &options, const std::string &name)
+    : options_(options)
+    , reused_(metrics::make_counter("net_coroutine_stacks_total", "Coroutine stacks handed out", {{"pool", name}, {"source", "cache"}}))
+    , mapped_(metrics::make_counter("net_coroutine_stacks_total", "Coroutine stacks handed out", {{"pool", name}, {"source", "mmap"}}))
+    , unmapped_(metrics::make_counter("net_coroutine_stacks_unmapped_total", "Coroutine stacks released with a full cache", {{"pool", name}}))
+    , cached_(metrics::make_gauge("net_coroutine_stacks_cached", "Coroutine stacks cached for reuse", {{"pool", name}}))
+    , used_(metrics::make_histogram("net_coroutine_stack_used_bytes",
+                                    "Stack high-water mark of sampled coroutines",
+                                    {{"pool", name}},
+                                    1,
+                                    {1024, 2048, 4096, 8192, 16384, 32768, 65536, 131072, 262144, 524288, 1048576}))
+    {
+        std::size_t page=static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+        if (options_.huge_pages) {
+            size_=details::round_up(options_.size, details::huge_page_size);
+            guard_=0;
+        } else {
+            size_=details::round_up(options_.size, page);
+            guard_=options_.guard_page ? page : 0;
+        }
+    }
+
+    void stack_pool::allocate(boost::coroutines::stack_context &ctx, bool &sampled) {
+        details::stack_cache_t &cache=details::stack_cache();
+        details::free_list_t &l=cache.list(size_, guard_);
+        char *base;
+        if (!l.stacks.empty()) {
+            base=static_cast<char *>(l.stacks.back());
+            l.stacks.pop_back();
+            cached_.dec();
+            reused_.inc();
+        } else {
+            base=static_cast<char *>(details::map_stack(size_, guard_, options_.huge_pages));
+            mapped_.inc();
+        }
+        // Stacks grow down, sp is the top of the usable area
+        ctx.size=size_;
+        ctx.sp=base+guard_+size_;
+        sampled=options_.sample_rate>0 && ++cache.allocations%options_.sample_rate==0;
+        if (sampled)
+            std::memset(base+guard_, details::stack_fill, size_);
+    }
+
+    void stack_pool::deallocate(boost::coroutines::stack_context &ctx, bool sampled) {
+        char *top=static_cast<char *>(ctx.sp);
+        char *base=top-size_-guard_;
+        if (sampled) {
+            const char *p=base+guard_;
+            while (p<top && static_cast<unsigned char>(*p)==details::stack_fill) p++;
+            used_.observe(static_cast<std::uint64_t>(top-p));
+        }
+        details::free_list_t &l=details::stack_cache().list(size_, guard_);
+        if (l.stacks.size()<options_.cache_size) {
+            l.stacks.push_back(base);
+            cached_.inc();
+        } else {
+            munmap(base, size_+guard_);
+            unmapped_.inc();
+        }
+    }
+}   // End of namespace net
@@ -0,0 +1,159 @@
+//
+//  stack_pool.h
+//  coroserver
+//
+
+#ifndef __coroserver__stack_pool__
+#define __coroserver__stack_pool__
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <boost/asio/strand.hpp>
+#include <boost/asio/spawn.hpp>
+#include <boost/coroutine/stack_context.hpp>
+#include "metrics.h"
+
+namespace net {
+    /**
+     * Coroutine stack options
+     */
+    struct stack_options_t {
+        /**
+         * Usable stack size, rounded up to whole pages
+         */
+        std::size_t size=64*1024;
+        /**
+         * Put an inaccessible page below the stack so an overflow faults instead of corrupting memory
+         */
+        bool guard_page=true;
+        /**
+         * Back stacks with huge pages, the size is rounded up to 2MB and there is no guard page.
+         * Explicit huge pages are tried first, then transparent huge pages
+         */
+        bool huge_pages=false;
+        /**
+         * Stacks kept for reuse by each thread, more are unmapped when released
+         */
+        std::size_t cache_size=256;
+        /**
+         * Measure the stack usage of 1 in sample_rate coroutines, 0 disables sampling
+         */
+        std::size_t sample_rate=0;
+    };
+
+    /**
+     * Pool of coroutine stacks
+     *
+     * Stacks are cached by the thread releasing them and handed out again to coroutines spawned
+     * on that thread, so a busy server stops mapping and unmapping stacks once it's warmed up.
+     * Pools with the same stack geometry share the cached stacks.
+     *
+     * Sampled stacks are filled with a pattern when handed out and scanned when released, the
+     * deepest overwritten byte gives the high-water mark of the coroutine, which is observed in
+     * the "net_coroutine_stack_used_bytes" histogram.
+     */
+    class stack_pool {
+    public:
+        /**
+         * @param name the "pool" label of the metrics of this pool
+         */
+        stack_pool(const stack_options_t &options, const std::string &name);
+
+        // Non-copyable
+        stack_pool(const stack_pool&) = delete;
+        stack_pool& operator=(const stack_pool&) = delete;
+
+        inline const stack_options_t &options() const
+        { return options_; }
+
+        /**
+         * Hand out a stack, sampled is set if its usage is to be measured
+         */
+        void allocate(boost::coroutines::stack_context &ctx, bool &sampled);
+
+        void deallocate(boost::coroutines::stack_context &ctx, bool sampled);
+
+    private:
+        stack_options_t options_;
+        // Usable size and guard size, in bytes
+        std::size_t size_;
+        std::size_t guard_;
+        metrics::counter reused_;
+        metrics::counter mapped_;
+        metrics::counter unmapped_;
+        metrics::gauge cached_;
+        metrics::histogram used_;
+    };
+
+    typedef std::shared_ptr<stack_pool> stack_pool_ptr;
+
+    /**
+     * StackAllocator of Boost.Coroutine taking stacks from a stack_pool
+     */
+    class pooled_stack_allocator {
+    public:
+        explicit pooled_stack_allocator(const stack_pool_ptr &pool)
+        : pool_(pool)
+        , sampled_(false)
+        {}
+
+        // The size comes from the pool options, they are passed in the coroutine attributes as well
+        inline void allocate(boost::coroutines::stack_context &ctx, std::size_t)
+        { pool_->allocate(ctx, sampled_); }
+
+        inline void deallocate(boost::coroutines::stack_context &ctx)
+        { pool_->deallocate(ctx, sampled_); }
+
+    private:
+        // Keeps the pool alive as long as the coroutine
+        stack_pool_ptr pool_;
+        bool sampled_;
+    };
+
+    namespace details {
+        /**
+         * Same as the spawn helper of Asio, but the coroutine is created with a pooled stack
+         */
+        template <typename Handler, typename Function>
+        struct pooled_spawn_helper {
+            void operator()() {
+                typedef typename boost::asio::basic_yield_context<Handler>::callee_type callee_type;
+                boost::asio::detail::coro_entry_point<Handler, Function> entry_point={ data_ };
+                boost::asio::detail::shared_ptr<callee_type> coro(new callee_type(entry_point,
+                                                                                  boost::coroutines::attributes(pool_->options().size),
+                                                                                  pooled_stack_allocator(pool_)));
+                data_->coro_=coro;
+                (*coro)();
+            }
+
+            boost::asio::detail::shared_ptr<boost::asio::detail::spawn_data<Handler, Function> > data_;
+            stack_pool_ptr pool_;
+        };
+    }   // End of namespace details
+
+    /**
+     * Start a coroutine within the strand like boost::asio::spawn, the stack is taken from the pool
+     *
+     * boost::asio::spawn always uses the default stack allocator, so the coroutine is set up here,
+     * it gets the same yield_context type. Without a pool this is boost::asio::spawn.
+     */
+    template <typename Function>
+    void spawn(boost::asio::strand strand, BOOST_ASIO_MOVE_ARG(Function) function, const stack_pool_ptr &pool) {
+        if (!pool) {
+            boost::asio::spawn(strand, BOOST_ASIO_MOVE_CAST(Function)(function));
+            return;
+        }
+        typedef decltype(strand.wrap(&boost::asio::detail::default_spawn_handler)) handler_t;
+        typedef typename std::decay<Function>::type function_t;
+        details::pooled_spawn_helper<handler_t, function_t> helper;
+        helper.data_.reset(new boost::asio::detail::spawn_data<handler_t, function_t>(strand.wrap(&boost::asio::detail::default_spawn_handler),
+                                                                                      true,
+                                                                                      BOOST_ASIO_MOVE_CAST(Function)(function)));
+        helper.pool_=pool;
+        boost_asio_handler_invoke_helpers::invoke(helper, helper.data_->handler_);
+    }
+}   // End of namespace net
+
+#endif /* defined(__coroserver__stack_pool__) */
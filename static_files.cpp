@@ -0,0 +1,524 @@
+//
+//  static_files.cpp
+//  coroserver
+//
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <atomic>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "timer_wheel.h"
+#include "static_files.h"
+
+namespace http {
+    namespace details {
+        struct mime_type_t {
+            const char *ext;
+            const char *type;
+        };
+
+        const mime_type_t mime_types[]={
+            {"css", "text/css; charset=utf-8"},
+            {"gif", "image/gif"},
+            {"htm", "text/html; charset=utf-8"},
+            {"html", "text/html; charset=utf-8"},
+            {"ico", "image/x-icon"},
+            {"jpeg", "image/jpeg"},
+            {"jpg", "image/jpeg"},
+            {"js", "application/javascript; charset=utf-8"},
+            {"json", "application/json"},
+            {"mp4", "video/mp4"},
+            {"pdf", "application/pdf"},
+            {"png", "image/png"},
+            {"svg", "image/svg+xml"},
+            {"ttf", "font/ttf"},
+            {"txt", "text/plain; charset=utf-8"},
+            {"wasm", "application/wasm"},
+            {"webp", "image/webp"},
+            {"woff", "font/woff"},
+            {"woff2", "font/woff2"},
+            {"xml", "application/xml"},
+            {"zip", "application/zip"},
+        };
+
+        string_ref_t mime_type(const std::string &path) {
+            std::size_t dot=path.find_last_of("./");
+            if (dot!=std::string::npos && path[dot]=='.') {
+                string_ref_t ext(path.data()+dot+1, path.size()-dot-1);
+                for (const mime_type_t &m : mime_types) {
+                    if (iequals(ext, m.ext)) return m.type;
+                }
+            }
+            return "application/octet-stream";
+        }
+
+        /**
+         * Open file with the metadata sent in the response headers
+         */
+        struct open_file_t {
+            ~open_file_t() {
+                if (fd>=0) ::close(fd);
+            }
+
+            bool same(const struct stat &st) const {
+                return dev==st.st_dev
+                    && ino==st.st_ino
+                    && size==std::uint64_t(st.st_size)
+                    && mtime==st.st_mtime;
+            }
+
+            int fd=-1;
+            dev_t dev;
+            ino_t ino;
+            std::uint64_t size;
+            std::time_t mtime;
+            std::string etag;
+            std::string last_modified;
+            string_ref_t content_type;
+            // Compressed responses indexed by content_coding, made on first use by the request
+            // setting compressed, null until then
+            mutable std::atomic<bool> compressed[static_cast<std::size_t>(content_coding::count)]={};
+            mutable prepared_response_ptr variants[static_cast<std::size_t>(content_coding::count)];
+        };
+        typedef std::shared_ptr<const open_file_t> open_file_ptr;
+
+        /**
+         * LRU cache of open files, shared by all threads
+         */
+        class file_cache {
+        public:
+            file_cache(const std::string &root, const static_files_options_t &options)
+            : root_(root)
+            , options_(options)
+            {
+                while (!root_.empty() && root_.back()=='/') root_.pop_back();
+            }
+
+            const static_files_options_t &options() const
+            { return options_; }
+
+            /**
+             * Open the file at path relative to the root, returns null and sets err if failed
+             *
+             * Cached files are re-checked with stat() if they haven't been for a while, and
+             * reopened if they have been changed or replaced
+             */
+            open_file_ptr open(const std::string &path, int &err) {
+                std::int64_t now=net::timer_wheel::now();
+                open_file_ptr cached;
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    index_t::iterator i=index_.find(path);
+                    if (i!=index_.end()) {
+                        // Most recently used first
+                        lru_.splice(lru_.begin(), lru_, i->second);
+                        if (now-i->second->checked<options_.revalidate.count())
+                            return i->second->file;
+                        cached=i->second->file;
+                    }
+                }
+                std::string full=root_+path;
+                struct stat st;
+                if (::stat(full.c_str(), &st)!=0) {
+                    err=errno;
+                    erase(path);
+                    return open_file_ptr();
+                }
+                if (!S_ISREG(st.st_mode)) {
+                    err=S_ISDIR(st.st_mode) ? EISDIR : ENOENT;
+                    erase(path);
+                    return open_file_ptr();
+                }
+                if (cached && cached->same(st)) {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    index_t::iterator i=index_.find(path);
+                    if (i!=index_.end()) i->second->checked=now;
+                    return cached;
+                }
+                std::shared_ptr<open_file_t> f=std::make_shared<open_file_t>();
+                f->fd=::open(full.c_str(), O_RDONLY|O_CLOEXEC);
+                // Metadata of the file actually opened, it may have been replaced after stat()
+                if (f->fd<0 || ::fstat(f->fd, &st)!=0) {
+                    err=errno;
+                    return open_file_ptr();
+                }
+                f->dev=st.st_dev;
+                f->ino=st.st_ino;
+                f->size=st.st_size;
+                f->mtime=st.st_mtime;
+                char buf[64];
+                int n=snprintf(buf, sizeof(buf), "\"%llx-%llx-%llx\"",
+                               (unsigned long long)f->ino,
+                               (unsigned long long)f->size,
+                               (unsigned long long)f->mtime);
+                f->etag.assign(buf, n);
+                std::tm tm;
+                gmtime_r(&f->mtime, &tm);
+                f->last_modified.assign(buf, strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", &tm));
+                f->content_type=mime_type(path);
+                insert(path, f, now);
+                return f;
+            }
+
+            std::size_t size() const {
+                std::lock_guard<std::mutex> lock(mutex_);
+                return lru_.size();
+            }
+
+        private:
+            struct entry_t {
+                std::string path;
+                open_file_ptr file;
+                std::int64_t checked;
+            };
+            typedef std::list<entry_t> lru_t;
+            typedef std::unordered_map<std::string, lru_t::iterator> index_t;
+
+            void insert(const std::string &path, const open_file_ptr &f, std::int64_t now) {
+                std::lock_guard<std::mutex> lock(mutex_);
+                index_t::iterator i=index_.find(path);
+                if (i!=index_.end()) {
+                    i->second->file=f;
+                    i->second->checked=now;
+                    lru_.splice(lru_.begin(), lru_, i->second);
+                    return;
+                }
+                lru_.push_front(entry_t{path, f, now});
+                index_[path]=lru_.begin();
+                while (lru_.size()>options_.max_open_files) {
+                    // Responses still being sent keep their files open
+                    index_.erase(lru_.back().path);
+                    lru_.pop_back();
+                }
+            }
+
+            void erase(const std::string &path) {
+                std::lock_guard<std::mutex> lock(mutex_);
+                index_t::iterator i=index_.find(path);
+                if (i!=index_.end()) {
+                    lru_.erase(i->second);
+                    index_.erase(i);
+                }
+            }
+
+            std::string root_;
+            static_files_options_t options_;
+            mutable std::mutex mutex_;
+            lru_t lru_;
+            index_t index_;
+        };
+
+        inline int hex_value(char c) {
+            if (c>='0' && c<='9') return c-'0';
+            if (c>='a' && c<='f') return c-'a'+10;
+            if (c>='A' && c<='F') return c-'A'+10;
+            return -1;
+        }
+
+        /**
+         * Percent-decode the URL path, returns false if it may escape the root
+         */
+        bool map_path(const string_ref_t &url_path, std::string &path) {
+            path.clear();
+            for (std::size_t i=0; i<url_path.size(); i++) {
+                char c=url_path[i];
+                if (c=='%') {
+                    if (i+2>=url_path.size()) return false;
+                    int h=hex_value(url_path[i+1]);
+                    int l=hex_value(url_path[i+2]);
+                    if (h<0 || l<0) return false;
+                    c=char(h*16+l);
+                    i+=2;
+                }
+                if (c=='\0' || c=='\\') return false;
+                path.push_back(c);
+            }
+            if (path.empty() || path[0]!='/') path.insert(path.begin(), '/');
+            // Reject ".." segments
+            for (std::size_t pos=path.find("/.."); pos!=std::string::npos; pos=path.find("/..", pos+1)) {
+                if (pos+3==path.size() || path[pos+3]=='/') return false;
+            }
+            return true;
+        }
+
+        inline string_ref_t trim(string_ref_t s) {
+            while (!s.empty() && (s.front()==' ' || s.front()=='\t')) s.remove_prefix(1);
+            while (!s.empty() && (s.back()==' ' || s.back()=='\t')) s.remove_suffix(1);
+            return s;
+        }
+
+        /**
+         * Weak comparison against the entity tags in If-None-Match
+         */
+        bool etag_matches(string_ref_t tags, const string_ref_t &etag) {
+            while (!tags.empty()) {
+                std::size_t comma=tags.find(',');
+                string_ref_t tag=trim(tags.substr(0, comma));
+                if (tag=="*") return true;
+                if (tag.starts_with("W/")) tag.remove_prefix(2);
+                if (tag==etag) return true;
+                if (comma==string_ref_t::npos) break;
+                tags.remove_prefix(comma+1);
+            }
+            return false;
+        }
+
+        bool parse_http_date(const string_ref_t &s, std::time_t &t) {
+            std::string v(s.data(), s.size());
+            std::tm tm;
+            memset(&tm, 0, sizeof(tm));
+            const char *end=strptime(v.c_str(), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+            if (!end || *end) return false;
+            t=timegm(&tm);
+            return true;
+        }
+
+        /**
+         * Entity tag of a compressed variant, "abc" becomes "abc-gzip"
+         */
+        string_ref_t variant_etag(const open_file_t &f, content_coding c, char *buf, std::size_t size) {
+            if (c==content_coding::identity) return f.etag;
+            string_ref_t name=coding_name(c);
+            int n=snprintf(buf, size, "%.*s-%.*s\"",
+                           int(f.etag.size()-1), f.etag.data(),
+                           int(name.size()), name.data());
+            return string_ref_t(buf, n);
+        }
+
+        /**
+         * Headers of a full response with the coding
+         */
+        void file_headers(headers_t &h, const open_file_t &f, const static_files_options_t &opt, bool vary, content_coding c) {
+            char buf[96];
+            h.push_back("Content-Type", f.content_type);
+            h.push_back("Last-Modified", f.last_modified);
+            h.push_back("ETag", variant_etag(f, c, buf, sizeof(buf)));
+            h.push_back("Accept-Ranges", "bytes");
+            if (opt.max_age.count()>0) {
+                int n=snprintf(buf, sizeof(buf), "max-age=%lld", (long long)opt.max_age.count());
+                h.push_back("Cache-Control", string_ref_t(buf, n));
+            }
+            if (vary)
+                h.push_back("Vary", "Accept-Encoding");
+            if (c!=content_coding::identity)
+                h.push_back("Content-Encoding", coding_name(c));
+        }
+
+        /**
+         * Compressed 200 response of the file, made once and kept with the open file, null if
+         * the file can't be read or doesn't get smaller
+         */
+        prepared_response_ptr file_variant(const open_file_t &f, content_coding c, const static_files_options_t &opt, int level) {
+            std::size_t i=static_cast<std::size_t>(c);
+            // Nobody waits for the file to be read and compressed, other requests for the same
+            // variant are sent the file as it is until it's published
+            if (f.compressed[i].load(std::memory_order_acquire) || f.compressed[i].exchange(true))
+                return std::atomic_load(&f.variants[i]);
+            std::string content(f.size, '\0');
+            for (std::size_t n=0; n<f.size;) {
+                ssize_t r=::pread(f.fd, &content[n], f.size-n, n);
+                if (r<0 && errno==EINTR) continue;
+                if (r<=0) return prepared_response_ptr();
+                n+=r;
+            }
+            std::string body;
+            if (!compress(c, level, content, body) || body.size()>=content.size())
+                return prepared_response_ptr();
+            response_t resp;
+            resp.clear();
+            resp.code(OK);
+            file_headers(resp.headers(), f, opt, true, c);
+            resp.body_stream().write(body.data(), body.size());
+            prepared_response_ptr v=prepare_response(resp);
+            std::atomic_store(&f.variants[i], v);
+            return v;
+        }
+
+        bool not_modified(const request_t &req, const open_file_t &f, const string_ref_t &etag) {
+            // If-None-Match takes precedence over If-Modified-Since
+            if (req.headers().contains(header_id::if_none_match))
+                return etag_matches(req.headers().value(header_id::if_none_match), etag);
+            std::time_t since;
+            if (req.headers().contains(header_id::if_modified_since)
+                && parse_http_date(req.headers().value(header_id::if_modified_since), since))
+            {
+                return f.mtime<=since;
+            }
+            return false;
+        }
+
+        enum class range_result {
+            none,
+            satisfiable,
+            unsatisfiable,
+        };
+
+        bool parse_uint(const string_ref_t &s, std::uint64_t &v) {
+            if (s.empty() || s.size()>19) return false;
+            v=0;
+            for (char c : s) {
+                if (c<'0' || c>'9') return false;
+                v=v*10+(c-'0');
+            }
+            return true;
+        }
+
+        /**
+         * Parse a single byte range, multiple ranges and invalid ones are ignored
+         */
+        range_result parse_range(string_ref_t v, std::uint64_t size, std::uint64_t &first, std::uint64_t &last) {
+            v=trim(v);
+            if (v.size()<6 || !iequals(v.substr(0, 6), "bytes=")) return range_result::none;
+            v=trim(v.substr(6));
+            std::size_t dash=v.find('-');
+            if (dash==string_ref_t::npos || v.find(',')!=string_ref_t::npos) return range_result::none;
+            string_ref_t a=trim(v.substr(0, dash));
+            string_ref_t b=trim(v.substr(dash+1));
+            if (a.empty()) {
+                // Suffix range, the last n bytes
+                std::uint64_t n;
+                if (!parse_uint(b, n)) return range_result::none;
+                if (n==0 || size==0) return range_result::unsatisfiable;
+                first=n<size ? size-n : 0;
+                last=size-1;
+                return range_result::satisfiable;
+            }
+            if (!parse_uint(a, first)) return range_result::none;
+            if (b.empty()) {
+                last=size-1;
+            } else if (!parse_uint(b, last) || last<first) {
+                return range_result::none;
+            }
+            if (first>=size) return range_result::unsatisfiable;
+            if (last>=size) last=size-1;
+            return range_result::satisfiable;
+        }
+
+        /**
+         * Range applies if there is no If-Range or it names the current version
+         */
+        bool if_range_matches(const request_t &req, const open_file_t &f) {
+            headers_t::const_iterator i=req.headers().find("If-Range");
+            if (i==req.headers().end()) return true;
+            string_ref_t v=trim(i->second);
+            return v==f.etag || v==f.last_modified;
+        }
+    }   // End of namespace details
+
+    static_files::static_files(const std::string &root, const static_files_options_t &options)
+    : cache_(std::make_shared<details::file_cache>(root, options))
+    {}
+
+    std::size_t static_files::cached() const
+    { return cache_->size(); }
+
+    bool static_files::operator()(session_t &session) const {
+        const request_t &req=session.request();
+        response_t &resp=session.response();
+        const static_files_options_t &opt=cache_->options();
+        if (req.method()!=GET && req.method()!=HEAD) {
+            resp.code(METHOD_NOT_ALLOWED);
+            resp.headers().push_back("Allow", "GET, HEAD");
+            return true;
+        }
+        string_ref_t url_path=req.path();
+        if (!opt.strip_prefix.empty() && url_path.starts_with(opt.strip_prefix))
+            url_path.remove_prefix(opt.strip_prefix.size());
+        std::string path;
+        if (!details::map_path(url_path, path)) {
+            resp.code(NOT_FOUND);
+            return true;
+        }
+        int err=0;
+        details::open_file_ptr f=cache_->open(path, err);
+        if (!f && err==EISDIR && !opt.index.empty()) {
+            if (path.back()!='/') path.push_back('/');
+            path.append(opt.index);
+            f=cache_->open(path, err);
+        }
+        if (!f) {
+            resp.code(err==EACCES ? FORBIDDEN : NOT_FOUND);
+            return true;
+        }
+
+        // Text files are compressed once and the compressed copy is kept in memory, ranges
+        // are only served from the file itself
+        const compression_options_t &copt=session.compression();
+        bool vary=copt.enabled
+            && compressible_type(f->content_type)
+            && f->size>=copt.min_size
+            && f->size<=copt.max_file_size;
+        content_coding coding=content_coding::identity;
+        prepared_response_ptr variant;
+        if (vary && !req.headers().contains(header_id::range)) {
+            coding=negotiate_coding(req.headers().value(header_id::accept_encoding));
+            if (coding!=content_coding::identity)
+                variant=details::file_variant(*f, coding, opt, copt.variant_level);
+            if (!variant)
+                coding=content_coding::identity;
+        }
+        headers_t &h=resp.headers();
+        details::file_headers(h, *f, opt, vary, coding);
+        char buf[96];
+        std::uint64_t full_size=variant ? variant->body.size() : f->size;
+        if (details::not_modified(req, *f, details::variant_etag(*f, coding, buf, sizeof(buf)))) {
+            resp.code(NOT_MODIFIED);
+            // Length of the full representation, no body is sent
+            int n=snprintf(buf, sizeof(buf), "%llu", (unsigned long long)full_size);
+            h.push_back("Content-Length", string_ref_t(buf, n));
+            return true;
+        }
+        if (variant) {
+            if (req.method()==HEAD) {
+                int n=snprintf(buf, sizeof(buf), "%llu", (unsigned long long)full_size);
+                h.push_back("Content-Length", string_ref_t(buf, n));
+            } else {
+                resp.prepared(variant);
+            }
+            return true;
+        }
+
+        file_body_t body;
+        body.owner=f;
+        body.fd=f->fd;
+        body.size=f->size;
+        if (req.headers().contains(header_id::range) && details::if_range_matches(req, *f)) {
+            std::uint64_t first=0, last=0;
+            switch (details::parse_range(req.headers().value(header_id::range), f->size, first, last)) {
+                case details::range_result::satisfiable: {
+                    resp.code(PARTIAL_CONTENT);
+                    int n=snprintf(buf, sizeof(buf), "bytes %llu-%llu/%llu",
+                                   (unsigned long long)first,
+                                   (unsigned long long)last,
+                                   (unsigned long long)f->size);
+                    h.push_back("Content-Range", string_ref_t(buf, n));
+                    body.offset=first;
+                    body.size=last-first+1;
+                    break;
+                }
+                case details::range_result::unsatisfiable: {
+                    resp.code(REQUESTED_RANGE_NOT_SATISFIABLE);
+                    int n=snprintf(buf, sizeof(buf), "bytes */%llu", (unsigned long long)f->size);
+                    h.push_back("Content-Range", string_ref_t(buf, n));
+                    return true;
+                }
+                case details::range_result::none:
+                    break;
+            }
+        }
+        if (req.method()==HEAD) {
+            int n=snprintf(buf, sizeof(buf), "%llu", (unsigned long long)body.size);
+            h.push_back("Content-Length", string_ref_t(buf, n));
+            return true;
+        }
+        resp.file_body(body);
+        return true;
+    }
+}   // End of namespace http
@@ -0,0 +1,69 @@
+//
+//  static_files.h
+//  coroserver
+//
+
+#ifndef __coroserver__static_files__
+#define __coroserver__static_files__
+
+#include <string>
+#include <memory>
+#include <chrono>
+#include "http_protocol.h"
+
+namespace http {
+    struct static_files_options_t {
+        /**
+         * Removed from the request path before it's mapped to a file, i.e. "/static"
+         */
+        std::string strip_prefix;
+        /**
+         * File served for directories, empty to answer 404
+         */
+        std::string index="index.html";
+        /**
+         * Value of "Cache-Control: max-age", no Cache-Control header if 0
+         */
+        std::chrono::seconds max_age=std::chrono::seconds(0);
+        /**
+         * How long a cached stat result is trusted before the file is checked again
+         */
+        net::timeout_t revalidate=std::chrono::seconds(2);
+        /**
+         * Max number of open files kept in the cache
+         */
+        std::size_t max_open_files=256;
+    };
+
+    namespace details {
+        class file_cache;
+    }   // End of namespace details
+
+    /**
+     * Request handler serving files under a directory, can be used with router<> and router<Arg>
+     *
+     * Bodies are sent with sendfile(), open files and their metadata are kept in an LRU cache
+     * shared by all copies of the handler. Answers conditional requests with 304 and single
+     * byte ranges with 206, other methods than GET and HEAD get 405.
+     */
+    class static_files {
+    public:
+        static_files(const std::string &root, const static_files_options_t &options=static_files_options_t());
+
+        bool operator()(session_t &session) const;
+
+        template<typename Arg>
+        bool operator()(session_t &session, Arg &) const
+        { return (*this)(session); }
+
+        /**
+         * Number of open files in the cache
+         */
+        std::size_t cached() const;
+
+    private:
+        std::shared_ptr<details::file_cache> cache_;
+    };
+}   // End of namespace http
+
+#endif /* defined(__coroserver__static_files__) */
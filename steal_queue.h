@@ -0,0 +1,74 @@
+//
+//  steal_queue.h
+//  coroserver
+//
+
+#ifndef __coroserver__steal_queue__
+#define __coroserver__steal_queue__
+
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+
+namespace net {
+    namespace details {
+        /**
+         * Bounded lock-free work-stealing queue of pointers
+         *
+         * The owner pushes at the bottom, the owner and any other thread take from the top, so items
+         * come out oldest first. This is the Chase-Lev deque without the owner's LIFO end, taking
+         * from the top costs the owner one CAS like a thief.
+         */
+        template<typename T, std::size_t Capacity=1024>
+        class steal_queue {
+            static_assert((Capacity & (Capacity-1))==0, "Capacity must be a power of 2");
+        public:
+            steal_queue()
+            : top_(0)
+            , bottom_(0)
+            {
+                for (std::atomic<T *> &i : items_)
+                    i.store(nullptr, std::memory_order_relaxed);
+            }
+
+            // Non-copyable
+            steal_queue(const steal_queue&) = delete;
+            steal_queue& operator=(const steal_queue&) = delete;
+
+            /**
+             * Owner only, returns false if the queue is full
+             */
+            bool push(T *item) {
+                std::int64_t b=bottom_.load(std::memory_order_relaxed);
+                std::int64_t t=top_.load(std::memory_order_acquire);
+                if (b-t>=static_cast<std::int64_t>(Capacity)) return false;
+                items_[b & (Capacity-1)].store(item, std::memory_order_relaxed);
+                bottom_.store(b+1, std::memory_order_release);
+                return true;
+            }
+
+            /**
+             * Any thread, returns null if the queue is empty or another thread has won the race
+             */
+            T *steal() {
+                std::int64_t t=top_.load(std::memory_order_acquire);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                std::int64_t b=bottom_.load(std::memory_order_acquire);
+                if (t>=b) return nullptr;
+                T *item=items_[t & (Capacity-1)].load(std::memory_order_relaxed);
+                if (!top_.compare_exchange_strong(t, t+1, std::memory_order_seq_cst, std::memory_order_relaxed))
+                    return nullptr;
+                return item;
+            }
+
+        private:
+            std::atomic<std::int64_t> top_;
+            // Thieves hammer top_, keep it off the owner's cache line
+            char pad_[64-sizeof(std::atomic<std::int64_t>)];
+            std::atomic<std::int64_t> bottom_;
+            std::atomic<T *> items_[Capacity];
+        };
+    }   // End of namespace details
+}   // End of namespace net
+
+#endif /* defined(__coroserver__steal_queue__) */
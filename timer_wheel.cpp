@@ -0,0 +1,172 @@
+//
+//  timer_wheel.cpp
+//  coroserver
+//
+
+#include <algorithm>
+#include "timer_wheel.h"
+
+namespace net {
+    namespace details {
+        inline std::int64_t tick_of(std::int64_t ms)
+        { return ms/timer_wheel::tick_ms; }
+    }   // End of namespace details
+    
+    constexpr std::int64_t timer_wheel::tick_ms;
+    constexpr std::size_t timer_wheel::slot_count;
+    
+    wheel_timer::wheel_timer(boost::asio::io_service &ios)
+    : wheel_(&boost::asio::use_service<timer_wheel_service>(ios).wheel())
+    , deadline_(0)
+    , bucket_(-1)
+    {}
+    
+    wheel_timer::wheel_timer(wheel_timer &&src)
+    : wheel_(src.wheel_)
+    , deadline_(0)
+    , bucket_(-1)
+    , callback_(std::move(src.callback_))
+    {}
+    
+    wheel_timer::~wheel_timer() {
+        // Always lock, the wheel may be looking at this timer on another thread even if it's unlinked
+        std::unique_lock<std::mutex> lock=wheel_->guard();
+        wheel_->unlink(this);
+    }
+    
+    void wheel_timer::arm(timeout_t timeout) {
+        if (timeout.count()<=0) {
+            disarm();
+            return;
+        }
+        std::int64_t deadline=timer_wheel::now()+timeout.count();
+        deadline_.store(deadline);
+        std::int64_t bucket=bucket_.load();
+        // Stay in the current slot if it comes up no later than the deadline, the wheel moves
+        // the timer forward then
+        if (bucket<0 || details::tick_of(deadline)<bucket)
+            wheel_->link(this);
+    }
+    
+    timer_wheel::timer_wheel(boost::asio::io_service &ios)
+    : tick_timer_(ios)
+    , current_(details::tick_of(now()))
+    , slots_(slot_count)
+    {}
+    
+    void timer_wheel::shutdown() {
+        std::unique_lock<std::mutex> lock=guard();
+        shutdown_=true;
+        boost::system::error_code ec;
+        tick_timer_.cancel(ec);
+    }
+    
+    void timer_wheel::link(wheel_timer *t) {
+        std::unique_lock<std::mutex> lock=guard();
+        std::int64_t deadline=t->deadline_.load(std::memory_order_relaxed);
+        if (deadline==0) return;
+        std::int64_t bucket=t->bucket_.load(std::memory_order_relaxed);
+        std::int64_t tick=std::max(details::tick_of(deadline), current_+1);
+        if (bucket>=0) {
+            // Rechecked under the lock, another thread may have moved it
+            if (tick>=bucket) return;
+            unlink(t);
+        }
+        insert(t, tick);
+        schedule();
+    }
+    
+    void timer_wheel::insert(wheel_timer *t, std::int64_t tick) {
+        details::wheel_link_t &head=slots_[tick%slot_count];
+        t->prev=head.prev;
+        t->next=&head;
+        head.prev->next=t;
+        head.prev=t;
+        t->bucket_.store(tick, std::memory_order_release);
+        size_++;
+    }
+    
+    void timer_wheel::unlink(wheel_timer *t) {
+        if (t->bucket_.load(std::memory_order_relaxed)<0) return;
+        t->prev->next=t->next;
+        t->next->prev=t->prev;
+        t->prev=t->next=t;
+        t->bucket_.store(-1, std::memory_order_release);
+        size_--;
+    }
+    
+    void timer_wheel::schedule() {
+        if (ticking_ || shutdown_ || size_==0) return;
+        ticking_=true;
+        tick_timer_.expires_from_now(std::chrono::milliseconds(tick_ms));
+        tick_timer_.async_wait([this](const boost::system::error_code &ec){ on_tick(ec); });
+    }
+    
+    void timer_wheel::on_tick(const boost::system::error_code &ec) {
+        std::vector<wheel_timer::callback_t> expired;
+        {
+            std::unique_lock<std::mutex> lock=guard();
+            ticking_=false;
+            if (ec || shutdown_) return;
+            std::int64_t now_ms=now();
+            std::int64_t target=details::tick_of(now_ms);
+            // Visit every slot at most once if the tick is late
+            std::int64_t first=std::max(current_+1, target-std::int64_t(slot_count)+1);
+            for (std::int64_t tick=first; tick<=target; tick++) {
+                details::wheel_link_t &head=slots_[tick%slot_count];
+                // Detach the slot, timers moved forward may land in the same slot again
+                details::wheel_link_t pending;
+                if (head.next!=&head) {
+                    pending.next=head.next;
+                    pending.prev=head.prev;
+                    pending.next->prev=&pending;
+                    pending.prev->next=&pending;
+                    head.next=head.prev=&head;
+                }
+                while (pending.next!=&pending) {
+                    wheel_timer *t=static_cast<wheel_timer *>(pending.next);
+                    pending.next=t->next;
+                    t->next->prev=&pending;
+                    t->prev=t->next=t;
+                    size_--;
+                    std::int64_t deadline=t->deadline_.load(std::memory_order_relaxed);
+                    if (deadline>now_ms) {
+                        insert(t, std::max(details::tick_of(deadline), target+1));
+                        continue;
+                    }
+                    // Mark unlinked before the final check, a concurrent arm() either sees this and
+                    // links the timer again, or its deadline is seen below
+                    t->bucket_.store(-1);
+                    deadline=t->deadline_.load();
+                    if (deadline==0) {
+                        // Disarmed, will be linked again on next arm
+                        continue;
+                    }
+                    if (deadline>now_ms) {
+                        insert(t, std::max(details::tick_of(deadline), target+1));
+                        continue;
+                    }
+                    // Fails if rearmed after the check, arm() links it again then
+                    if (t->deadline_.compare_exchange_strong(deadline, 0))
+                        expired.push_back(t->callback_);
+                }
+            }
+            current_=target;
+            schedule();
+        }
+        // Callbacks may arm timers of this wheel
+        for (const wheel_timer::callback_t &cb : expired) {
+            if (cb) cb();
+        }
+    }
+    
+    boost::asio::io_service::id timer_wheel_service::id;
+    
+    timer_wheel_service::timer_wheel_service(boost::asio::io_service &ios)
+    : boost::asio::io_service::service(ios)
+    , wheel_(ios)
+    {}
+    
+    void timer_wheel_service::shutdown_service()
+    { wheel_.shutdown(); }
+}   // End of namespace net
@@ -0,0 +1,180 @@
+//
+//  timer_wheel.h
+//  coroserver
+//
+
+#ifndef __coroserver__timer_wheel__
+#define __coroserver__timer_wheel__
+
+#include <cstdint>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <memory>
+#include <vector>
+#include <functional>
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+namespace net {
+    /**
+     * I/O timeouts, 0 means no timeout
+     */
+    typedef std::chrono::milliseconds timeout_t;
+
+    class timer_wheel;
+
+    namespace details {
+        /**
+         * Node of the circular lists in timer wheel slots
+         */
+        struct wheel_link_t {
+            wheel_link_t *prev=this;
+            wheel_link_t *next=this;
+        };
+    }   // End of namespace details
+
+    /**
+     * Timer registered to the timer wheel of an io_service
+     *
+     * Arming and disarming only store the deadline, the timer is linked into the wheel on the first
+     * arm and stays there, the wheel moves it to the right slot when its old slot comes up, so
+     * rearming is O(1) and lock-free in the common case where the deadline moves forward
+     */
+    class wheel_timer : private details::wheel_link_t {
+    public:
+        typedef std::function<void()> callback_t;
+
+        wheel_timer(boost::asio::io_service &ios);
+
+        // Movable, the deadline is not moved
+        wheel_timer(wheel_timer &&src);
+
+        // Non-copyable
+        wheel_timer(const wheel_timer&) = delete;
+        wheel_timer& operator=(const wheel_timer&) = delete;
+
+        ~wheel_timer();
+
+        /**
+         * Set the expiration callback
+         *
+         * The callback is called on an arbitrary thread running the io_service, wrap it with a
+         * strand if needed
+         */
+        void callback(const callback_t &cb)
+        { callback_=cb; }
+
+        /**
+         * Call the callback after timeout unless the timer is rearmed or disarmed before, a zero
+         * timeout disarms the timer
+         */
+        void arm(timeout_t timeout);
+
+        void disarm()
+        { deadline_.store(0, std::memory_order_relaxed); }
+
+        bool armed() const
+        { return deadline_.load(std::memory_order_relaxed)!=0; }
+
+    private:
+        timer_wheel *wheel_;
+        // Milliseconds on the wheel clock, 0 means disarmed
+        std::atomic<std::int64_t> deadline_;
+        // Tick of the slot this timer is linked into, -1 if not linked, written under the wheel lock
+        std::atomic<std::int64_t> bucket_;
+        callback_t callback_;
+
+        friend class timer_wheel;
+    };
+
+    /**
+     * Hashed timer wheel with coarse ticks
+     *
+     * The tick timer is only running while there are timers linked into the wheel. The wheel is
+     * locked only if the io_service may be run by several threads, see single_threaded()
+     */
+    class timer_wheel {
+    public:
+        /**
+         * Tick interval and number of slots, timers later than one revolution are moved when their
+         * slot comes up
+         */
+        static constexpr std::int64_t tick_ms=10;
+        static constexpr std::size_t slot_count=512;
+
+        timer_wheel(boost::asio::io_service &ios);
+
+        // Non-copyable
+        timer_wheel(const timer_wheel&) = delete;
+        timer_wheel& operator=(const timer_wheel&) = delete;
+
+        /**
+         * Milliseconds since the steady clock epoch
+         */
+        static std::int64_t now() {
+            using namespace std::chrono;
+            return duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+        }
+
+        /**
+         * Number of timers linked into the wheel
+         */
+        std::size_t size() const
+        { return size_; }
+
+        /**
+         * Stop ticking, called when the io_service is being destroyed
+         */
+        void shutdown();
+
+        /**
+         * Skip locking, only the thread running the io_service may use the wheel afterwards
+         */
+        void single_threaded()
+        { single_threaded_=true; }
+
+    private:
+        std::unique_lock<std::mutex> guard()
+        { return single_threaded_ ? std::unique_lock<std::mutex>() : std::unique_lock<std::mutex>(mutex_); }
+
+        void link(wheel_timer *t);
+        void unlink(wheel_timer *t);
+        void insert(wheel_timer *t, std::int64_t tick);
+        void schedule();
+        void on_tick(const boost::system::error_code &ec);
+
+        std::mutex mutex_;
+        bool single_threaded_=false;
+        boost::asio::steady_timer tick_timer_;
+        bool ticking_=false;
+        bool shutdown_=false;
+        // Last processed tick
+        std::int64_t current_;
+        std::size_t size_=0;
+        // Sentinels of circular lists
+        std::vector<details::wheel_link_t> slots_;
+
+        friend class wheel_timer;
+    };
+
+    /**
+     * Owns the timer wheel of an io_service
+     */
+    class timer_wheel_service : public boost::asio::io_service::service {
+    public:
+        static boost::asio::io_service::id id;
+
+        timer_wheel_service(boost::asio::io_service &ios);
+
+        timer_wheel &wheel()
+        { return wheel_; }
+
+    private:
+        virtual void shutdown_service();
+
+        timer_wheel wheel_;
+    };
+}   // End of namespace net
+
+#endif /* defined(__coroserver__timer_wheel__) */
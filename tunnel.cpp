@@ -0,0 +1,217 @@
+//
+//  tunnel.cpp
+//  coroserver
+//
+
+#if defined(__linux__)
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+#include <algorithm>
+#include <boost/asio/write.hpp>
+#include "condition_variable.hpp"
+#include "metrics.h"
+#include "tunnel.h"
+
+namespace net {
+    namespace details {
+        typedef boost::asio::ip::tcp::socket socket_t;
+        
+        /**
+         * Sockets of a tunnel, the idle timer closes them through a weak reference as it may fire
+         * after the tunnel is gone
+         */
+        struct tunnel_state_t {
+            tunnel_state_t(socket_t &c, socket_t &u)
+            : client(c)
+            , upstream(u)
+            {}
+            
+            void close() {
+                boost::system::error_code ec;
+                client.close(ec);
+                upstream.close(ec);
+            }
+            
+            socket_t &client;
+            socket_t &upstream;
+        };
+        
+        /**
+         * Pass bytes already read into from's buffer on to the other side
+         */
+        std::size_t flush_buffered(async_tcp_stream &from, async_tcp_stream &to) {
+            char buf[bf_size];
+            std::size_t total=0;
+            std::streamsize n;
+            while (from && to && (n=from.buffered_input())>0) {
+                // Never blocks, the data is in the buffer
+                from.read(buf, std::min<std::streamsize>(n, sizeof(buf)));
+                to.write(buf, from.gcount());
+                total+=from.gcount();
+            }
+            to.flush();
+            return total;
+        }
+        
+        /**
+         * Copy from one socket to another through a user-space buffer
+         *
+         * Returns false on errors, true when from is closed and the closing is passed on
+         */
+        bool copy_pump(socket_t &from,
+                       socket_t &to,
+                       std::size_t &bytes,
+                       wheel_timer &idle,
+                       timeout_t timeout,
+                       boost::asio::yield_context yield)
+        {
+            char buf[bf_size];
+            boost::system::error_code ec;
+            for (;;) {
+                std::size_t n=from.async_read_some(boost::asio::buffer(buf), yield[ec]);
+                if (ec==boost::asio::error::eof) {
+                    to.shutdown(socket_t::shutdown_send, ec);
+                    return true;
+                }
+                if (ec) return false;
+                idle.arm(timeout);
+                boost::asio::async_write(to, boost::asio::buffer(buf, n), yield[ec]);
+                if (ec) return false;
+                bytes+=n;
+                idle.arm(timeout);
+            }
+        }
+        
+#if defined(__linux__)
+        struct pipe_t {
+            pipe_t() {
+                if (::pipe2(fd, O_NONBLOCK | O_CLOEXEC)!=0)
+                    fd[0]=fd[1]=-1;
+            }
+            ~pipe_t() {
+                if (fd[0]>=0) ::close(fd[0]);
+                if (fd[1]>=0) ::close(fd[1]);
+            }
+            int fd[2];
+        };
+        
+        /**
+         * Move bytes from one socket to another with splice() through a pipe, waits for readiness
+         * within the coroutine when the sockets would block
+         *
+         * Returns false on errors, true when from is closed and the closing is passed on
+         */
+        bool pump(socket_t &from,
+                  socket_t &to,
+                  std::size_t &bytes,
+                  wheel_timer &idle,
+                  timeout_t timeout,
+                  boost::asio::yield_context yield)
+        {
+            pipe_t p;
+            if (p.fd[0]<0)
+                return copy_pump(from, to, bytes, idle, timeout, yield);
+            // Pipe capacity on Linux
+            constexpr std::size_t chunk=64*1024;
+            constexpr unsigned flags=SPLICE_F_MOVE | SPLICE_F_NONBLOCK;
+            boost::system::error_code ec;
+            for (;;) {
+                ssize_t n=::splice(from.native_handle(), nullptr, p.fd[1], nullptr, chunk, flags);
+                if (n==0) {
+                    to.shutdown(socket_t::shutdown_send, ec);
+                    return true;
+                }
+                if (n<0) {
+                    if (errno==EINTR) continue;
+                    if (errno!=EAGAIN && errno!=EWOULDBLOCK) return false;
+                    from.async_read_some(boost::asio::null_buffers(), yield[ec]);
+                    if (ec) return false;
+                    continue;
+                }
+                idle.arm(timeout);
+                std::size_t pending=n;
+                while (pending>0) {
+                    ssize_t m=::splice(p.fd[0], nullptr, to.native_handle(), nullptr, pending, flags);
+                    if (m<0) {
+                        if (errno==EINTR) continue;
+                        if (errno!=EAGAIN && errno!=EWOULDBLOCK) return false;
+                        to.async_write_some(boost::asio::null_buffers(), yield[ec]);
+                        if (ec) return false;
+                        continue;
+                    }
+                    pending-=m;
+                    bytes+=m;
+                }
+                idle.arm(timeout);
+            }
+        }
+#else
+        inline bool pump(socket_t &from,
+                         socket_t &to,
+                         std::size_t &bytes,
+                         wheel_timer &idle,
+                         timeout_t timeout,
+                         boost::asio::yield_context yield)
+        { return copy_pump(from, to, bytes, idle, timeout, yield); }
+#endif
+        
+        /**
+         * Add the bytes moved by a finished tunnel to the metrics
+         */
+        void count_bytes(const tunnel_stats_t &stats) {
+            static const metrics::counter upstream=metrics::make_counter("net_tunnel_bytes_total",
+                                                                         "Bytes moved through tunnels",
+                                                                         {{"direction", "upstream"}});
+            static const metrics::counter downstream=metrics::make_counter("net_tunnel_bytes_total",
+                                                                           "Bytes moved through tunnels",
+                                                                           {{"direction", "downstream"}});
+            upstream.inc(stats.upstream_bytes);
+            downstream.inc(stats.downstream_bytes);
+        }
+    }   // End of namespace details
+    
+    tunnel_stats_t tunnel(async_tcp_stream &client, async_tcp_stream &upstream, timeout_t idle_timeout) {
+        tunnel_stats_t stats;
+        stats.upstream_bytes+=details::flush_buffered(client, upstream);
+        stats.downstream_bytes+=details::flush_buffered(upstream, client);
+        
+        details::socket_t &c=client.stream_descriptor();
+        details::socket_t &u=upstream.stream_descriptor();
+        std::shared_ptr<details::tunnel_state_t> state=std::make_shared<details::tunnel_state_t>(c, u);
+        if (!client || !upstream || !c.is_open() || !u.is_open()) {
+            state->close();
+            details::count_bytes(stats);
+            return stats;
+        }
+        
+        // splice() needs the sockets themselves in non-blocking mode
+        boost::system::error_code ec;
+        c.native_non_blocking(true, ec);
+        u.native_non_blocking(true, ec);
+        
+        wheel_timer idle(client.io_service());
+        std::weak_ptr<details::tunnel_state_t> ws(state);
+        idle.callback(client.strand().wrap([ws](){
+            std::shared_ptr<details::tunnel_state_t> s=ws.lock();
+            if (s) s->close();
+        }));
+        idle.arm(idle_timeout);
+        
+        // One direction in a coroutine of its own, the other one here
+        boost::asio::condition_flag done(client.yield_context());
+        client.spawn([&](boost::asio::yield_context yield){
+            if (!details::pump(u, c, stats.downstream_bytes, idle, idle_timeout, yield))
+                state->close();
+            done=true;
+        });
+        if (!details::pump(c, u, stats.upstream_bytes, idle, idle_timeout, client.yield_context()))
+            state->close();
+        done.wait();
+        idle.disarm();
+        state->close();
+        details::count_bytes(stats);
+        return stats;
+    }
+}   // End of namespace net
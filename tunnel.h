@@ -0,0 +1,35 @@
+//
+//  tunnel.h
+//  coroserver
+//
+
+#ifndef __coroserver__tunnel__
+#define __coroserver__tunnel__
+
+#include <cstddef>
+#include "async_stream.h"
+
+namespace net {
+    struct tunnel_stats_t {
+        /**
+         * Bytes moved from the client to the upstream and back
+         */
+        std::size_t upstream_bytes=0;
+        std::size_t downstream_bytes=0;
+    };
+
+    /**
+     * Move bytes between two streams until both directions are closed, an error occurs, or
+     * nothing moves for idle_timeout
+     *
+     * Data buffered in the streams is flushed to the other side first. On Linux the payload is
+     * moved with splice() through a pipe and never enters user space, elsewhere it's copied.
+     * Both streams are closed when the function returns. The bytes moved are added to the
+     * "net_tunnel_bytes_total" counters.
+     *
+     * Must be called within the coroutine the streams are bound to, they must share one strand
+     */
+    tunnel_stats_t tunnel(async_tcp_stream &client, async_tcp_stream &upstream, timeout_t idle_timeout);
+}   // End of namespace net
+
+#endif /* defined(__coroserver__tunnel__) */
@@ -0,0 +1,138 @@
+//
+//  upstream_pool.cpp
+//  coroserver
+//
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include "upstream_pool.h"
+
+namespace net {
+    namespace details {
+        /**
+         * An idle connection is reusable only if the peer hasn't closed it or sent anything
+         */
+        inline bool is_alive(upstream_pool::socket_t &socket) {
+            if (!socket.is_open()) return false;
+            char c;
+            ssize_t n=::recv(socket.native_handle(), &c, 1, MSG_PEEK | MSG_DONTWAIT);
+            return n<0 && (errno==EAGAIN || errno==EWOULDBLOCK);
+        }
+    }   // End of namespace details
+    
+    boost::asio::io_service::id upstream_pool::id;
+    
+    upstream_pool::upstream_pool(boost::asio::io_service &ios)
+    : boost::asio::io_service::service(ios)
+    {}
+    
+    upstream_pool_options_t upstream_pool::options() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return options_;
+    }
+    
+    void upstream_pool::options(const upstream_pool_options_t &opt) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        options_=opt;
+        purge(timer_wheel::now());
+    }
+    
+    std::size_t upstream_pool::size() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return entries_.size();
+    }
+    
+    void upstream_pool::erase(entries_t::iterator i) {
+        auto h=per_host_.find(i->key);
+        if (h!=per_host_.end() && --(h->second)==0)
+            per_host_.erase(h);
+        boost::system::error_code ec;
+        i->socket.close(ec);
+        entries_.erase(i);
+    }
+    
+    void upstream_pool::purge(std::int64_t now) {
+        // Oldest first, stop at the first one still fresh
+        while (!entries_.empty()
+               && (entries_.size()>options_.max_idle
+                   || now-entries_.front().released>=options_.idle_timeout.count()))
+        {
+            erase(entries_.begin());
+        }
+    }
+    
+    bool upstream_pool::acquire(const std::string &key, socket_t &socket) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        purge(timer_wheel::now());
+        if (per_host_.find(key)!=per_host_.end()) {
+            // Most recently released first, it's the least likely to be closed by the peer
+            for (entries_t::iterator i=entries_.end(); i!=entries_.begin(); ) {
+                --i;
+                if (i->key!=key) continue;
+                if (details::is_alive(i->socket)) {
+                    socket=std::move(i->socket);
+                    erase(i);
+                    hits_.fetch_add(1, std::memory_order_relaxed);
+                    return true;
+                }
+                // Closed by the peer, drop it and look for another one
+                entries_t::iterator next=std::next(i);
+                erase(i);
+                if (per_host_.find(key)==per_host_.end()) break;
+                i=next;
+            }
+        }
+        misses_.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    
+    void upstream_pool::release(const std::string &key, socket_t &&socket) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (options_.max_idle==0 || options_.max_per_host==0) return;
+        std::size_t &n=per_host_[key];
+        if (n>=options_.max_per_host) {
+            // Replace the oldest one to the same host
+            for (entries_t::iterator i=entries_.begin(); i!=entries_.end(); ++i) {
+                if (i->key==key) {
+                    boost::system::error_code ec;
+                    i->socket.close(ec);
+                    entries_.erase(i);
+                    n--;
+                    break;
+                }
+            }
+        }
+        std::int64_t now=timer_wheel::now();
+        entries_.emplace_back(key, std::move(socket), now);
+        n++;
+        purge(now);
+    }
+    
+    void upstream_pool::shutdown_service() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        entries_.clear();
+        per_host_.clear();
+    }
+    
+    upstream_connection::upstream_connection(boost::asio::yield_context yield,
+                                             const std::string &endpoint_desc,
+                                             const std::string &default_port)
+    : pool_(upstream_pool::get(yield.handler_.dispatcher_.get_io_service()))
+    , key_(endpoint_desc+'/'+default_port)
+    {
+        upstream_pool::socket_t socket(yield.handler_.dispatcher_.get_io_service());
+        if (pool_.acquire(key_, socket)) {
+            stream_.reset(new async_tcp_stream(std::move(socket), yield));
+            reused_=true;
+        } else {
+            stream_.reset(new async_tcp_stream(yield, endpoint_desc, default_port));
+        }
+    }
+    
+    upstream_connection::~upstream_connection() {
+        // Unread or unsent data means the connection is out of sync with the upstream
+        if (keep_alive_ && stream_->is_open() && stream_->buffered_input()==0 && stream_->buffered_output()==0)
+            pool_.release(key_, stream_->release());
+    }
+}   // End of namespace net
@@ -0,0 +1,157 @@
+//
+//  upstream_pool.h
+//  coroserver
+//
+
+#ifndef __coroserver__upstream_pool__
+#define __coroserver__upstream_pool__
+
+#include <atomic>
+#include <string>
+#include <list>
+#include <mutex>
+#include <memory>
+#include <unordered_map>
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include "async_stream.h"
+
+namespace net {
+    struct upstream_pool_options_t {
+        /**
+         * Max number of idle connections in the pool
+         */
+        std::size_t max_idle=64;
+        /**
+         * Max number of idle connections to one upstream
+         */
+        std::size_t max_per_host=8;
+        /**
+         * Idle connections older than this are closed instead of reused
+         */
+        timeout_t idle_timeout=std::chrono::seconds(30);
+    };
+
+    /**
+     * Idle upstream connections of an io_service, keyed by host and port
+     *
+     * Connections are stored as sockets and wrapped into a new async_tcp_stream on reuse, as
+     * streams are bound to the coroutine created them
+     */
+    class upstream_pool : public boost::asio::io_service::service {
+    public:
+        typedef boost::asio::ip::tcp::socket socket_t;
+
+        static boost::asio::io_service::id id;
+
+        upstream_pool(boost::asio::io_service &ios);
+
+        /**
+         * Pool of the io_service
+         */
+        static upstream_pool &get(boost::asio::io_service &ios)
+        { return boost::asio::use_service<upstream_pool>(ios); }
+
+        upstream_pool_options_t options() const;
+
+        void options(const upstream_pool_options_t &opt);
+
+        /**
+         * Take a live idle connection to the upstream, returns false if there is none
+         */
+        bool acquire(const std::string &key, socket_t &socket);
+
+        /**
+         * Put a connection back, nothing should be pending on it
+         */
+        void release(const std::string &key, socket_t &&socket);
+
+        /**
+         * Number of idle connections
+         */
+        std::size_t size() const;
+
+        /**
+         * Number of connections reused and connections made
+         */
+        std::size_t hits() const
+        { return hits_.load(std::memory_order_relaxed); }
+
+        std::size_t misses() const
+        { return misses_.load(std::memory_order_relaxed); }
+
+    private:
+        struct entry_t {
+            entry_t(const std::string &k, socket_t &&s, std::int64_t t)
+            : key(k)
+            , socket(std::move(s))
+            , released(t)
+            {}
+            std::string key;
+            socket_t socket;
+            std::int64_t released;
+        };
+        typedef std::list<entry_t> entries_t;
+
+        virtual void shutdown_service();
+
+        void erase(entries_t::iterator i);
+        void purge(std::int64_t now);
+
+        mutable std::mutex mutex_;
+        upstream_pool_options_t options_;
+        // Least recently released first
+        entries_t entries_;
+        std::unordered_map<std::string, std::size_t> per_host_;
+        std::atomic<std::size_t> hits_{0};
+        std::atomic<std::size_t> misses_{0};
+    };
+
+    /**
+     * Connection to an upstream, taken from the pool of the coroutine's io_service or connected
+     * when there is none
+     *
+     * The connection goes back to the pool on destruction if it's marked keep-alive, which should
+     * be done after the response has been fully read
+     */
+    class upstream_connection {
+    public:
+        /**
+         * @param endpoint_desc host with optional port, i.e. "www.example.com:8080"
+         * @param default_port port or service name used if endpoint_desc has no port
+         */
+        upstream_connection(boost::asio::yield_context yield,
+                            const std::string &endpoint_desc,
+                            const std::string &default_port);
+
+        // Non-copyable
+        upstream_connection(const upstream_connection&) = delete;
+        upstream_connection& operator=(const upstream_connection&) = delete;
+
+        ~upstream_connection();
+
+        async_tcp_stream &stream()
+        { return *stream_; }
+
+        /**
+         * True if the connection came from the pool
+         */
+        bool reused() const
+        { return reused_; }
+
+        bool keep_alive() const
+        { return keep_alive_; }
+
+        void keep_alive(bool v)
+        { keep_alive_=v; }
+
+    private:
+        upstream_pool &pool_;
+        std::string key_;
+        std::unique_ptr<async_tcp_stream> stream_;
+        bool reused_=false;
+        bool keep_alive_=false;
+    };
+}   // End of namespace net
+
+#endif /* defined(__coroserver__upstream_pool__) */